@@ -0,0 +1,46 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The time to collect a large number of changes from the walk of a work tree, where every
+// worker is finding changes at once.  Every tracked file is modified and a new file is added next
+// to each one, so the status has twice as many entries as there are files in the index.
+//
+// Run with `cargo bench --bench changes`.
+mod common;
+
+use common::{measure, synthetic_paths, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use std::fs::OpenOptions;
+use std::io::Write;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let entries = 60_000;
+    let paths = synthetic_paths(entries, 12);
+    synthetic_work_tree(&temp_dir, &paths);
+    for path in &paths {
+        let full_path = temp_dir.join(path);
+        let mut file = OpenOptions::new().append(true).open(&full_path).unwrap();
+        file.write_all(b"a modification\n").unwrap();
+        std::fs::write(full_path.with_extension("new"), "").unwrap();
+    }
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let name = format!("{} changed files", entries * 2);
+    measure(&name, 5, || {
+        let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(work_tree.entries.len(), entries * 2);
+        work_tree
+    });
+}
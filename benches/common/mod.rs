@@ -0,0 +1,245 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// Shared helpers for the benchmarks.
+//
+// The benchmarks use a plain `main` (`harness = false`) so they run on stable without pulling in
+// a benchmarking framework.  Each one prints the best wall time out of a few runs along with the
+// allocation counts gathered by `CountingAllocator`.
+#![allow(dead_code)]
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::fs;
+use std::path::Path;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant, SystemTime};
+use win_git_status::hash::blob_oid;
+
+/// A global allocator which keeps track of the number of allocations and the peak heap usage.
+pub struct CountingAllocator;
+
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+static CURRENT_BYTES: AtomicUsize = AtomicUsize::new(0);
+static PEAK_BYTES: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        let current = CURRENT_BYTES.fetch_add(layout.size(), Ordering::Relaxed) + layout.size();
+        PEAK_BYTES.fetch_max(current, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        CURRENT_BYTES.fetch_sub(layout.size(), Ordering::Relaxed);
+        System.dealloc(ptr, layout)
+    }
+}
+
+/// Allocation statistics for one measured run.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct AllocStats {
+    pub allocations: usize,
+    pub peak_bytes: usize,
+}
+
+fn reset_alloc_stats() {
+    ALLOCATIONS.store(0, Ordering::Relaxed);
+    PEAK_BYTES.store(CURRENT_BYTES.load(Ordering::Relaxed), Ordering::Relaxed);
+}
+
+fn alloc_stats(baseline_bytes: usize) -> AllocStats {
+    AllocStats {
+        allocations: ALLOCATIONS.load(Ordering::Relaxed),
+        peak_bytes: PEAK_BYTES.load(Ordering::Relaxed) - baseline_bytes,
+    }
+}
+
+/// Runs `f` `runs` times and reports the fastest run and the allocations of the last run.
+pub fn measure<T, F: FnMut() -> T>(name: &str, runs: usize, mut f: F) -> (Duration, AllocStats) {
+    let mut best = Duration::MAX;
+    let mut stats = AllocStats::default();
+    for _ in 0..runs {
+        let baseline_bytes = CURRENT_BYTES.load(Ordering::Relaxed);
+        reset_alloc_stats();
+        let start = Instant::now();
+        let result = f();
+        let elapsed = start.elapsed();
+        stats = alloc_stats(baseline_bytes);
+        drop(result);
+        best = best.min(elapsed);
+    }
+    println!(
+        "{:<40} {:>10.3} ms {:>10} allocations {:>10} KiB peak heap",
+        name,
+        best.as_secs_f64() * 1000.0,
+        stats.allocations,
+        stats.peak_bytes / 1024
+    );
+    (best, stats)
+}
+
+/// The process' peak resident set size in KiB, where the platform makes it cheap to find out.
+pub fn peak_rss_kib() -> Option<u64> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    line.split_whitespace().nth(1)?.parse().ok()
+}
+
+/// The repo relative paths used for the synthetic index.  Paths are spread over a two level
+/// directory tree and are returned in git's index order.
+pub fn synthetic_paths(entries: usize, files_per_dir: usize) -> Vec<String> {
+    let dirs = (entries + files_per_dir - 1) / files_per_dir;
+    let mut paths = Vec::with_capacity(entries);
+    for dir in 0..dirs {
+        for file in 0..files_per_dir.min(entries - dir * files_per_dir) {
+            paths.push(format!(
+                "dir_{:04}/sub_{:04}/file_{:06}.txt",
+                dir / 16,
+                dir,
+                file
+            ));
+        }
+    }
+    paths.sort();
+    paths
+}
+
+/// Like `synthetic_paths()`, but every other file is moved up next to the directory it was in.
+/// The files of a directory are then interleaved with the files of its subdirectories in index
+/// order, "sub_0000/file_000000.txt" comes before "sub_0000_file_000001.txt".
+pub fn interleaved_paths(entries: usize, files_per_dir: usize) -> Vec<String> {
+    let mut paths: Vec<String> = synthetic_paths(entries, files_per_dir)
+        .into_iter()
+        .enumerate()
+        .map(|(number, path)| match number % 2 {
+            0 => path,
+            _ => path.replacen("/file_", "_file_", 1),
+        })
+        .collect();
+    paths.sort();
+    paths
+}
+
+/// Builds an index file for `paths`, `version` is 2 or 4.  The stat data is made up, only the
+/// layout matters.
+pub fn synthetic_index(paths: &[String], version: u32) -> Vec<u8> {
+    let mut stream: Vec<u8> = vec![];
+    stream.extend(b"DIRC");
+    stream.extend(&version.to_be_bytes());
+    stream.extend(&(paths.len() as u32).to_be_bytes());
+    let mut previous: &str = "";
+    for (number, path) in paths.iter().enumerate() {
+        // ctime, mtime, dev, ino
+        stream.extend(&[0u8; 8]);
+        stream.extend(&(number as u32).to_be_bytes());
+        stream.extend(&[0u8; 12]);
+        // mode
+        stream.extend(&0o100644u32.to_be_bytes());
+        // uid, gid
+        stream.extend(&[0u8; 8]);
+        stream.extend(&(path.len() as u32).to_be_bytes());
+        stream.extend(&[0xab; 20]);
+        stream.extend(&(path.len() as u16).to_be_bytes());
+        if version == 4 {
+            let common = previous
+                .bytes()
+                .zip(path.bytes())
+                .take_while(|(a, b)| a == b)
+                .count();
+            stream.extend(varint(previous.len() - common));
+            stream.extend(&path.as_bytes()[common..]);
+            stream.push(0);
+            previous = path;
+        } else {
+            stream.extend(path.as_bytes());
+            let pad_length = 8 - ((62 + path.len()) % 8);
+            stream.extend(vec![0; pad_length]);
+        }
+    }
+    // A made up checksum, all zeros would mean the index was written without one
+    stream.extend(&[0x5a; 20]);
+    stream
+}
+
+// The variable width integer git uses for the version 4 prefix lengths.
+fn varint(mut value: usize) -> Vec<u8> {
+    let mut bytes = vec![(value & 0x7f) as u8];
+    value >>= 7;
+    while value != 0 {
+        value -= 1;
+        bytes.insert(0, 0x80 | (value & 0x7f) as u8);
+        value >>= 7;
+    }
+    bytes
+}
+
+/// Writes a file for each of `paths` under `root`, a repo, along with an index of the files with
+/// their actual stat data and object ids.  A status of `root` finds nothing changed.
+pub fn synthetic_work_tree(root: &Path, paths: &[String]) {
+    let mut stream: Vec<u8> = vec![];
+    stream.extend(b"DIRC");
+    stream.extend(&2u32.to_be_bytes());
+    stream.extend(&(paths.len() as u32).to_be_bytes());
+    for path in paths {
+        let full_path = root.join(path);
+        fs::create_dir_all(full_path.parent().unwrap()).unwrap();
+        let contents = format!("The contents of {}\n", path);
+        fs::write(&full_path, &contents).unwrap();
+        let metadata = fs::symlink_metadata(&full_path).unwrap();
+        for value in &stat_fields(&metadata) {
+            stream.extend(&value.to_be_bytes());
+        }
+        stream.extend(&blob_oid(contents.as_bytes()));
+        stream.extend(&(path.len() as u16).to_be_bytes());
+        stream.extend(path.as_bytes());
+        let pad_length = 8 - ((62 + path.len()) % 8);
+        stream.extend(vec![0; pad_length]);
+    }
+    stream.extend(&[0x5a; 20]);
+    let index_path = root.join(".git/index");
+    fs::write(&index_path, stream).unwrap();
+
+    // Dated after the files, so none of them are racily clean
+    let index = fs::OpenOptions::new()
+        .write(true)
+        .open(&index_path)
+        .unwrap();
+    index
+        .set_modified(SystemTime::now() + Duration::from_secs(60))
+        .unwrap();
+}
+
+// The stat data of an index entry, ctime through the file size
+#[cfg(unix)]
+fn stat_fields(metadata: &fs::Metadata) -> [u32; 10] {
+    use std::os::unix::fs::MetadataExt;
+    [
+        metadata.ctime() as u32,
+        metadata.ctime_nsec() as u32,
+        metadata.mtime() as u32,
+        metadata.mtime_nsec() as u32,
+        metadata.dev() as u32,
+        metadata.ino() as u32,
+        0o100644,
+        metadata.uid(),
+        metadata.gid(),
+        metadata.size() as u32,
+    ]
+}
+
+#[cfg(not(unix))]
+fn stat_fields(metadata: &fs::Metadata) -> [u32; 10] {
+    let mtime = metadata
+        .modified()
+        .unwrap()
+        .duration_since(std::time::UNIX_EPOCH)
+        .unwrap();
+    let (seconds, nanoseconds) = (mtime.as_secs() as u32, mtime.subsec_nanos());
+    let size = metadata.len() as u32;
+    [0, 0, seconds, nanoseconds, 0, 0, 0o100644, 0, 0, size]
+}
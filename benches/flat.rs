@@ -0,0 +1,50 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The status of a work tree which is one flat directory of 500,000 tracked files, like a
+// directory of generated code.  A directory this large is stat'ed and compared in chunks spread
+// over the thread pool rather than by one task.  The untracked files modes are measured as well,
+// `--untracked-files=no` stats the index entries without listing the directory.
+//
+// Run with `cargo bench --bench flat`.
+mod common;
+
+use common::{measure, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use std::fs;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, UntrackedFiles, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let paths: Vec<String> = (0..500_000)
+        .map(|number| format!("flat/file_{:06}.txt", number))
+        .collect();
+    synthetic_work_tree(&temp_dir, &paths);
+    fs::write(temp_dir.join("flat/untracked.txt"), "").unwrap();
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let modes = [
+        ("normal", UntrackedFiles::Normal, 1),
+        ("no", UntrackedFiles::No, 0),
+    ];
+    for (mode, untracked_files, expected) in modes {
+        let name = format!("500,000 files, --untracked-files={}", mode);
+        measure(&name, 3, || {
+            let work_tree =
+                WorkTree::diff_against_index_with_untracked(&temp_dir, &index, untracked_files)
+                    .unwrap();
+            assert_eq!(work_tree.entries.len(), expected);
+            work_tree
+        });
+    }
+}
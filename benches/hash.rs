@@ -0,0 +1,96 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// Blob hashing throughput in GB/s, for data already in memory and for a corpus of many small
+// files and one of a few large files.  The file corpora are hashed one file after another on
+// the calling thread and spread over the hashing pool.
+//
+// Run with `cargo bench --bench hash`.
+mod common;
+
+use common::{measure, CountingAllocator};
+use std::fs;
+use std::path::PathBuf;
+use std::time::Duration;
+use temp_testdir::TempDir;
+use win_git_status::hash::{blob_oid, file_blob_oid, is_accelerated, BlobHasher};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+// Contents which don't compress or repeat, so nothing along the way can shortcut them
+fn contents(size: usize, seed: usize) -> Vec<u8> {
+    let mut state = (seed as u64 + 1).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    (0..size)
+        .map(|_| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state as u8
+        })
+        .collect()
+}
+
+fn report(name: &str, bytes: usize, (time, _): (Duration, common::AllocStats)) {
+    println!(
+        "{:<40} {:>10.3} GB/s",
+        name,
+        bytes as f64 / time.as_secs_f64() / 1e9
+    );
+}
+
+fn hash_corpus(name: &str, files: &[PathBuf], bytes: usize) {
+    let single = measure(&format!("{} one thread", name), 5, || {
+        for file in files {
+            file_blob_oid(file).unwrap();
+        }
+    });
+    report(&format!("{} one thread", name), bytes, single);
+    let pooled = measure(&format!("{} hashing pool", name), 5, || {
+        let hasher = BlobHasher::default();
+        for file in files {
+            let file = file.clone();
+            hasher.spawn(move || {
+                file_blob_oid(&file).unwrap();
+            });
+        }
+        hasher.wait();
+    });
+    report(&format!("{} hashing pool", name), bytes, pooled);
+}
+
+fn main() {
+    println!("SHA extensions used: {}", is_accelerated());
+    for &size in &[1024, 64 * 1024, 64 * 1024 * 1024] {
+        let data = contents(size, 0);
+        let name = format!("in memory {} KiB", size / 1024);
+        let time = measure(&name, 5, || blob_oid(&data));
+        report(&name, size, time);
+    }
+
+    // Sizes like those of source files, 256 bytes up to 16 KiB
+    let temp_dir = TempDir::default();
+    let mut small = vec![];
+    let mut small_bytes = 0;
+    for number in 0..10_000 {
+        let size = 256 << (number % 7);
+        let path = temp_dir.join(format!("small_{}", number));
+        fs::write(&path, contents(size, number)).unwrap();
+        small.push(path);
+        small_bytes += size;
+    }
+    hash_corpus("10000 small files", &small, small_bytes);
+
+    let mut large = vec![];
+    let large_size = 64 * 1024 * 1024;
+    for number in 0..4 {
+        let path = temp_dir.join(format!("large_{}", number));
+        fs::write(&path, contents(large_size, number)).unwrap();
+        large.push(path);
+    }
+    hash_corpus("4 large files", &large, 4 * large_size);
+}
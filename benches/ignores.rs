@@ -0,0 +1,102 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The time to match untracked files against deeply nested ignore files.  Each of 128 top level
+// directories is the start of a chain 8 directories deep, every directory of the chain has a
+// tracked file, an ignore file of its own, and untracked files which the rules of the different
+// levels ignore or add back.  Next to each is an untracked directory holding only ignored files.
+// The same tree is then measured with the ignore files tracked and nothing untracked, where the
+// ignore files never need to be read.
+//
+// Run with `cargo bench --bench ignores`.
+mod common;
+
+use common::{measure, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use std::fs;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+const TOP_LEVEL: usize = 128;
+const DEPTH: usize = 8;
+
+fn main() {
+    let mut directories = vec![];
+    for top in 0..TOP_LEVEL {
+        let mut directory = format!("dir_{:03}", top);
+        for level in 0..DEPTH {
+            directories.push((directory.clone(), level));
+            directory = format!("{}/level_{}", directory, level);
+        }
+    }
+    untracked_files(&directories);
+    tracked_only(&directories);
+}
+
+fn untracked_files(directories: &[(String, usize)]) {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let mut paths: Vec<String> = directories
+        .iter()
+        .map(|(directory, _)| format!("{}/file.txt", directory))
+        .collect();
+    paths.sort();
+    synthetic_work_tree(&temp_dir, &paths);
+
+    fs::write(temp_dir.join(".gitignore"), ".gitignore\n*.o\n").unwrap();
+    for (directory, level) in directories {
+        let directory = temp_dir.join(directory);
+        let rules = format!("!keep_{0}.o\n/build_{0}/\n*.tmp{0}\n", level);
+        fs::write(directory.join(".gitignore"), rules).unwrap();
+        for name in &["a.o", "notes.md"] {
+            fs::write(directory.join(name), "").unwrap();
+        }
+        fs::write(directory.join(format!("keep_{}.o", level)), "").unwrap();
+        fs::write(directory.join(format!("x.tmp{}", level)), "").unwrap();
+        let build = directory.join(format!("build_{}", level));
+        let scratch = directory.join("scratch");
+        for untracked in &[build, scratch] {
+            fs::create_dir(untracked).unwrap();
+            for number in 0..4 {
+                fs::write(untracked.join(format!("{}.o", number)), "").unwrap();
+            }
+        }
+    }
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let name = format!("{} nested ignore files", directories.len());
+    measure(&name, 5, || {
+        let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(work_tree.entries.len(), directories.len() * 2);
+        work_tree
+    });
+}
+
+fn tracked_only(directories: &[(String, usize)]) {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let mut paths = vec![];
+    for (directory, _) in directories {
+        paths.push(format!("{}/file.txt", directory));
+        paths.push(format!("{}/.gitignore", directory));
+    }
+    paths.sort();
+    synthetic_work_tree(&temp_dir, &paths);
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let name = format!("{} tracked ignore files", directories.len());
+    measure(&name, 5, || {
+        let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert!(work_tree.entries.is_empty());
+        work_tree
+    });
+}
@@ -0,0 +1,101 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// Index load time, allocations, and peak memory for synthetic version 2 and version 4 indices
+// of increasing size, along with the time to look up the entries of every directory.  An index
+// with the files of directories interleaved with their subdirectories is also loaded, those
+// entries have to be moved to group them by directory.  Loading through the index cache is
+// measured both cold, when the cache has to be written, and warm.
+//
+// Run with `cargo bench --bench index`.
+mod common;
+
+use common::{
+    interleaved_paths, measure, peak_rss_kib, synthetic_index, synthetic_paths, CountingAllocator,
+};
+use std::fs;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    for &entries in &[10_000, 100_000, 500_000] {
+        let paths = synthetic_paths(entries, 50);
+        for &version in &[2, 4] {
+            let index_path = temp_dir.join(format!("index_v{}_{}", version, entries));
+            let contents = synthetic_index(&paths, version);
+            println!(
+                "version {} index of {} entries is {} KiB",
+                version,
+                entries,
+                contents.len() / 1024
+            );
+            fs::write(&index_path, contents).unwrap();
+
+            let name = format!("v{} mapped load {} entries", version, entries);
+            measure(&name, 5, || {
+                let file = IndexFile::open(&index_path).unwrap();
+                let count = Index::new(&file).unwrap().entries.len();
+                (file, count)
+            });
+            let name = format!("v{} read load {} entries", version, entries);
+            measure(&name, 5, || {
+                let file = IndexFile::read(&index_path).unwrap();
+                let count = Index::new(&file).unwrap().entries.len();
+                (file, count)
+            });
+
+            // Cold runs parse the index and write the cache, warm runs load from the cache
+            let cache_path = temp_dir.join(format!("index_v{}_{}.cache", version, entries));
+            let name = format!("v{} cold cache load {} entries", version, entries);
+            measure(&name, 5, || {
+                let _ = fs::remove_file(&cache_path);
+                let file = IndexFile::open_cached(&index_path, &cache_path).unwrap();
+                let count = Index::new(&file).unwrap().entries.len();
+                (file, count)
+            });
+            let name = format!("v{} warm cache load {} entries", version, entries);
+            measure(&name, 5, || {
+                let file = IndexFile::open_cached(&index_path, &cache_path).unwrap();
+                let count = Index::new(&file).unwrap().entries.len();
+                (file, count)
+            });
+
+            // Every directory is looked up the way the work tree walk does
+            let file = IndexFile::open(&index_path).unwrap();
+            let index = Index::new(&file).unwrap();
+            let directories: Vec<String> = index.entries.keys().map(String::from).collect();
+            let name = format!("v{} directory lookups {} entries", version, entries);
+            measure(&name, 5, || {
+                directories
+                    .iter()
+                    .map(|d| index.entries.get(d.as_str()).unwrap().iter().count())
+                    .sum::<usize>()
+            });
+        }
+
+        // Files and subdirectories interleaved, so the entries need to be grouped by directory
+        let index_path = temp_dir.join(format!("index_interleaved_{}", entries));
+        fs::write(
+            &index_path,
+            synthetic_index(&interleaved_paths(entries, 50), 2),
+        )
+        .unwrap();
+        let name = format!("v2 interleaved load {} entries", entries);
+        measure(&name, 5, || {
+            let file = IndexFile::open(&index_path).unwrap();
+            let count = Index::new(&file).unwrap().entries.len();
+            (file, count)
+        });
+    }
+    if let Some(peak) = peak_rss_kib() {
+        println!("peak RSS {} KiB", peak);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The time of a status limited to one project of a monorepo.  The work tree is the 120,000 file
+// tree of the worktree bench, 625 top level directories of 192 files each.  The work tree and
+// the index, which has no commit to compare against so every entry is new, are measured in full
+// and then limited to a single top level directory, by name and by a glob.  Last the status is
+// limited to a path which doesn't exist, which is the fixed cost of a status.
+//
+// Run with `cargo bench --bench pathspec`.
+mod common;
+
+use common::{measure, synthetic_paths, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, Pathspec, TreeDiff, UntrackedFiles, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    let repo = Repository::init(&temp_dir).unwrap();
+    let entries = 120_000;
+    let paths = synthetic_paths(entries, 12);
+    synthetic_work_tree(&temp_dir, &paths);
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let cases: [(&str, Option<&str>, usize); 4] = [
+        ("whole work tree", None, entries),
+        ("one project by name", Some("dir_0312"), 192),
+        ("one project by glob", Some("dir_0312/*.txt"), 192),
+        ("nothing matched", Some("missing"), 0),
+    ];
+    for (name, spec, staged) in cases {
+        let pathspec = spec.map(|spec| Pathspec::new("", &[spec]).unwrap());
+        let pathspec = pathspec.as_ref();
+        measure(&format!("work tree, {}", name), 5, || {
+            let normal = UntrackedFiles::Normal;
+            let work_tree =
+                WorkTree::diff_against_index_with_pathspec(&temp_dir, &index, normal, pathspec)
+                    .unwrap();
+            assert!(work_tree.entries.is_empty());
+            work_tree
+        });
+        measure(&format!("index, {}", name), 5, || {
+            let diff = TreeDiff::diff_against_index_with_pathspec(&repo, &index, pathspec);
+            assert_eq!(diff.entries.len(), staged);
+            diff
+        });
+    }
+}
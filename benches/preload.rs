@@ -0,0 +1,52 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The status of the tracked files only, `--untracked-files=no`, with the walk of the directories
+// and with the preload which stats the index entries in chunks.  The work trees range from 1,000
+// files to 100,000, with 2 to 256 files in a directory, to find where one overtakes the other.
+// Smaller indexes, which fit in a single chunk of the preload, always get the walk.
+//
+// Run with `cargo bench --bench preload`.
+mod common;
+
+use common::{measure, synthetic_paths, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, UntrackedFiles, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    for entries in [1_000, 10_000, 100_000] {
+        for files_per_dir in [2, 16, 256] {
+            let temp_dir = TempDir::default();
+            let repo = Repository::init(&temp_dir).unwrap();
+            let paths = synthetic_paths(entries, files_per_dir);
+            synthetic_work_tree(&temp_dir, &paths);
+            let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+            let index = Index::new(&index_file).unwrap();
+
+            let mut config = repo.config().unwrap();
+            for (engine, preload) in [("walk", false), ("preload", true)] {
+                config.set_bool("core.preloadIndex", preload).unwrap();
+                let name = format!("{} files, {} per dir, {}", entries, files_per_dir, engine);
+                let runs = if entries >= 100_000 { 3 } else { 10 };
+                measure(&name, runs, || {
+                    let work_tree = WorkTree::diff_against_index_with_untracked(
+                        &temp_dir,
+                        &index,
+                        UntrackedFiles::No,
+                    )
+                    .unwrap();
+                    assert!(work_tree.entries.is_empty());
+                    work_tree
+                });
+            }
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The time to decide whether a large untracked directory is shown.  Next to a small tracked tree
+// is an untracked build directory, 64 directories of 16 directories of 60 object files each,
+// around 60,000 files which the root ignore file ignores.  The same tree is then measured with a
+// single file at the top of the build directory which isn't ignored, and last with each of the
+// `--untracked-files` modes, where `all` walks the whole of the build directory.
+//
+// Run with `cargo bench --bench untracked`.
+mod common;
+
+use common::{measure, synthetic_paths, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use std::fs;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, UntrackedFiles, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let paths = synthetic_paths(1_000, 12);
+    synthetic_work_tree(&temp_dir, &paths);
+
+    // The ignore file ignores itself so it doesn't show up as untracked
+    fs::write(temp_dir.join(".gitignore"), "*.o\n.gitignore\n").unwrap();
+    let build = temp_dir.join("build");
+    for outer in 0..64 {
+        for inner in 0..16 {
+            let directory = build.join(format!("dir_{:02}/sub_{:02}", outer, inner));
+            fs::create_dir_all(&directory).unwrap();
+            for number in 0..60 {
+                fs::write(directory.join(format!("{}.o", number)), "").unwrap();
+            }
+        }
+    }
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let run = |name: &str, expected: usize| {
+        measure(name, 5, || {
+            let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+            assert_eq!(work_tree.entries.len(), expected);
+            work_tree
+        });
+    };
+    run("ignored untracked directory", 0);
+
+    fs::write(build.join("notes.md"), "").unwrap();
+    run("one trackable file at the top of the directory", 1);
+
+    let modes = [
+        ("no", UntrackedFiles::No, 0),
+        ("normal", UntrackedFiles::Normal, 1),
+        ("all", UntrackedFiles::All, 1),
+    ];
+    for (mode, untracked_files, expected) in modes {
+        let name = format!("--untracked-files={}", mode);
+        measure(&name, 5, || {
+            let work_tree =
+                WorkTree::diff_against_index_with_untracked(&temp_dir, &index, untracked_files)
+                    .unwrap();
+            assert_eq!(work_tree.entries.len(), expected);
+            work_tree
+        });
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The time to compare a work tree with its index.  The work tree is made to look like an
+// llvm-project checkout, around 120,000 files with about a dozen per directory, and is
+// unchanged so every file is read and stat'ed but none are hashed.  The same work tree is then
+// measured with an ignored build output next to every file, and again with
+// `--untracked-files=no`, which stats the tracked files without listing any directories.
+//
+// Run with `cargo bench --bench worktree`.
+mod common;
+
+use common::{measure, peak_rss_kib, synthetic_paths, synthetic_work_tree, CountingAllocator};
+use git2::Repository;
+use std::fs;
+use temp_testdir::TempDir;
+use win_git_status::{Index, IndexFile, UntrackedFiles, WorkTree};
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+fn main() {
+    let temp_dir = TempDir::default();
+    Repository::init(&temp_dir).unwrap();
+    let entries = 120_000;
+    let paths = synthetic_paths(entries, 12);
+    synthetic_work_tree(&temp_dir, &paths);
+
+    let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+    let index = Index::new(&index_file).unwrap();
+    let name = format!("unchanged work tree {} files", entries);
+    measure(&name, 5, || {
+        let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert!(work_tree.entries.is_empty());
+        work_tree
+    });
+
+    // The ignore file ignores itself so it doesn't show up as untracked
+    fs::write(temp_dir.join(".gitignore"), "*.o\n.gitignore\n").unwrap();
+    for path in &paths {
+        fs::write(temp_dir.join(path.replace(".txt", ".o")), "").unwrap();
+    }
+    let name = format!("with {} ignored build outputs", entries);
+    measure(&name, 5, || {
+        let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert!(work_tree.entries.is_empty());
+        work_tree
+    });
+    measure("--untracked-files=no", 5, || {
+        let work_tree =
+            WorkTree::diff_against_index_with_untracked(&temp_dir, &index, UntrackedFiles::No)
+                .unwrap();
+        assert!(work_tree.entries.is_empty());
+        work_tree
+    });
+    if let Some(peak) = peak_rss_kib() {
+        println!("peak RSS {} KiB", peak);
+    }
+}
@@ -0,0 +1,204 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::index_refresh::RefreshedEntry;
+use crate::status::StatusEntry;
+use std::iter::Peekable;
+use std::mem;
+use std::sync::{Arc, Mutex};
+
+/// The changes found in one directory of the work tree.
+#[derive(Debug, Default)]
+pub struct Run {
+    /// Sorted by name once the directory is done.
+    pub changed: Vec<StatusEntry>,
+    pub refreshed: Vec<RefreshedEntry>,
+}
+
+impl Run {
+    fn is_empty(&self) -> bool {
+        self.changed.is_empty() && self.refreshed.is_empty()
+    }
+}
+
+/// Collects the changes found by the tasks of a walk of the work tree.
+///
+/// Each directory gathers its changes into a run of its own, a `DirectoryChanges`, which is only
+/// added here, sorted, once everything in the directory is done.  The lock is taken once per
+/// directory rather than for every change, the workers don't contend for it even when most files
+/// changed.
+#[derive(Debug, Clone, Default)]
+pub struct Changes {
+    // The runs along with the work tree relative path of their directory, ending in "/"
+    runs: Arc<Mutex<Vec<(String, Run)>>>,
+}
+
+impl Changes {
+    fn add(&self, prefix: String, run: Run) {
+        if !run.is_empty() {
+            self.runs.lock().unwrap().push((prefix, run));
+        }
+    }
+
+    /// Takes the changes out once every directory is done.  The changes are in git's path order,
+    /// the already sorted runs are merged rather than sorting all of the changes again.
+    pub fn take(&self) -> Run {
+        let mut runs = mem::take(&mut *self.runs.lock().unwrap());
+        let mut all = Run {
+            changed: Vec::with_capacity(runs.iter().map(|r| r.1.changed.len()).sum()),
+            refreshed: Vec::with_capacity(runs.iter().map(|r| r.1.refreshed.len()).sum()),
+        };
+        for (_, run) in runs.iter_mut() {
+            all.refreshed.append(&mut run.refreshed);
+        }
+        // Sorted by path the runs of a directory's subdirectories come right after it
+        runs.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+        let mut runs = runs
+            .into_iter()
+            .map(|(prefix, run)| (prefix, run.changed))
+            .peekable();
+        merge_runs(&mut runs, "", vec![], &mut all.changed);
+        all
+    }
+}
+
+// Merges the run of the directory `prefix`, `own`, with the runs of the directories below it,
+// the next of `runs`.  The changes of a subdirectory all start with its path, so they go in as
+// one block between the directory's own changes.
+fn merge_runs<I: Iterator<Item = (String, Vec<StatusEntry>)>>(
+    runs: &mut Peekable<I>,
+    prefix: &str,
+    own: Vec<StatusEntry>,
+    merged: &mut Vec<StatusEntry>,
+) {
+    let mut own = own.into_iter().peekable();
+    while let Some((subdirectory, changes)) = runs.next_if(|r| r.0.starts_with(prefix)) {
+        while let Some(entry) = own.next_if(|e| e.name <= subdirectory) {
+            merged.push(entry);
+        }
+        merge_runs(runs, &subdirectory, changes, merged);
+    }
+    merged.extend(own);
+}
+
+/// The changes of one directory, shared by the tasks working on the directory.  The changes are
+/// sorted and added to the `Changes` of the walk when the last task lets go of them.
+#[derive(Debug)]
+pub struct DirectoryChanges {
+    run: Mutex<Run>,
+    changes: Changes,
+    // The work tree relative path of the directory, ending in "/" unless it's the root
+    prefix: String,
+}
+
+impl DirectoryChanges {
+    /// The changes of the work tree relative `directory`.
+    pub fn new(changes: &Changes, directory: &str) -> DirectoryChanges {
+        let prefix = match directory {
+            "" => String::new(),
+            directory => format!("{}/", directory),
+        };
+        DirectoryChanges {
+            run: Mutex::new(Run::default()),
+            changes: changes.clone(),
+            prefix,
+        }
+    }
+
+    /// Adds a change to the directory.
+    pub fn push(&self, entry: StatusEntry) {
+        self.run.lock().unwrap().changed.push(entry);
+    }
+
+    /// Adds all of `entries` to the directory.
+    pub fn append(&self, entries: &mut Vec<StatusEntry>) {
+        self.run.lock().unwrap().changed.append(entries);
+    }
+
+    /// Adds a file which was hashed and found to be unchanged.
+    pub fn push_refreshed(&self, entry: RefreshedEntry) {
+        self.run.lock().unwrap().refreshed.push(entry);
+    }
+}
+
+impl Drop for DirectoryChanges {
+    fn drop(&mut self) {
+        let mut run = mem::take(self.run.get_mut().unwrap_or_else(|e| e.into_inner()));
+        // The changes of the directory's own listing are already in order, only those of its
+        // hashing and submodule jobs are out of place, which the sort is quick to fix
+        run.changed.sort_by(|a, b| a.name.cmp(&b.name));
+        self.changes.add(mem::take(&mut self.prefix), run);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::status::Status;
+
+    fn new_file(name: &str) -> StatusEntry {
+        StatusEntry {
+            name: name.to_string(),
+            state: Status::New,
+        }
+    }
+
+    fn names(run: Run) -> Vec<String> {
+        run.changed.into_iter().map(|e| e.name).collect()
+    }
+
+    #[test]
+    fn test_directory_changes_added_when_dropped() {
+        let changes = Changes::default();
+        let directory = Arc::new(DirectoryChanges::new(&changes, ""));
+        directory.append(&mut vec![new_file("b"), new_file("c")]);
+        let task = Arc::clone(&directory);
+        drop(directory);
+        assert!(changes.runs.lock().unwrap().is_empty());
+
+        task.push(new_file("a"));
+        drop(task);
+        assert_eq!(names(changes.take()), ["a", "b", "c"]);
+        assert!(changes.take().changed.is_empty());
+    }
+
+    #[test]
+    fn test_runs_merged_in_path_order() {
+        let changes = Changes::default();
+        let runs: [(&str, &[&str]); 5] = [
+            ("dir/sub", &["dir/sub/a", "dir/sub/z"]),
+            ("", &["dir-a", "dir0", "top"]),
+            (
+                "dir",
+                &["dir/sub-a", "dir/sub.txt", "dir/sub0", "dir/untracked/"],
+            ),
+            ("empty", &[]),
+            ("other/deep", &["other/deep/a"]),
+        ];
+        for (directory, entries) in runs.iter() {
+            let directory = DirectoryChanges::new(&changes, directory);
+            for entry in entries.iter() {
+                directory.push(new_file(entry));
+            }
+        }
+        assert_eq!(
+            names(changes.take()),
+            [
+                "dir-a",
+                "dir/sub-a",
+                "dir/sub.txt",
+                "dir/sub/a",
+                "dir/sub/z",
+                "dir/sub0",
+                "dir/untracked/",
+                "dir0",
+                "other/deep/a",
+                "top"
+            ]
+        );
+    }
+}
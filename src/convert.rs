@@ -0,0 +1,370 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::hash::{blob_oid, file_blob_oid};
+use git2::{AttrCheckFlags, AttrValue, Oid, Repository};
+use std::fmt;
+use std::fs;
+use std::io;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::process::{Command, Stdio};
+use std::sync::Mutex;
+use std::thread;
+
+// `core.autocrlf`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum AutoCrlf {
+    False,
+    True,
+    Input,
+}
+
+// What happens to the line endings of a file on its way into the repo, git's
+// `convert_crlf_action` without the differences which only matter for checking files out
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum CrlfAction {
+    // The contents are left alone
+    Binary,
+    // Every CRLF becomes a LF
+    Text,
+    // Like `Text`, unless the contents look binary or the blob in the index has CRLFs
+    Auto,
+}
+
+/// The conversions git applies to a work tree file before hashing it, the "clean" direction.
+///
+/// `core.autocrlf`, and the `text`, `crlf`, `eol` and `filter` attributes are applied the way git
+/// applies them.  The clean command of a filter driver is run through `sh`.  The `ident` and
+/// `working-tree-encoding` attributes aren't supported.
+pub struct Conversion {
+    work_tree: PathBuf,
+    auto_crlf: AutoCrlf,
+    // The repos attributes are looked up in, a repo can only be used by one thread at a time so
+    // each hashing job takes one for as long as it needs it
+    repos: Mutex<Vec<Repository>>,
+}
+
+impl fmt::Debug for Conversion {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Conversion")
+            .field("work_tree", &self.work_tree)
+            .field("auto_crlf", &self.auto_crlf)
+            .finish()
+    }
+}
+
+impl Conversion {
+    /// The conversions of the repo whose work tree is at `path`.
+    pub fn load(path: &Path) -> Conversion {
+        let repo = Repository::open(path).ok();
+        let config = repo.as_ref().and_then(|r| r.config().ok());
+        let auto_crlf = match config.as_ref() {
+            Some(config) => match config.get_string("core.autocrlf") {
+                Ok(value) if value == "input" => AutoCrlf::Input,
+                _ => match config.get_bool("core.autocrlf") {
+                    Ok(true) => AutoCrlf::True,
+                    _ => AutoCrlf::False,
+                },
+            },
+            None => AutoCrlf::False,
+        };
+        Conversion {
+            work_tree: PathBuf::from(path),
+            auto_crlf,
+            repos: Mutex::new(repo.into_iter().collect()),
+        }
+    }
+
+    /// The object id git gives the blob of the file at `path`, after the conversions which apply
+    /// to it.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the file.
+    /// * `name` - The path relative to the work tree, using "/" as the separator.
+    /// * `index_oid` - The object id the index has for the file.  With `text=auto` a blob which
+    ///     already has CRLFs keeps them.
+    pub fn blob_oid(&self, path: &Path, name: &str, index_oid: &[u8; 20]) -> io::Result<[u8; 20]> {
+        let (action, filter) = self
+            .with_repo(|repo| (self.crlf_action(repo, name), clean_filter(repo, name)))
+            .unwrap_or((CrlfAction::Binary, None));
+        if action == CrlfAction::Binary && filter.is_none() {
+            return file_blob_oid(path);
+        }
+
+        let mut contents = fs::read(path)?;
+        if let Some((command, required)) = filter {
+            match self.run_filter(&command, name, contents.clone()) {
+                Ok(filtered) => contents = filtered,
+                Err(err) if required => return Err(err),
+                Err(_) => {}
+            }
+        }
+        let convert = match action {
+            CrlfAction::Binary => false,
+            CrlfAction::Text => true,
+            CrlfAction::Auto => {
+                let stats = TextStats::new(&contents);
+                !stats.is_binary()
+                    && stats.crlf > 0
+                    && !self.with_repo(|r| has_crlf(r, index_oid)).unwrap_or(false)
+            }
+        };
+        if convert {
+            contents = crlf_to_lf(&contents);
+        }
+        Ok(blob_oid(&contents))
+    }
+
+    // Calls `f` with a repo of the work tree, `None` when the repo can't be opened
+    fn with_repo<T, F: FnOnce(&Repository) -> T>(&self, f: F) -> Option<T> {
+        let repo = self.repos.lock().unwrap().pop();
+        let repo = match repo {
+            Some(repo) => repo,
+            None => Repository::open(&self.work_tree).ok()?,
+        };
+        let result = f(&repo);
+        self.repos.lock().unwrap().push(repo);
+        Some(result)
+    }
+
+    // What to do with the line endings of the file at the work tree relative `name`, git's
+    // `convert_attrs()`.  The `text` attribute takes precedence over the older `crlf`, and `eol`
+    // makes a file text when neither says otherwise.
+    fn crlf_action(&self, repo: &Repository, name: &str) -> CrlfAction {
+        let text = text_attribute(attribute(repo, name, "text"))
+            .or_else(|| text_attribute(attribute(repo, name, "crlf")));
+        let text = match (text, attribute(repo, name, "eol")) {
+            (Some(CrlfAction::Binary), _) => text,
+            (Some(CrlfAction::Auto), AttrValue::String(_)) => text,
+            (_, AttrValue::String("lf")) | (_, AttrValue::String("crlf")) => Some(CrlfAction::Text),
+            _ => text,
+        };
+        text.unwrap_or(match self.auto_crlf {
+            AutoCrlf::False => CrlfAction::Binary,
+            AutoCrlf::True | AutoCrlf::Input => CrlfAction::Auto,
+        })
+    }
+
+    // Runs the clean `command` of a filter driver with the `contents` of the file at the work
+    // tree relative `name` as its input, git's `apply_single_file_filter()`
+    fn run_filter(&self, command: &str, name: &str, contents: Vec<u8>) -> io::Result<Vec<u8>> {
+        let quoted = format!("'{}'", name.replace('\'', "'\\''"));
+        let mut child = Command::new("sh")
+            .arg("-c")
+            .arg(command.replace("%f", &quoted))
+            .current_dir(&self.work_tree)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn()?;
+        // Written from another thread so a filter which writes as it reads can't block on a full
+        // pipe
+        let mut stdin = child.stdin.take().unwrap();
+        let writer = thread::spawn(move || stdin.write_all(&contents));
+        let output = child.wait_with_output()?;
+        // Like git, a filter which doesn't read all of its input isn't an error by itself
+        match writer.join() {
+            Ok(Err(err)) if err.kind() != io::ErrorKind::BrokenPipe => return Err(err),
+            Ok(_) => {}
+            Err(_) => return Err(io::Error::other("filter input couldn't be written")),
+        }
+        match output.status.success() {
+            true => Ok(output.stdout),
+            false => Err(io::Error::other(format!("filter '{}' failed", command))),
+        }
+    }
+}
+
+fn attribute<'a>(repo: &'a Repository, name: &str, attribute: &str) -> AttrValue<'a> {
+    let value = repo.get_attr(Path::new(name), attribute, AttrCheckFlags::FILE_THEN_INDEX);
+    AttrValue::from_string(value.ok().flatten())
+}
+
+// The line ending handling a `text` or `crlf` attribute asks for, git's `git_path_check_crlf()`
+fn text_attribute(value: AttrValue) -> Option<CrlfAction> {
+    match value {
+        AttrValue::True | AttrValue::String("input") => Some(CrlfAction::Text),
+        AttrValue::False => Some(CrlfAction::Binary),
+        AttrValue::String("auto") => Some(CrlfAction::Auto),
+        _ => None,
+    }
+}
+
+// The clean command of the filter driver of the file at the work tree relative `name`, along
+// with whether the driver is required.  A driver without a clean command leaves the contents
+// alone.
+fn clean_filter(repo: &Repository, name: &str) -> Option<(String, bool)> {
+    let driver = match attribute(repo, name, "filter") {
+        AttrValue::String(driver) => driver.to_string(),
+        _ => return None,
+    };
+    let config = repo.config().ok()?;
+    let command = config
+        .get_string(&format!("filter.{}.clean", driver))
+        .ok()?;
+    let required = config
+        .get_bool(&format!("filter.{}.required", driver))
+        .unwrap_or(false);
+    Some((command, required))
+}
+
+// Whether the blob `oid` is text with CRLFs, git's `has_crlf_in_index()`
+fn has_crlf(repo: &Repository, oid: &[u8; 20]) -> bool {
+    let blob = Oid::from_bytes(oid).and_then(|oid| repo.find_blob(oid));
+    match blob {
+        Ok(blob) => {
+            let stats = TextStats::new(blob.content());
+            !stats.is_binary() && stats.crlf > 0
+        }
+        Err(_) => false,
+    }
+}
+
+// The `contents` with the CR of each CRLF removed
+fn crlf_to_lf(contents: &[u8]) -> Vec<u8> {
+    let mut converted = Vec::with_capacity(contents.len());
+    for (position, &byte) in contents.iter().enumerate() {
+        if byte != b'\r' || contents.get(position + 1) != Some(&b'\n') {
+            converted.push(byte);
+        }
+    }
+    converted
+}
+
+// The kinds of characters in some contents, git's `text_stat`
+#[derive(Debug, Default, PartialEq, Eq)]
+struct TextStats {
+    lone_cr: usize,
+    crlf: usize,
+    nul: usize,
+    printable: usize,
+    nonprintable: usize,
+}
+
+impl TextStats {
+    fn new(contents: &[u8]) -> TextStats {
+        let mut stats = TextStats::default();
+        let mut bytes = contents.iter().peekable();
+        while let Some(&byte) = bytes.next() {
+            match byte {
+                b'\r' if bytes.peek() == Some(&&b'\n') => {
+                    stats.crlf += 1;
+                    bytes.next();
+                }
+                b'\r' => stats.lone_cr += 1,
+                b'\n' => {}
+                // Backspace, tab, escape and form feed
+                8 | 9 | 27 | 12 => stats.printable += 1,
+                0 => {
+                    stats.nul += 1;
+                    stats.nonprintable += 1;
+                }
+                byte if byte < 32 || byte == 127 => stats.nonprintable += 1,
+                _ => stats.printable += 1,
+            }
+        }
+        // A DOS end of file character at the very end doesn't count
+        if contents.last() == Some(&0x1a) {
+            stats.nonprintable -= 1;
+        }
+        stats
+    }
+
+    // Whether the contents look binary, git's `convert_is_binary()`
+    fn is_binary(&self) -> bool {
+        self.lone_cr > 0 || self.nul > 0 || (self.printable >> 7) < self.nonprintable
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::convert::TryInto;
+    use temp_testdir::TempDir;
+
+    #[test]
+    fn test_text_stats() {
+        let stats = TextStats::new(b"one\r\ntwo\nthree\r\n\x1a");
+        assert_eq!(stats.crlf, 2);
+        assert_eq!(stats.nonprintable, 0);
+        assert!(!stats.is_binary());
+        assert!(TextStats::new(b"one\rtwo").is_binary());
+        assert!(TextStats::new(b"one\0two").is_binary());
+    }
+
+    #[test]
+    fn test_crlf_to_lf() {
+        assert_eq!(
+            crlf_to_lf(b"one\r\ntwo\rthree\r\n\r"),
+            b"one\ntwo\rthree\n\r"
+        );
+    }
+
+    #[test]
+    fn test_attributes_convert_line_endings() {
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        repo.config()
+            .unwrap()
+            .set_bool("core.autocrlf", true)
+            .unwrap();
+        let attributes = "*.txt text\n*.dat -text\n*.lf eol=lf\nauto.* text=auto\n";
+        fs::write(temp_dir.join(".gitattributes"), attributes).unwrap();
+        let conversion = Conversion::load(&temp_dir);
+        let index_oid = blob_oid(b"one\ntwo\n");
+        let cases: [(&str, &[u8], &[u8]); 5] = [
+            ("file.txt", b"one\r\ntwo\r\n", b"one\ntwo\n"),
+            ("file.dat", b"one\r\ntwo\r\n", b"one\r\ntwo\r\n"),
+            ("file.lf", b"one\r\ntwo\r\n", b"one\ntwo\n"),
+            ("auto.bin", b"one\r\ntwo\0\r\n", b"one\r\ntwo\0\r\n"),
+            ("other", b"one\r\ntwo\r\n", b"one\ntwo\n"),
+        ];
+        for (name, contents, expected) in cases.iter() {
+            fs::write(temp_dir.join(name), contents).unwrap();
+            let oid = conversion.blob_oid(&temp_dir.join(name), name, &index_oid);
+            assert_eq!(oid.unwrap(), blob_oid(expected), "{}", name);
+        }
+    }
+
+    #[test]
+    fn test_auto_keeps_crlf_of_index() {
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        repo.config()
+            .unwrap()
+            .set_str("core.autocrlf", "input")
+            .unwrap();
+        let contents = b"one\r\ntwo\r\n";
+        let index_oid = repo.blob(contents).unwrap();
+        let index_oid: [u8; 20] = index_oid.as_bytes().try_into().unwrap();
+        fs::write(temp_dir.join("file.txt"), contents).unwrap();
+        let conversion = Conversion::load(&temp_dir);
+        let oid = conversion.blob_oid(&temp_dir.join("file.txt"), "file.txt", &index_oid);
+        assert_eq!(oid.unwrap(), index_oid);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_clean_filter() {
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        let mut config = repo.config().unwrap();
+        config.set_str("filter.upper.clean", "tr a-z A-Z").unwrap();
+        config.set_str("filter.broken.clean", "false").unwrap();
+        config.set_bool("filter.broken.required", true).unwrap();
+        let attributes = "*.up filter=upper\n*.broken filter=broken\n";
+        fs::write(temp_dir.join(".gitattributes"), attributes).unwrap();
+        fs::write(temp_dir.join("file.up"), "contents\n").unwrap();
+        fs::write(temp_dir.join("file.broken"), "contents\n").unwrap();
+        let conversion = Conversion::load(&temp_dir);
+        let oid = conversion.blob_oid(&temp_dir.join("file.up"), "file.up", &[0; 20]);
+        assert_eq!(oid.unwrap(), blob_oid(b"CONTENTS\n"));
+        let oid = conversion.blob_oid(&temp_dir.join("file.broken"), "file.broken", &[0; 20]);
+        assert!(oid.is_err());
+    }
+}
@@ -0,0 +1,581 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::direntry::FileStat;
+use git2::Repository;
+use std::fs;
+use std::io;
+use std::path::Path;
+#[cfg(not(unix))]
+use std::time::UNIX_EPOCH;
+
+pub use listing::{DirListing, ListedEntry};
+
+// The modes git records
+const MODE_DIRECTORY: u16 = 0o040000;
+const MODE_LINK: u16 = 0o120000;
+const MODE_EXECUTABLE: u16 = 0o100755;
+const MODE_FILE: u16 = 0o100644;
+
+/// The stat data of a directory entry, along with the mode git would record for it.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct EntryStat {
+    pub stat: FileStat,
+    pub mode: u16,
+}
+
+impl EntryStat {
+    pub fn is_dir(&self) -> bool {
+        self.mode == MODE_DIRECTORY
+    }
+}
+
+/// How the calls for the entries of a directory are made.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Batching {
+    /// One after the other.
+    Sequential,
+    /// Submitted together to io_uring, so they're in flight at the same time.
+    #[cfg(all(target_os = "linux", feature = "io-uring"))]
+    IoUring,
+}
+
+impl Batching {
+    /// The batching for the repo at `path`.  io_uring is only used when built with the
+    /// `io-uring` feature, `winGitStatus.ioUring` is set, and the kernel allows it.
+    pub fn load(path: &Path) -> Batching {
+        let enabled = Repository::open(path)
+            .and_then(|r| r.config()?.get_bool("winGitStatus.ioUring"))
+            .unwrap_or(false);
+        Batching::new(enabled)
+    }
+
+    #[cfg(all(target_os = "linux", feature = "io-uring"))]
+    fn new(io_uring: bool) -> Batching {
+        match io_uring && crate::uring::is_available() {
+            true => Batching::IoUring,
+            false => Batching::Sequential,
+        }
+    }
+
+    #[cfg(not(all(target_os = "linux", feature = "io-uring")))]
+    fn new(_io_uring: bool) -> Batching {
+        Batching::Sequential
+    }
+}
+
+impl DirListing {
+    /// The stat data of each of `entries`, in the same order.
+    pub fn stat_all(
+        &self,
+        entries: &[ListedEntry],
+        batching: Batching,
+    ) -> Vec<io::Result<EntryStat>> {
+        match batching {
+            #[cfg(all(target_os = "linux", feature = "io-uring"))]
+            Batching::IoUring if entries.len() > 1 => {
+                if let Some(stats) = self.stat_batched(entries) {
+                    return stats;
+                }
+            }
+            _ => {}
+        }
+        entries.iter().map(|entry| self.stat(entry)).collect()
+    }
+
+    /// Opens the directories at `paths` ahead of being listed.  Those which aren't opened, the
+    /// batching is sequential or too many directories are already open, are `None`.
+    pub fn open_all(paths: &[&Path], batching: Batching) -> Vec<Option<DirListing>> {
+        let mut opened = match batching {
+            #[cfg(all(target_os = "linux", feature = "io-uring"))]
+            Batching::IoUring => DirListing::open_batched(paths),
+            _ => vec![],
+        };
+        opened.resize_with(paths.len(), || None);
+        opened
+    }
+}
+
+#[cfg(unix)]
+pub fn file_stat(metadata: &fs::Metadata) -> FileStat {
+    use std::os::unix::fs::MetadataExt;
+    FileStat {
+        ctime: (metadata.ctime() as u32, metadata.ctime_nsec() as u32),
+        mtime: (metadata.mtime() as u32, metadata.mtime_nsec() as u32),
+        dev: metadata.dev() as u32,
+        ino: metadata.ino() as u32,
+        uid: metadata.uid(),
+        gid: metadata.gid(),
+        size: metadata.size() as u32,
+    }
+}
+
+#[cfg(not(unix))]
+pub fn file_stat(metadata: &fs::Metadata) -> FileStat {
+    let mtime = metadata
+        .modified()
+        .unwrap()
+        .duration_since(UNIX_EPOCH)
+        .unwrap();
+    FileStat {
+        mtime: (mtime.as_secs() as u32, mtime.subsec_nanos()),
+        size: metadata.len() as u32,
+        ..Default::default()
+    }
+}
+
+/// The mode git records for a file with `metadata`
+#[cfg(unix)]
+pub fn file_mode(metadata: &fs::Metadata) -> u16 {
+    use std::os::unix::fs::MetadataExt;
+    git_mode(metadata.mode())
+}
+
+/// The mode git records for a file with `metadata`
+#[cfg(not(unix))]
+pub fn file_mode(metadata: &fs::Metadata) -> u16 {
+    match metadata.file_type() {
+        t if t.is_symlink() => MODE_LINK,
+        t if t.is_dir() => MODE_DIRECTORY,
+        _ => MODE_FILE,
+    }
+}
+
+// The mode git records for a file with the unix `st_mode`, only the type and whether the owner
+// can execute it are kept
+#[cfg(unix)]
+fn git_mode(st_mode: u32) -> u16 {
+    const S_IFMT: u32 = 0o170000;
+    match st_mode & S_IFMT {
+        0o120000 => MODE_LINK,
+        0o040000 => MODE_DIRECTORY,
+        _ if st_mode & 0o100 != 0 => MODE_EXECUTABLE,
+        _ => MODE_FILE,
+    }
+}
+
+// Reads directories with `getdents64` and stats their entries with `statx` relative to the
+// directory, asking only for the fields git records.  The directory is read in large batches and
+// each entry is only allocated for its name.
+#[cfg(target_os = "linux")]
+mod listing {
+    use super::{git_mode, EntryStat};
+    use crate::direntry::FileStat;
+    use std::ffi::CString;
+    use std::io;
+    use std::mem;
+    use std::os::unix::ffi::OsStrExt;
+    use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
+    use std::path::Path;
+    #[cfg(feature = "io-uring")]
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    // Big enough to read most directories in one call
+    const BUFFER_SIZE: usize = 64 * 1024;
+
+    // Where the fields are in a `struct linux_dirent64`
+    const RECORD_LENGTH_OFFSET: usize = 16;
+    const TYPE_OFFSET: usize = 18;
+    const NAME_OFFSET: usize = 19;
+
+    // The longest name a directory entry can have, plus the terminating nul
+    const NAME_MAX: usize = 256;
+
+    const STATX_MASK: u32 = libc::STATX_TYPE
+        | libc::STATX_MODE
+        | libc::STATX_UID
+        | libc::STATX_GID
+        | libc::STATX_INO
+        | libc::STATX_SIZE
+        | libc::STATX_MTIME
+        | libc::STATX_CTIME;
+
+    // How many more directories can be opened ahead of being listed.  Directories are opened
+    // long before the rayon scope gets to them, this keeps them from using up the process's
+    // file descriptors.
+    #[cfg(feature = "io-uring")]
+    static OPEN_BUDGET: AtomicUsize = AtomicUsize::new(256);
+
+    /// An open directory.
+    #[derive(Debug)]
+    pub struct DirListing {
+        fd: OwnedFd,
+        // Whether the directory was opened ahead of time and counts against `OPEN_BUDGET`
+        #[cfg(feature = "io-uring")]
+        budgeted: bool,
+    }
+
+    #[cfg(feature = "io-uring")]
+    impl Drop for DirListing {
+        fn drop(&mut self) {
+            if self.budgeted {
+                OPEN_BUDGET.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+
+    /// An entry of a directory, `.` and `..` are never listed.
+    #[derive(Debug)]
+    pub struct ListedEntry {
+        pub name: String,
+        // The `d_type` the file system gave, `DT_UNKNOWN` when it doesn't keep the type
+        kind: u8,
+    }
+
+    impl DirListing {
+        /// Opens the directory at `path`.
+        pub fn open(path: &Path) -> io::Result<DirListing> {
+            let path = CString::new(path.as_os_str().as_bytes())?;
+            let flags = libc::O_RDONLY | libc::O_DIRECTORY | libc::O_CLOEXEC;
+            let fd = unsafe { libc::open(path.as_ptr(), flags) };
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(DirListing {
+                fd: unsafe { OwnedFd::from_raw_fd(fd) },
+                #[cfg(feature = "io-uring")]
+                budgeted: false,
+            })
+        }
+
+        // Opens as many of the directories at `paths` as the budget allows, in one batch
+        #[cfg(feature = "io-uring")]
+        pub(super) fn open_batched(paths: &[&Path]) -> Vec<Option<DirListing>> {
+            let available = OPEN_BUDGET
+                .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |a| {
+                    Some(a - a.min(paths.len()))
+                })
+                .unwrap();
+            let paths = &paths[..available.min(paths.len())];
+            let opened = crate::uring::open_dirs(paths).unwrap_or_default();
+            OPEN_BUDGET.fetch_add(paths.len() - opened.len(), Ordering::Relaxed);
+            opened
+                .into_iter()
+                .map(|fd| match fd {
+                    Ok(fd) => Some(DirListing { fd, budgeted: true }),
+                    Err(_) => {
+                        OPEN_BUDGET.fetch_add(1, Ordering::Relaxed);
+                        None
+                    }
+                })
+                .collect()
+        }
+
+        // The stat data of `entries` from one batch of `statx` calls, `None` when io_uring
+        // couldn't be used
+        #[cfg(feature = "io-uring")]
+        pub(super) fn stat_batched(
+            &self,
+            entries: &[ListedEntry],
+        ) -> Option<Vec<io::Result<EntryStat>>> {
+            let names: Vec<&str> = entries.iter().map(|e| e.name.as_str()).collect();
+            let stats = crate::uring::statx_all(
+                self.fd.as_raw_fd(),
+                &names,
+                libc::AT_SYMLINK_NOFOLLOW,
+                STATX_MASK,
+            )?;
+            let stats = stats
+                .into_iter()
+                .zip(entries)
+                .map(|(stat, entry)| match stat {
+                    Ok(statx) => Ok(entry_stat(&statx)),
+                    // Kernels before 5.6 don't have the `statx` operation
+                    Err(e) if e.raw_os_error() == Some(libc::EINVAL) => self.stat(entry),
+                    Err(e) => Err(e),
+                });
+            Some(stats.collect())
+        }
+
+        /// The entries of the directory, in the order the file system keeps them.  The
+        /// directory is only read once, later calls have no entries.
+        pub fn entries(&self) -> io::Result<Vec<ListedEntry>> {
+            let mut entries = vec![];
+            let mut buffer = vec![0u8; BUFFER_SIZE];
+            loop {
+                let read = unsafe {
+                    libc::syscall(
+                        libc::SYS_getdents64,
+                        self.fd.as_raw_fd(),
+                        buffer.as_mut_ptr(),
+                        buffer.len(),
+                    )
+                };
+                if read < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+                if read == 0 {
+                    return Ok(entries);
+                }
+                let mut records = &buffer[..read as usize];
+                while !records.is_empty() {
+                    let length = u16::from_ne_bytes([
+                        records[RECORD_LENGTH_OFFSET],
+                        records[RECORD_LENGTH_OFFSET + 1],
+                    ]) as usize;
+                    let name = &records[NAME_OFFSET..length];
+                    let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+                    if name != b"." && name != b".." {
+                        let name = String::from_utf8(name.to_vec())
+                            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+                        entries.push(ListedEntry {
+                            name,
+                            kind: records[TYPE_OFFSET],
+                        });
+                    }
+                    records = &records[length..];
+                }
+            }
+        }
+
+        /// Whether `entry` is a directory, only stat'ed when the file system doesn't keep the
+        /// type in the directory.
+        pub fn is_dir(&self, entry: &ListedEntry) -> io::Result<bool> {
+            match entry.kind {
+                libc::DT_UNKNOWN => Ok(self.stat(entry)?.is_dir()),
+                kind => Ok(kind == libc::DT_DIR),
+            }
+        }
+
+        /// The stat data of `entry`, symbolic links aren't followed.
+        pub fn stat(&self, entry: &ListedEntry) -> io::Result<EntryStat> {
+            let mut name = [0u8; NAME_MAX];
+            let bytes = entry.name.as_bytes();
+            if bytes.len() >= NAME_MAX {
+                return Err(io::Error::from_raw_os_error(libc::ENAMETOOLONG));
+            }
+            name[..bytes.len()].copy_from_slice(bytes);
+
+            let mut statx: libc::statx = unsafe { mem::zeroed() };
+            let result = unsafe {
+                libc::statx(
+                    self.fd.as_raw_fd(),
+                    name.as_ptr() as *const libc::c_char,
+                    libc::AT_SYMLINK_NOFOLLOW,
+                    STATX_MASK,
+                    &mut statx,
+                )
+            };
+            if result != 0 {
+                return Err(io::Error::last_os_error());
+            }
+            Ok(entry_stat(&statx))
+        }
+    }
+
+    fn entry_stat(statx: &libc::statx) -> EntryStat {
+        let dev = libc::makedev(statx.stx_dev_major, statx.stx_dev_minor);
+        EntryStat {
+            stat: FileStat {
+                ctime: (statx.stx_ctime.tv_sec as u32, statx.stx_ctime.tv_nsec),
+                mtime: (statx.stx_mtime.tv_sec as u32, statx.stx_mtime.tv_nsec),
+                dev: dev as u32,
+                ino: statx.stx_ino as u32,
+                uid: statx.stx_uid,
+                gid: statx.stx_gid,
+                size: statx.stx_size as u32,
+            },
+            mode: git_mode(statx.stx_mode as u32),
+        }
+    }
+}
+
+// Everywhere else the standard library's directory reading is used
+#[cfg(not(target_os = "linux"))]
+mod listing {
+    use super::{file_mode, file_stat, EntryStat};
+    use std::fs;
+    use std::io;
+    use std::path::Path;
+    use std::sync::Mutex;
+
+    /// An open directory.  Once listed the entries of a large directory are stat'ed from
+    /// several threads, so the directory is behind a lock rather than a cell.
+    #[derive(Debug)]
+    pub struct DirListing {
+        read_dir: Mutex<Option<fs::ReadDir>>,
+    }
+
+    /// An entry of a directory, `.` and `..` are never listed.
+    #[derive(Debug)]
+    pub struct ListedEntry {
+        pub name: String,
+        entry: fs::DirEntry,
+    }
+
+    impl DirListing {
+        /// Opens the directory at `path`.
+        pub fn open(path: &Path) -> io::Result<DirListing> {
+            Ok(DirListing {
+                read_dir: Mutex::new(Some(fs::read_dir(path)?)),
+            })
+        }
+
+        /// The entries of the directory, in the order the file system keeps them.  The
+        /// directory is only read once, later calls have no entries.
+        pub fn entries(&self) -> io::Result<Vec<ListedEntry>> {
+            let read_dir = match self.read_dir.lock().unwrap().take() {
+                Some(read_dir) => read_dir,
+                None => return Ok(vec![]),
+            };
+            read_dir
+                .map(|entry| {
+                    let entry = entry?;
+                    let name = entry.file_name().into_string().map_err(|_| {
+                        io::Error::new(io::ErrorKind::InvalidData, "name isn't valid UTF-8")
+                    })?;
+                    Ok(ListedEntry { name, entry })
+                })
+                .collect()
+        }
+
+        /// Whether `entry` is a directory.
+        pub fn is_dir(&self, entry: &ListedEntry) -> io::Result<bool> {
+            Ok(entry.entry.file_type()?.is_dir())
+        }
+
+        /// The stat data of `entry`, symbolic links aren't followed.
+        pub fn stat(&self, entry: &ListedEntry) -> io::Result<EntryStat> {
+            let metadata = entry.entry.metadata()?;
+            Ok(EntryStat {
+                stat: file_stat(&metadata),
+                mode: file_mode(&metadata),
+            })
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::path::Path;
+    use temp_testdir::TempDir;
+
+    #[test]
+    fn test_entries_of_directory() {
+        let temp_dir = TempDir::default();
+        fs::create_dir(temp_dir.join("sub")).unwrap();
+        fs::write(temp_dir.join("file.txt"), "contents").unwrap();
+        for number in 0..500 {
+            fs::write(temp_dir.join(format!("a_long_name_to_fill_{}", number)), "").unwrap();
+        }
+
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let entries = listing.entries().unwrap();
+        assert_eq!(entries.len(), 502);
+        let mut names: Vec<&str> = entries.iter().map(|e| e.name.as_str()).collect();
+        names.sort_unstable();
+        assert_eq!(names[500..], ["file.txt", "sub"]);
+
+        let sub = entries.iter().find(|e| e.name == "sub").unwrap();
+        assert!(listing.is_dir(sub).unwrap());
+        let file = entries.iter().find(|e| e.name == "file.txt").unwrap();
+        assert!(!listing.is_dir(file).unwrap());
+    }
+
+    #[test]
+    fn test_stat_matches_metadata() {
+        let temp_dir = TempDir::default();
+        fs::create_dir(temp_dir.join("sub")).unwrap();
+        fs::write(temp_dir.join("file.txt"), "contents").unwrap();
+        let listing = DirListing::open(&temp_dir).unwrap();
+        for entry in listing.entries().unwrap() {
+            let metadata = fs::symlink_metadata(temp_dir.join(&entry.name)).unwrap();
+            let expected = EntryStat {
+                stat: file_stat(&metadata),
+                mode: file_mode(&metadata),
+            };
+            assert_eq!(listing.stat(&entry).unwrap(), expected);
+        }
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_stat_of_links_and_executables() {
+        use std::os::unix::fs::PermissionsExt;
+        let temp_dir = TempDir::default();
+        let script = temp_dir.join("script.sh");
+        fs::write(&script, "#!/bin/sh").unwrap();
+        fs::set_permissions(&script, fs::Permissions::from_mode(0o755)).unwrap();
+        std::os::unix::fs::symlink("missing", temp_dir.join("link")).unwrap();
+
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let mut modes: Vec<(String, u16)> = listing
+            .entries()
+            .unwrap()
+            .into_iter()
+            .map(|e| {
+                let mode = listing.stat(&e).unwrap().mode;
+                (e.name, mode)
+            })
+            .collect();
+        modes.sort();
+        assert_eq!(
+            modes,
+            [
+                (String::from("link"), MODE_LINK),
+                (String::from("script.sh"), MODE_EXECUTABLE)
+            ]
+        );
+    }
+
+    #[test]
+    fn test_stat_all_sequential() {
+        let temp_dir = TempDir::default();
+        fs::write(temp_dir.join("file.txt"), "contents").unwrap();
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let entries = listing.entries().unwrap();
+        fs::remove_file(temp_dir.join("file.txt")).unwrap();
+        let stats = listing.stat_all(&entries, Batching::Sequential);
+        assert_eq!(
+            stats[0].as_ref().unwrap_err().kind(),
+            io::ErrorKind::NotFound
+        );
+        assert!(DirListing::open_all(&[temp_dir.as_ref()], Batching::Sequential)[0].is_none());
+    }
+
+    #[cfg(all(target_os = "linux", feature = "io-uring"))]
+    #[test]
+    fn test_stat_all_io_uring_matches_sequential() {
+        if Batching::new(true) != Batching::IoUring {
+            return;
+        }
+        let temp_dir = TempDir::default();
+        fs::create_dir(temp_dir.join("sub")).unwrap();
+        std::os::unix::fs::symlink("missing", temp_dir.join("link")).unwrap();
+        for number in 0..300 {
+            fs::write(temp_dir.join(format!("file_{}", number)), "contents").unwrap();
+        }
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let entries = listing.entries().unwrap();
+        let batched = listing.stat_all(&entries, Batching::IoUring);
+        let sequential = listing.stat_all(&entries, Batching::Sequential);
+        assert_eq!(batched.len(), 302);
+        for (batched, sequential) in batched.iter().zip(&sequential) {
+            assert_eq!(batched.as_ref().unwrap(), sequential.as_ref().unwrap());
+        }
+
+        let sub = temp_dir.join("sub");
+        let paths = [sub.as_path(), Path::new("/a/directory/that/isn't/there")];
+        let opened = DirListing::open_all(&paths, Batching::IoUring);
+        let names: Vec<String> = opened[0]
+            .as_ref()
+            .unwrap()
+            .entries()
+            .unwrap()
+            .into_iter()
+            .map(|e| e.name)
+            .collect();
+        assert!(names.is_empty());
+        assert!(opened[1].is_none());
+    }
+
+    #[test]
+    fn test_open_missing_directory() {
+        assert!(DirListing::open(Path::new("/a/directory/that/isn't/there")).is_err());
+    }
+}
@@ -11,6 +11,9 @@ pub enum ObjectType {
     SymLink,
     // These are submodules
     GitLink,
+    // A directory outside of the sparse checkout, which a sparse index stores as a single entry
+    // in place of everything under it
+    SparseDirectory,
 }
 impl Default for ObjectType {
     fn default() -> Self {
@@ -18,19 +21,54 @@ impl Default for ObjectType {
     }
 }
 
-#[derive(PartialEq, Eq, Debug, Default, Clone)]
+impl ObjectType {
+    /// Whether the entry is a directory in the work tree, a submodule or a sparse directory.
+    pub fn is_directory(&self) -> bool {
+        matches!(self, ObjectType::GitLink | ObjectType::SparseDirectory)
+    }
+
+    /// The object type of an entry with the file `mode` git records.
+    pub fn from_mode(mode: u16) -> ObjectType {
+        match mode >> 12 {
+            0b1110 => ObjectType::GitLink,
+            0b1010 => ObjectType::SymLink,
+            0b0100 => ObjectType::SparseDirectory,
+            _ => ObjectType::Regular,
+        }
+    }
+}
+
+/// The stat data git records to tell when a file or directory has changed.
+///
+/// Everything is truncated to 32 bits the way git records it, so the size of a 4GiB file is 0.
+#[derive(PartialEq, Eq, Debug, Default, Clone, Copy)]
 pub struct FileStat {
-    pub mtime: u32,
+    /// Seconds and nanoseconds
+    pub ctime: (u32, u32),
+    /// Seconds and nanoseconds
+    pub mtime: (u32, u32),
+    pub dev: u32,
+    pub ino: u32,
+    pub uid: u32,
+    pub gid: u32,
     pub size: u32,
 }
 
 /// Represents an git entry in the index or working tree i.e. a file or blob
-#[derive(PartialEq, Eq, Debug, Default)]
-pub struct DirEntry {
+///
+/// The name is borrowed from the index file the entry was read from.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+pub struct DirEntry<'a> {
     pub object_type: ObjectType,
     pub stat: FileStat,
 
+    // The file mode as git records it, e.g. 0o100644 or 0o100755
+    pub mode: u16,
+
     // The docs call this "object name"
     pub sha: [u8; 20],
-    pub name: String,
+    pub name: &'a str,
+
+    // The entry is outside of the sparse checkout, it isn't expected to be in the work tree
+    pub skip_worktree: bool,
 }
@@ -0,0 +1,203 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::Index;
+use git2::Repository;
+use std::collections::HashSet;
+use std::path::Path;
+use std::process::Command;
+
+/// The paths the file system monitor reports as changed since the index was written.
+///
+/// Git stores the last token the `core.fsmonitor` hook gave it in the index.  Handing that token
+/// back to the hook returns every path which changed since.  Together with the entries the index
+/// already had marked as changed, these are the only paths which need to be looked at.
+///
+/// The hook protocol is described in https://git-scm.com/docs/githooks#_fsmonitor_watchman.
+#[derive(Debug, Default)]
+pub struct FsMonitor {
+    // Files and directories which may have changed
+    dirty_paths: HashSet<String>,
+    // Directories the hook reported with a trailing "/", everything below them may have changed
+    dirty_trees: Vec<String>,
+    // Directories which may have had entries added, removed or changed
+    dirty_directories: HashSet<String>,
+}
+
+impl FsMonitor {
+    /// Queries the `core.fsmonitor` hook of the repo at `path` with the token stored in `index`.
+    ///
+    /// Only version 2 of the hook protocol is supported.  `None` is returned when there is no
+    /// hook, the index has no token to give it, or the hook fails or can't tell what changed.
+    /// Everything has to be looked at in these cases.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the work tree of the repo.
+    /// * `index` - The index of the repo.
+    pub fn query(path: &Path, index: &Index) -> Option<FsMonitor> {
+        let cache = index.fsmonitor_cache()?;
+        let token = cache.token?;
+        let hook = fsmonitor_hook(path)?;
+        let output = run_hook(path, &hook, token)?;
+        FsMonitor::from_hook_output(&output, &cache.dirty)
+    }
+
+    // Builds the changed paths from the output of the hook, the new token followed by NUL
+    // terminated paths, and the entries the index has marked as changed.
+    fn from_hook_output(output: &[u8], dirty_entries: &[&str]) -> Option<FsMonitor> {
+        let mut fields = output.split(|b| *b == 0);
+        let _token = fields.next().filter(|token| !token.is_empty())?;
+        let mut fsmonitor = FsMonitor::default();
+        for path in fields.filter(|p| !p.is_empty()) {
+            let path = std::str::from_utf8(path).ok()?;
+            match path.strip_suffix('/') {
+                // A lone "/" means the hook lost track and everything may have changed
+                Some("") => return None,
+                Some(tree) => {
+                    fsmonitor.dirty_trees.push(tree.to_string());
+                    fsmonitor.mark_dirty(tree);
+                }
+                None => fsmonitor.mark_dirty(path),
+            }
+        }
+        for path in dirty_entries {
+            fsmonitor.mark_dirty(path);
+        }
+        Some(fsmonitor)
+    }
+
+    fn mark_dirty(&mut self, path: &str) {
+        let parent = path.rfind('/').map_or("", |end| &path[..end]);
+        self.dirty_directories.insert(parent.to_string());
+        // The hook doesn't say if a path is a directory, which could have changed entries
+        self.dirty_directories.insert(path.to_string());
+        self.dirty_paths.insert(path.to_string());
+    }
+
+    /// Whether the file or directory at `path` may have changed.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path relative to the root of the work tree, using "/" as the separator.
+    pub fn is_dirty(&self, path: &str) -> bool {
+        self.dirty_paths.contains(path) || self.in_dirty_tree(path)
+    }
+
+    /// Whether files or directories may have been added, removed or changed in `directory`.
+    ///
+    /// # Arguments
+    ///
+    /// * `directory` - The path relative to the root of the work tree, using "/" as the
+    ///   separator.  The root is an empty string.
+    pub fn is_directory_dirty(&self, directory: &str) -> bool {
+        self.dirty_directories.contains(directory) || self.in_dirty_tree(directory)
+    }
+
+    fn in_dirty_tree(&self, path: &str) -> bool {
+        self.dirty_trees.iter().any(|tree| {
+            path.starts_with(tree.as_str())
+                && (path.len() == tree.len() || path.as_bytes()[tree.len()] == b'/')
+        })
+    }
+}
+
+// The hook configured in `core.fsmonitor`.  Boolean values are for git's builtin daemon, which
+// isn't supported, and so is version 1 of the hook protocol.
+fn fsmonitor_hook(path: &Path) -> Option<String> {
+    let repo = Repository::open(path).ok()?;
+    let config = repo.config().ok()?;
+    if let Ok(1) = config.get_i32("core.fsmonitorHookVersion") {
+        return None;
+    }
+    let hook = config.get_string("core.fsmonitor").ok()?;
+    match hook.to_lowercase().as_str() {
+        "" | "true" | "false" | "yes" | "no" | "on" | "off" | "1" | "0" => None,
+        _ => Some(hook),
+    }
+}
+
+// Runs `hook` in the work tree at `path`, returning what it wrote when it succeeded.  Like git,
+// the hook is run through the shell, so it may have arguments of its own or be a script which
+// can't be executed directly, with the protocol version and `token` appended.
+fn run_hook(path: &Path, hook: &str, token: &str) -> Option<Vec<u8>> {
+    let output = Command::new("sh")
+        .arg("-c")
+        .arg(format!("{} \"$@\"", hook))
+        .arg(hook)
+        .arg("2")
+        .arg(token)
+        .current_dir(path)
+        .output()
+        .ok()?;
+    match output.status.success() {
+        true => Some(output.stdout),
+        false => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+    use temp_testdir::TempDir;
+
+    #[test]
+    fn test_hook_output_marks_paths_and_parents_dirty() {
+        let output = b"token_2\0dir/nested/file.txt\0top.txt\0";
+        let fsmonitor = FsMonitor::from_hook_output(output, &["other/entry.txt"]).unwrap();
+        for path in &["dir/nested/file.txt", "top.txt", "other/entry.txt"] {
+            assert!(fsmonitor.is_dirty(path));
+        }
+        assert!(!fsmonitor.is_dirty("dir/nested/other.txt"));
+        assert!(!fsmonitor.is_dirty("dir/nested"));
+        for directory in &["", "dir/nested", "other"] {
+            assert!(fsmonitor.is_directory_dirty(directory));
+        }
+        assert!(!fsmonitor.is_directory_dirty("dir"));
+    }
+
+    #[test]
+    fn test_hook_output_with_directory() {
+        let output = b"token_2\0dir/\0";
+        let fsmonitor = FsMonitor::from_hook_output(output, &[]).unwrap();
+        assert!(fsmonitor.is_dirty("dir/nested/file.txt"));
+        assert!(fsmonitor.is_directory_dirty("dir/nested"));
+        assert!(fsmonitor.is_directory_dirty(""));
+        assert!(!fsmonitor.is_dirty("directory/file.txt"));
+        assert!(!fsmonitor.is_directory_dirty("directory"));
+    }
+
+    #[test]
+    fn test_hook_output_everything_changed() {
+        let output = b"token_2\0file.txt\0/\0";
+        assert!(FsMonitor::from_hook_output(output, &[]).is_none());
+    }
+
+    #[test]
+    fn test_hook_output_nothing_changed() {
+        let fsmonitor = FsMonitor::from_hook_output(b"token_2\0", &[]).unwrap();
+        assert!(!fsmonitor.is_directory_dirty(""));
+        assert!(!fsmonitor.is_dirty("file.txt"));
+    }
+
+    #[test]
+    fn test_hook_runs_through_the_shell() {
+        let temp_dir = TempDir::default();
+        let path: &Path = temp_dir.as_ref();
+        // Not executable, and only succeeds with its own argument ahead of the protocol's
+        let script =
+            "[ \"$1 $2 $3\" = \"--flag 2 old token\" ] || exit 1\nprintf 'token_3\\0file.txt\\0'\n";
+        fs::write(path.join("hook.sh"), script).unwrap();
+        let output = run_hook(path, "sh hook.sh --flag", "old token").unwrap();
+        assert_eq!(output, b"token_3\0file.txt\0");
+        let fsmonitor = FsMonitor::from_hook_output(&output, &[]).unwrap();
+        assert!(fsmonitor.is_dirty("file.txt"));
+        assert!(!fsmonitor.is_dirty("other.txt"));
+        assert!(run_hook(path, "sh hook.sh --other", "old token").is_none());
+    }
+}
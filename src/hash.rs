@@ -0,0 +1,207 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+pub use crate::sha1::is_accelerated;
+use crate::sha1::Sha1;
+use memmap2::Mmap;
+use rayon::{ThreadPool, ThreadPoolBuilder};
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::io::Read;
+use std::path::Path;
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+
+// Mapping a file has a fixed cost, smaller files are cheaper to read
+const MAP_THRESHOLD: u64 = 1 << 20;
+
+// The size of the pieces files under `MAP_THRESHOLD` are read in
+const CHUNK_SIZE: usize = 64 * 1024;
+
+/// The object id git gives a blob with `contents`.
+pub fn blob_oid(contents: &[u8]) -> [u8; 20] {
+    let mut sha = blob_header(contents.len() as u64);
+    sha.update(contents);
+    sha.finish()
+}
+
+/// The object id git gives the blob of the file at `path`, the contents are hashed as they are,
+/// no filters or line ending conversions are applied.
+///
+/// Large files are memory mapped, smaller ones are read in pieces.  A file which changes size
+/// while it's being read is an error.
+pub fn file_blob_oid(path: &Path) -> io::Result<[u8; 20]> {
+    let mut file = File::open(path)?;
+    let size = file.metadata()?.len();
+    if size >= MAP_THRESHOLD {
+        if let Ok(contents) = unsafe { Mmap::map(&file) } {
+            return Ok(blob_oid(&contents));
+        }
+    }
+
+    let mut sha = blob_header(size);
+    let mut chunk = vec![0; CHUNK_SIZE.min(size as usize + 1)];
+    let mut read = 0;
+    loop {
+        let count = file.read(&mut chunk)?;
+        if count == 0 {
+            break;
+        }
+        read += count as u64;
+        if read > size {
+            break;
+        }
+        sha.update(&chunk[..count]);
+    }
+    match read == size {
+        true => Ok(sha.finish()),
+        false => Err(io::Error::other("file changed size while being hashed")),
+    }
+}
+
+/// The object id git gives the blob of the symbolic link at `path`, the blob is the link's
+/// target.
+pub fn link_blob_oid(path: &Path) -> io::Result<[u8; 20]> {
+    let target = fs::read_link(path)?;
+    let target = target
+        .to_str()
+        .ok_or_else(|| io::Error::other("link target isn't valid UTF-8"))?;
+    Ok(blob_oid(target.as_bytes()))
+}
+
+fn blob_header(size: u64) -> Sha1 {
+    let mut sha = Sha1::default();
+    sha.update(format!("blob {}\0", size).as_bytes());
+    sha
+}
+
+/// Runs hashing jobs on a pool of threads of their own, and waits for them to finish.
+///
+/// Hashing is bound by reading files and can take much longer than the walk of the work tree.
+/// The pool only has half as many threads as rayon's global pool, so a lot of files to hash
+/// doesn't hold up reading directories.  The pool is shared by every `BlobHasher`.
+#[derive(Debug, Clone, Default)]
+pub struct BlobHasher {
+    // The number of jobs which haven't finished
+    pending: Arc<(Mutex<usize>, Condvar)>,
+}
+
+// Counts a job as finished when dropped, even when the job panics
+struct Finished(Arc<(Mutex<usize>, Condvar)>);
+
+impl Drop for Finished {
+    fn drop(&mut self) {
+        let (pending, condvar) = &*self.0;
+        let mut pending = pending.lock().unwrap_or_else(|e| e.into_inner());
+        *pending -= 1;
+        if *pending == 0 {
+            condvar.notify_all();
+        }
+    }
+}
+
+fn hash_pool() -> &'static ThreadPool {
+    static POOL: OnceLock<ThreadPool> = OnceLock::new();
+    POOL.get_or_init(|| {
+        ThreadPoolBuilder::new()
+            .num_threads((rayon::current_num_threads() / 2).max(1))
+            .thread_name(|i| format!("hash-{}", i))
+            .build()
+            .unwrap()
+    })
+}
+
+impl BlobHasher {
+    /// Runs `job` on the hashing pool.
+    pub fn spawn<F: FnOnce() + Send + 'static>(&self, job: F) {
+        *self.pending.0.lock().unwrap() += 1;
+        let finished = Finished(Arc::clone(&self.pending));
+        hash_pool().spawn(move || {
+            let _finished = finished;
+            job();
+        });
+    }
+
+    /// Waits for every job spawned by this, or a clone of this, to finish.
+    pub fn wait(&self) {
+        let (pending, condvar) = &*self.pending;
+        let mut pending = pending.lock().unwrap();
+        while *pending > 0 {
+            pending = condvar.wait(pending).unwrap();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use temp_testdir::TempDir;
+
+    fn hex(oid: [u8; 20]) -> String {
+        oid.iter().map(|b| format!("{:02x}", b)).collect()
+    }
+
+    #[test]
+    fn test_blob_oid() {
+        // `git hash-object` of an empty file and of "hello world\n"
+        assert_eq!(
+            hex(blob_oid(b"")),
+            "e69de29bb2d1d6434b8b29ae775ad8c2e48c5391"
+        );
+        assert_eq!(
+            hex(blob_oid(b"hello world\n")),
+            "3b18e512dba79e4c8300dd08aeb37f8e728b8dad"
+        );
+    }
+
+    #[test]
+    fn test_file_blob_oid_read_and_mapped() {
+        let temp_dir = TempDir::default();
+        for &size in &[0, 1, 100, CHUNK_SIZE + 7, MAP_THRESHOLD as usize + 3] {
+            let contents: Vec<u8> = (0..size).map(|i| (i % 251) as u8).collect();
+            let path = temp_dir.join(format!("file_{}", size));
+            fs::write(&path, &contents).unwrap();
+            assert_eq!(
+                file_blob_oid(&path).unwrap(),
+                blob_oid(&contents),
+                "{}",
+                size
+            );
+        }
+    }
+
+    #[test]
+    fn test_file_blob_oid_missing_file() {
+        let temp_dir = TempDir::default();
+        assert!(file_blob_oid(&temp_dir.join("missing")).is_err());
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_link_blob_oid() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("link");
+        std::os::unix::fs::symlink("some/target", &path).unwrap();
+        assert_eq!(link_blob_oid(&path).unwrap(), blob_oid(b"some/target"));
+    }
+
+    #[test]
+    fn test_hasher_waits_for_jobs() {
+        let hasher = BlobHasher::default();
+        let count = Arc::new(AtomicUsize::new(0));
+        for _ in 0..20 {
+            let count = Arc::clone(&count);
+            hasher.clone().spawn(move || {
+                blob_oid(&[0; 10000]);
+                count.fetch_add(1, Ordering::Relaxed);
+            });
+        }
+        hasher.wait();
+        assert_eq!(count.load(Ordering::Relaxed), 20);
+    }
+}
@@ -0,0 +1,345 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use globset::{GlobBuilder, GlobSet, GlobSetBuilder};
+use std::fs;
+use std::path::PathBuf;
+use std::sync::{Arc, OnceLock};
+
+/// The ignore rules in effect in a directory of the work tree.
+///
+/// Each ignore file is compiled into a single glob set, a `Layer`, which links to the layer of the
+/// closest directory above it with an ignore file of its own.  Directories share the layers of the
+/// directories above them, entering a directory without an ignore file adds no layer.
+///
+/// Nothing is read until a path is matched, an ignore file is only read and compiled the first
+/// time a path under its directory is matched.  Directories with only tracked files never match
+/// a path, so they never pay for their ignore files.
+#[derive(Debug, Clone)]
+pub struct Ignores(Arc<Directory>);
+
+#[derive(Debug)]
+struct Directory {
+    // The work tree relative path, "" for the root
+    path: String,
+    // The closest layer, the directory's own or the one of a directory above it
+    layer: Option<Arc<Layer>>,
+    parent: Option<Ignores>,
+    // Whether the directory, or one above it, is ignored.  Git doesn't add back files under an
+    // ignored directory, whatever the rules say about the files themselves.
+    excluded: OnceLock<bool>,
+}
+
+// The patterns of one ignore file, matched against paths relative to the file's directory
+#[derive(Debug)]
+struct Layer {
+    file: PathBuf,
+    rules: OnceLock<Option<Rules>>,
+    // The length of the work tree relative path of the directory, including the trailing "/"
+    prefix_length: usize,
+    parent: Option<Arc<Layer>>,
+}
+
+// The later of the matching patterns wins, the patterns are kept in the order of the file
+#[derive(Debug)]
+struct Rules {
+    globs: GlobSet,
+    patterns: Vec<Pattern>,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct Pattern {
+    // A "!" pattern, which adds back what an earlier pattern ignored
+    negated: bool,
+    // A pattern ending in "/", which only matches directories
+    directory_only: bool,
+}
+
+impl Ignores {
+    /// The rules above the root of the work tree, `excludes_file` is `core.excludesFile`.
+    pub fn root(excludes_file: Option<PathBuf>) -> Ignores {
+        Ignores(Arc::new(Directory {
+            path: String::new(),
+            layer: excludes_file.map(|file| Arc::new(Layer::new(file, "", None))),
+            parent: None,
+            excluded: OnceLock::from(false),
+        }))
+    }
+
+    /// The rules in effect in `directory`, whose ignore file, if it has one, is `ignore_file`.
+    /// `directory` is a work tree relative path directly below the directory of these rules, or
+    /// "" for the root of the work tree.
+    pub fn directory(&self, directory: &str, ignore_file: Option<PathBuf>) -> Ignores {
+        let parent_layer = self.0.layer.clone();
+        let layer = match ignore_file {
+            Some(file) => Some(Arc::new(Layer::new(file, directory, parent_layer))),
+            None => parent_layer,
+        };
+        Ignores(Arc::new(Directory {
+            path: directory.to_string(),
+            layer,
+            parent: Some(self.clone()),
+            excluded: OnceLock::new(),
+        }))
+    }
+
+    /// Whether the work tree relative `path`, an entry of the directory of these rules, is
+    /// ignored.
+    pub fn is_ignored(&self, path: &str, is_dir: bool) -> bool {
+        self.excluded() || self.matched(path, is_dir) == Some(true)
+    }
+
+    fn excluded(&self) -> bool {
+        let directory = &self.0;
+        *directory.excluded.get_or_init(|| match &directory.parent {
+            Some(parent) if !directory.path.is_empty() => parent.is_ignored(&directory.path, true),
+            Some(parent) => parent.excluded(),
+            None => false,
+        })
+    }
+
+    // Whether the last pattern to match `path` ignores it, `None` when no pattern matches.  The
+    // layers of deeper directories take precedence.
+    fn matched(&self, path: &str, is_dir: bool) -> Option<bool> {
+        let mut layer = self.0.layer.as_deref();
+        while let Some(current) = layer {
+            if let Some(ignored) = current.matched(path, is_dir) {
+                return Some(ignored);
+            }
+            layer = current.parent.as_deref();
+        }
+        None
+    }
+}
+
+impl Layer {
+    fn new(file: PathBuf, directory: &str, parent: Option<Arc<Layer>>) -> Layer {
+        let prefix_length = match directory {
+            "" => 0,
+            directory => directory.len() + 1,
+        };
+        Layer {
+            file,
+            rules: OnceLock::new(),
+            prefix_length,
+            parent,
+        }
+    }
+
+    fn matched(&self, path: &str, is_dir: bool) -> Option<bool> {
+        let rules = self.rules.get_or_init(|| {
+            let contents = fs::read_to_string(&self.file).ok()?;
+            Rules::new(&contents)
+        });
+        rules
+            .as_ref()?
+            .matched(path.get(self.prefix_length..)?, is_dir)
+    }
+}
+
+impl Rules {
+    // The rules of an ignore file with `contents`, `None` when the file has no patterns
+    fn new(contents: &str) -> Option<Rules> {
+        let mut builder = GlobSetBuilder::new();
+        let mut patterns = vec![];
+        for line in contents.lines() {
+            if let Some((glob, pattern)) = parse_line(line) {
+                // globset doesn't read backslash escapes on Windows unless told to
+                let glob = GlobBuilder::new(&glob)
+                    .literal_separator(true)
+                    .backslash_escape(true)
+                    .build();
+                if let Ok(glob) = glob {
+                    builder.add(glob);
+                    patterns.push(pattern);
+                }
+            }
+        }
+        if patterns.is_empty() {
+            return None;
+        }
+        Some(Rules {
+            globs: builder.build().ok()?,
+            patterns,
+        })
+    }
+
+    fn matched(&self, path: &str, is_dir: bool) -> Option<bool> {
+        // Most paths aren't matched at all, only those which are need to know by what
+        if !self.globs.is_match(path) {
+            return None;
+        }
+        let matches = self.globs.matches(path);
+        let pattern = matches
+            .iter()
+            .rev()
+            .map(|&index| self.patterns[index])
+            .find(|pattern| is_dir || !pattern.directory_only)?;
+        Some(!pattern.negated)
+    }
+}
+
+// The glob for a line of an ignore file, relative to the file's directory, `None` for blank lines
+// and comments
+fn parse_line(line: &str) -> Option<(String, Pattern)> {
+    let line = trim_trailing_spaces(line);
+    if line.is_empty() || line.starts_with('#') {
+        return None;
+    }
+    let (negated, line) = match line.strip_prefix('!') {
+        Some(rest) => (true, rest),
+        // A leading "!" or "#" can be escaped to be taken literally
+        None if line.starts_with("\\!") || line.starts_with("\\#") => (false, &line[1..]),
+        None => (false, line),
+    };
+    let (directory_only, line) = match line.strip_suffix('/') {
+        Some(rest) => (true, rest),
+        None => (false, line),
+    };
+    // A pattern with a "/" anywhere but the end only matches relative to the directory,
+    // otherwise it matches at any depth
+    let glob = match line.strip_prefix('/') {
+        Some(rest) => rest.to_string(),
+        None if line.contains('/') => line.to_string(),
+        None => format!("**/{}", line),
+    };
+    if glob.is_empty() {
+        return None;
+    }
+    let pattern = Pattern {
+        negated,
+        directory_only,
+    };
+    Some((glob, pattern))
+}
+
+// Trailing spaces are ignored unless they're escaped with a backslash
+fn trim_trailing_spaces(line: &str) -> &str {
+    let trimmed = line.trim_end_matches(' ');
+    match trimmed.ends_with('\\') && trimmed.len() < line.len() {
+        true => &line[..trimmed.len() + 1],
+        false => trimmed,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use temp_testdir::TempDir;
+
+    // The rules of ignore files with the given contents, in the directories they're paired with.
+    // Each directory is below the one before it.
+    fn rules(temp_dir: &TempDir, files: &[(&str, &str)]) -> Ignores {
+        let mut ignores = Ignores::root(None);
+        for (number, (directory, contents)) in files.iter().enumerate() {
+            let file = temp_dir.join(format!("ignore_{}", number));
+            fs::write(&file, contents).unwrap();
+            ignores = ignores.directory(directory, Some(file));
+        }
+        ignores
+    }
+
+    #[test]
+    fn test_parse_line() {
+        let pattern = |negated, directory_only| Pattern {
+            negated,
+            directory_only,
+        };
+        assert_eq!(parse_line("# comment"), None);
+        assert_eq!(parse_line("   "), None);
+        assert_eq!(
+            parse_line("*.o"),
+            Some((String::from("**/*.o"), pattern(false, false)))
+        );
+        assert_eq!(
+            parse_line("!/build/"),
+            Some((String::from("build"), pattern(true, true)))
+        );
+        assert_eq!(
+            parse_line("doc/*.html  "),
+            Some((String::from("doc/*.html"), pattern(false, false)))
+        );
+        assert_eq!(
+            parse_line("\\#file\\ "),
+            Some((String::from("**/#file\\ "), pattern(false, false)))
+        );
+    }
+
+    #[test]
+    fn test_escaped_wildcards_are_literal() {
+        let temp_dir = TempDir::default();
+        let ignores = rules(&temp_dir, &[("", "\\*.txt\n")]);
+        assert!(ignores.is_ignored("*.txt", false));
+        assert!(!ignores.is_ignored("notes.txt", false));
+    }
+
+    #[test]
+    fn test_unanchored_patterns_match_at_any_depth() {
+        let temp_dir = TempDir::default();
+        let ignores = rules(&temp_dir, &[("", "*.log\nbuild/\n")]);
+        assert!(ignores.is_ignored("out.log", false));
+        assert!(!ignores.is_ignored("out.txt", false));
+        let nested = ignores.directory("a", None).directory("a/b", None);
+        assert!(nested.is_ignored("a/b/out.log", false));
+        assert!(nested.is_ignored("a/b/build", true));
+        assert!(!nested.is_ignored("a/b/build", false));
+    }
+
+    #[test]
+    fn test_anchored_patterns_are_relative_to_their_directory() {
+        let temp_dir = TempDir::default();
+        let ignores = rules(
+            &temp_dir,
+            &[("", "/top.txt\n"), ("a", "/build\ndoc/*.html\n")],
+        );
+        assert!(ignores.is_ignored("a/build", true));
+        assert!(ignores.is_ignored("a/doc/index.html", false));
+        assert!(!ignores.is_ignored("a/top.txt", false));
+        let nested = ignores.directory("a/b", None);
+        assert!(!nested.is_ignored("a/b/build", true));
+    }
+
+    #[test]
+    fn test_deeper_and_later_patterns_take_precedence() {
+        let temp_dir = TempDir::default();
+        let ignores = rules(
+            &temp_dir,
+            &[("", "*.txt\n!keep.txt\n"), ("a", "!*.txt\nsecret.txt\n")],
+        );
+        assert!(!ignores.is_ignored("a/notes.txt", false));
+        assert!(ignores.is_ignored("a/secret.txt", false));
+        let sibling = rules(&temp_dir, &[("", "*.txt\n!keep.txt\n")]).directory("b", None);
+        assert!(sibling.is_ignored("b/notes.txt", false));
+        assert!(!sibling.is_ignored("b/keep.txt", false));
+    }
+
+    #[test]
+    fn test_nothing_is_added_back_under_an_ignored_directory() {
+        let temp_dir = TempDir::default();
+        let build = rules(
+            &temp_dir,
+            &[("", "build/\n!build/keep.txt\n"), ("build", "!*.txt")],
+        );
+        assert!(build.is_ignored("build/keep.txt", false));
+        assert!(build.is_ignored("build/other.txt", false));
+    }
+
+    #[test]
+    fn test_ignore_file_is_read_when_first_matched() {
+        let temp_dir = TempDir::default();
+        let file = temp_dir.join(".gitignore");
+        let ignores = Ignores::root(None).directory("", Some(file.clone()));
+        let tracked_only = ignores.directory("a", None);
+        fs::write(&file, "*.o").unwrap();
+        assert!(tracked_only.is_ignored("a/main.o", false));
+        fs::remove_file(&file).unwrap();
+        assert!(ignores.is_ignored("main.o", false));
+
+        let missing = Ignores::root(Some(temp_dir.join("missing")));
+        assert!(!missing.is_ignored("main.o", false));
+    }
+}
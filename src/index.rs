@@ -7,23 +7,39 @@
 
 use nom::bits;
 use nom::bytes::complete::tag;
+use nom::bytes::complete::take;
+use nom::bytes::complete::take_until;
+use nom::combinator::map;
+use nom::combinator::map_res;
+use nom::combinator::verify;
+use nom::multi::count;
 use nom::number::complete::be_u16;
 use nom::number::complete::be_u32;
+use nom::number::complete::be_u64;
+use nom::number::complete::be_u8;
 use nom::sequence::tuple;
 use nom::take;
 use nom::take_bits;
 use nom::tuple;
 
+use memmap2::Mmap;
 use nom::do_parse;
 use nom::IResult;
 use std::convert::TryInto;
 use std::fs::File;
+use std::hash::{BuildHasherDefault, Hasher};
 use std::io::Read;
-use std::path::Path;
+use std::iter::FromIterator;
+use std::ops::{Deref, Range};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, OnceLock, Weak};
+use std::time::SystemTime;
 
 use crate::direntry::{DirEntry, FileStat, ObjectType};
 
 use crate::error::StatusError;
+use crate::index_cache::IndexCache;
+use rayon::prelude::*;
 use std::collections::HashMap;
 
 impl From<nom::Err<nom::error::Error<&[u8]>>> for StatusError {
@@ -34,12 +50,13 @@ impl From<nom::Err<nom::error::Error<&[u8]>>> for StatusError {
     }
 }
 
-// A function for parsing the name size of an index entry.
+// A function for parsing the extended flag and the name size of an index entry.
 // This assumes the input is at the 16 bit flags field.
 //
 //      A 16-bit 'flags' field split into (high to low bits)
 //      - 1-bit assume-valid flag
-//      - 1-bit extended flag (must be zero in version 2)
+//      - 1-bit extended flag (must be zero in version 2), when set a second 16-bit flags field
+//        follows
 //      - 2-bit stage (during merge)
 //      - 12-bit name length if the length is less than 0xFFF; otherwise 0xFFF is stored in this
 //        field.
@@ -55,15 +72,258 @@ impl From<nom::Err<nom::error::Error<&[u8]>>> for StatusError {
 //
 // Also trying to put this as a function in the impl block for Index resulted in some compilation
 // errors.  Not sure on why, my macro knowledge is next to nothing.
-fn parse_name_size(input: &[u8]) -> IResult<&[u8], u16> {
-    let (input, b): (&[u8], (u8, u8, u16)) = do_parse!(
+fn parse_flags(input: &[u8]) -> IResult<&[u8], (bool, u16)> {
+    let (input, b): (&[u8], (u8, u8, u8, u16)) = do_parse!(
         input,
-        b: bits!(tuple!(take_bits!(2u8), take_bits!(2u8), take_bits!(12u16))) >> (b)
+        b: bits!(tuple!(
+            take_bits!(1u8),
+            take_bits!(1u8),
+            take_bits!(2u8),
+            take_bits!(12u16)
+        )) >> (b)
     )?;
     // I tried to just return the u16 from the do_parse macro, but I kept hitting compiler errors
     // so I decided to fall back to full parse there and access the tuple entry here outside of the
     // do_parse
-    Ok((input, b.2))
+    Ok((input, (b.1 == 1, b.3)))
+}
+
+// Parses the ASCII decimal numbers used in the cache tree extension
+fn parse_decimal<T: std::str::FromStr>(digits: &[u8]) -> Result<T, ()> {
+    let digits = std::str::from_utf8(digits).map_err(|_| ())?;
+    digits.parse().map_err(|_| ())
+}
+
+// Parses the variable width integer used for the prefix compression of version 4 paths.  This is
+// the same encoding git uses for offsets in packs, 7 bits per byte with the high bit meaning
+// there is another byte, and one added for every continuation so there is only one encoding for
+// each value.
+fn parse_varint(input: &[u8]) -> IResult<&[u8], usize> {
+    let (mut input, mut byte) = be_u8(input)?;
+    let mut value = (byte & 0x7f) as usize;
+    while byte & 0x80 != 0 {
+        let (local_input, local_byte) = be_u8(input)?;
+        value = ((value + 1) << 7) | (local_byte & 0x7f) as usize;
+        input = local_input;
+        byte = local_byte;
+    }
+    Ok((input, value))
+}
+
+// Parses an EWAH compressed bitmap, returning one `bool` per bit.
+//
+//      - 32-bit number of bits in the uncompressed bitmap
+//      - 32-bit number of 64-bit words
+//      - The 64-bit words, each run length word is followed by its literal words
+//      - 32-bit position of the last run length word
+//
+// A run length word is split into (low to high bits) the bit value of the run, a 32-bit count of
+// 64-bit words with every bit set to the run's value and a 31-bit count of literal words.
+fn parse_ewah(input: &[u8]) -> IResult<&[u8], Vec<bool>> {
+    let (input, (bit_count, word_count)) = tuple((be_u32, be_u32))(input)?;
+    let (input, (words, _)) = tuple((count(be_u64, word_count as usize), be_u32))(input)?;
+    let bit_count = bit_count as usize;
+    let mut bits = vec![false; bit_count];
+    let mut position = 0;
+    let mut words = words.iter();
+    while let Some(run_length_word) = words.next() {
+        let run_length = ((run_length_word >> 1) & 0xffff_ffff) as usize * 64;
+        if run_length_word & 1 == 1 {
+            let end = bit_count.min(position + run_length);
+            bits[position.min(end)..end]
+                .iter_mut()
+                .for_each(|b| *b = true);
+        }
+        position += run_length;
+        for literal in words.by_ref().take((run_length_word >> 33) as usize) {
+            for bit in 0..64 {
+                if literal & (1 << bit) != 0 && position + bit < bit_count {
+                    bits[position + bit] = true;
+                }
+            }
+            position += 64;
+        }
+    }
+    Ok((input, bits))
+}
+
+/// The raw bytes of an index file.
+///
+/// The entries of an `Index` borrow their names directly from these bytes, so an `IndexFile` needs
+/// to outlive any `Index` created from it.
+///
+/// Version 4 indices prefix compress the paths, so there are no full paths to borrow.  For these
+/// the paths are decoded once, the first time the entries are parsed, and the entries borrow from
+/// that instead.
+#[derive(Debug)]
+pub struct IndexFile {
+    path: PathBuf,
+    contents: Contents,
+    paths: OnceLock<Option<DecodedPaths>>,
+    modified: Option<SystemTime>,
+    cache: Option<IndexCache>,
+    // The shared index of a split index, loaded when the entries are first parsed
+    shared: OnceLock<Arc<IndexFile>>,
+}
+
+/// The full paths of the entries in a version 4 index.
+#[derive(Debug, Default)]
+struct DecodedPaths {
+    // Every path back to back
+    names: String,
+    // The end of each entry's path in `names`
+    ends: Vec<usize>,
+}
+
+impl DecodedPaths {
+    fn get(&self, entry: usize) -> &str {
+        let start = match entry {
+            0 => 0,
+            _ => self.ends[entry - 1],
+        };
+        &self.names[start..self.ends[entry]]
+    }
+}
+
+#[derive(Debug)]
+enum Contents {
+    Mapped(Mmap),
+    Owned(Vec<u8>),
+}
+
+impl Deref for Contents {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            Contents::Mapped(map) => map,
+            Contents::Owned(buffer) => buffer,
+        }
+    }
+}
+
+impl IndexFile {
+    /// Memory maps the index file at `path`.
+    ///
+    /// Nothing is copied out of the file, the pages are only read in as the entries are parsed.
+    /// Falls back to reading the file when it can't be mapped, for instance an empty file.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the index file, usually `.git/index`.
+    pub fn open(path: &Path) -> Result<IndexFile, StatusError> {
+        let file = File::open(path)?;
+        let modified = file.metadata().and_then(|m| m.modified()).ok();
+
+        // Safety: git never modifies an index in place, it writes `index.lock` and renames it over
+        // the top, so the mapped pages stay valid for the life of the map.
+        match unsafe { Mmap::map(&file) } {
+            Ok(map) => {
+                let contents = Contents::Mapped(map);
+                Ok(IndexFile::new(PathBuf::from(path), contents, modified))
+            }
+            Err(_) => IndexFile::read(path),
+        }
+    }
+
+    /// Reads the index file at `path` into memory.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the index file, usually `.git/index`.
+    pub fn read(path: &Path) -> Result<IndexFile, StatusError> {
+        let mut buffer: Vec<u8> = Vec::new();
+        let mut file = File::open(path)?;
+        file.read_to_end(&mut buffer)?;
+        let modified = file.metadata().and_then(|m| m.modified()).ok();
+        Ok(IndexFile::new(
+            PathBuf::from(path),
+            Contents::Owned(buffer),
+            modified,
+        ))
+    }
+
+    /// Memory maps the index file at `path`, along with the cache of its parsed entries at
+    /// `cache_path`.
+    ///
+    /// When the cache was written for this same index file, `Index::new()` loads the entries from
+    /// the cache rather than parsing them.  Otherwise `Index::new()` parses the entries and
+    /// replaces the cache.  See `IndexCache` for how a cache is matched to its index file.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the index file, usually `.git/index`.
+    /// * `cache_path` - The path to the cache, usually `.git/win-git-status/index.cache`.
+    pub fn open_cached(path: &Path, cache_path: &Path) -> Result<IndexFile, StatusError> {
+        let mut file = IndexFile::open(path)?;
+        file.cache = IndexCache::open(cache_path, &file.contents, file.modified);
+        Ok(file)
+    }
+
+    fn new(path: PathBuf, contents: Contents, modified: Option<SystemTime>) -> IndexFile {
+        IndexFile {
+            path,
+            contents,
+            paths: OnceLock::new(),
+            modified,
+            cache: None,
+            shared: OnceLock::new(),
+        }
+    }
+
+    /// The path this index file was loaded from.
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    // The shared index `oid` of this split index.  It's held for as long as this file so the
+    // merged entries can borrow from it too.
+    fn shared_index(&self, oid: &[u8; 20]) -> Result<&IndexFile, StatusError> {
+        if let Some(shared) = self.shared.get() {
+            return Ok(shared);
+        }
+        let git_dir = self.path.parent().ok_or_else(|| StatusError {
+            message: format!("Unable to find the shared index of {:?}", self.path),
+        })?;
+        let _ = self.shared.set(shared_index(git_dir, oid)?);
+        Ok(self.shared.get().unwrap())
+    }
+}
+
+// The shared indices of split indices which are in use.  A shared index is named by its
+// checksum, so when the same name shows up in another repo, like a submodule created from the
+// same index, the file already loaded is reused.  Only the split index files keep them alive,
+// git writes a new shared index each time the split is rebuilt and the old ones are unmapped
+// once nothing uses them.
+static SHARED_INDICES: Mutex<Vec<([u8; 20], Weak<IndexFile>)>> = Mutex::new(Vec::new());
+
+// The shared index `$GIT_DIR/sharedindex.<oid>` of a split index.
+fn shared_index(git_dir: &Path, oid: &[u8; 20]) -> Result<Arc<IndexFile>, StatusError> {
+    let mut shared_indices = SHARED_INDICES.lock().unwrap();
+    shared_indices.retain(|(_, file)| file.strong_count() > 0);
+    let loaded = shared_indices.iter().find(|(o, _)| o == oid);
+    if let Some(file) = loaded.and_then(|(_, file)| file.upgrade()) {
+        return Ok(file);
+    }
+    let hex: String = oid.iter().map(|b| format!("{:02x}", b)).collect();
+    let path = git_dir.join(format!("sharedindex.{}", hex));
+    let file = Arc::new(IndexFile::open(&path)?);
+    shared_indices.push((*oid, Arc::downgrade(&file)));
+    Ok(file)
+}
+
+impl From<Vec<u8>> for IndexFile {
+    fn from(buffer: Vec<u8>) -> IndexFile {
+        IndexFile::new(PathBuf::new(), Contents::Owned(buffer), None)
+    }
+}
+
+impl Deref for IndexFile {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.contents
+    }
 }
 
 /// An index of a repo.
@@ -72,16 +332,411 @@ fn parse_name_size(input: &[u8]) -> IResult<&[u8], u16> {
 /// This is meant to be a representation of the git index file.  The documentation for this format
 /// can be found https://git-scm.com/docs/index-format.
 ///
+/// The entries borrow their names from the `IndexFile` the index was parsed from, avoiding an
+/// allocation per entry.
+///
 /// Some common git internal terms.
 ///
 /// - `oid` - Object ID.  This is often the SHA of an item.  It could be a commit, file blob, tree,
 ///     etc.
 #[derive(Debug, Default)]
-pub struct Index {
+pub struct Index<'a> {
     path: String,
     oid: [u8; 20],
     header: Header,
-    pub entries: HashMap<String, Vec<DirEntry>>,
+    pub entries: IndexEntries<'a>,
+    cache_tree: Option<CacheTree<'a>>,
+    untracked_cache: Option<UntrackedCache<'a>>,
+    fsmonitor_cache: Option<FsMonitorCache<'a>>,
+    modified: Option<SystemTime>,
+    // Whether the entries were combined with those of a shared index
+    split: bool,
+}
+
+// A fast non-cryptographic hasher for looking up directories, the multiply and rotate of
+// rustc's FxHash.  The keys come from the index so there is no need to resist collision attacks.
+#[derive(Default, Clone, Copy)]
+struct DirectoryHasher(u64);
+
+impl DirectoryHasher {
+    fn add(&mut self, word: u64) {
+        self.0 = (self.0.rotate_left(5) ^ word).wrapping_mul(0x517c_c1b7_2722_0a95);
+    }
+}
+
+impl Hasher for DirectoryHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        let mut chunks = bytes.chunks_exact(8);
+        for chunk in &mut chunks {
+            self.add(u64::from_le_bytes(chunk.try_into().unwrap()));
+        }
+        for byte in chunks.remainder() {
+            self.add(*byte as u64);
+        }
+    }
+
+    fn write_u8(&mut self, byte: u8) {
+        self.add(byte as u64);
+    }
+
+    fn finish(&self) -> u64 {
+        self.0
+    }
+}
+
+type DirectoryMap<'a, V> = HashMap<&'a str, V, BuildHasherDefault<DirectoryHasher>>;
+
+/// The entries of an index grouped by directory.
+///
+/// All of the entries are kept in one array sorted by directory and then by name, so the entries
+/// of a directory are one contiguous slice.  The directories are kept in a table sorted by path
+/// along with the range of their entries, every ancestor of a directory is in the table even when
+/// it has no entries of its own.
+#[derive(PartialEq, Eq, Debug, Default)]
+pub struct IndexEntries<'a> {
+    entries: Vec<DirEntry<'a>>,
+    directories: Vec<(&'a str, Range<usize>)>,
+    // The position of each directory in `directories`
+    positions: DirectoryMap<'a, usize>,
+}
+
+/// Collects the entries of an index, in index order, to build `IndexEntries`.
+///
+/// In index order the entries of a directory are in order by name, but may be interleaved with
+/// the entries of its subdirectories, "a/b/c" comes between "a/a" and "a/d".  Each entry gets
+/// the number of its directory as it's added, the entries are only moved when a directory turns
+/// up again after another, or the directories turn up out of order.
+#[derive(Default)]
+struct IndexEntriesBuilder<'a> {
+    entries: Vec<DirEntry<'a>>,
+    // The number of the directory of each entry
+    numbers: Vec<u32>,
+    // The directories in the order they turned up, with the number of entries in each
+    directories: Vec<(&'a str, usize)>,
+    directory_numbers: DirectoryMap<'a, u32>,
+    // The directory of the last entry with its number
+    last: Option<(&'a str, u32)>,
+    // Whether the entries have needed to be moved
+    interleaved: bool,
+}
+
+impl<'a> IndexEntriesBuilder<'a> {
+    fn with_capacity(capacity: usize) -> IndexEntriesBuilder<'a> {
+        IndexEntriesBuilder {
+            entries: Vec::with_capacity(capacity),
+            numbers: Vec::with_capacity(capacity),
+            ..Default::default()
+        }
+    }
+
+    fn push(&mut self, directory: &'a str, entry: DirEntry<'a>) {
+        let number = match self.last {
+            Some((last, number)) if last == directory => number,
+            _ => {
+                let next = self.directories.len() as u32;
+                let number = *self.directory_numbers.entry(directory).or_insert(next);
+                if number == next {
+                    let in_order = !matches!(self.last, Some((last, _)) if last >= directory);
+                    self.interleaved |= !in_order;
+                    self.directories.push((directory, 0));
+                } else {
+                    self.interleaved = true;
+                }
+                self.last = Some((directory, number));
+                number
+            }
+        };
+        self.directories[number as usize].1 += 1;
+        self.numbers.push(number);
+        self.entries.push(entry);
+    }
+
+    // The entries paired with their directory, in the order they were added
+    fn into_entries(self) -> impl Iterator<Item = (&'a str, DirEntry<'a>)> {
+        let directories = self.directories;
+        self.numbers
+            .into_iter()
+            .zip(self.entries)
+            .map(move |(number, entry)| (directories[number as usize].0, entry))
+    }
+
+    fn build(self) -> IndexEntries<'a> {
+        let mut order: Vec<u32> = (0..self.directories.len() as u32).collect();
+        if self.interleaved {
+            order.sort_by_key(|number| self.directories[*number as usize].0);
+        }
+        let mut starts = vec![0; self.directories.len()];
+        let mut table = Vec::with_capacity(self.directories.len());
+        let mut start = 0;
+        for number in order {
+            let (directory, count) = self.directories[number as usize];
+            starts[number as usize] = start;
+            table.push((directory, start..start + count));
+            start += count;
+        }
+
+        let mut entries = self.entries;
+        if self.interleaved {
+            // Each entry's directory number becomes its destination, then the entries are
+            // swapped into place, every swap puts at least one entry where it belongs
+            let mut destinations = self.numbers;
+            for destination in destinations.iter_mut() {
+                let start = &mut starts[*destination as usize];
+                *destination = *start as u32;
+                *start += 1;
+            }
+            for position in 0..entries.len() {
+                while destinations[position] as usize != position {
+                    let destination = destinations[position] as usize;
+                    entries.swap(position, destination);
+                    destinations.swap(position, destination);
+                }
+            }
+        }
+        // Sparse directories, "dir/", can come after files starting with the same name, like
+        // "dir.txt", and the new entries of a split index are added to the end
+        for (_, range) in &table {
+            let directory_entries = &mut entries[range.clone()];
+            if directory_entries.windows(2).any(|w| w[0].name > w[1].name) {
+                directory_entries.sort_by(|a, b| a.name.cmp(b.name));
+            }
+        }
+
+        // Directories with only subdirectories have no entries to be found from
+        let mut ancestors = vec![];
+        for (directory, _) in &table {
+            let mut ancestor = *directory;
+            while !ancestor.is_empty() {
+                ancestor = ancestor.rfind('/').map_or("", |end| &ancestor[..end]);
+                if self.directory_numbers.contains_key(ancestor) || ancestors.contains(&ancestor) {
+                    break;
+                }
+                ancestors.push(ancestor);
+            }
+        }
+        if !ancestors.is_empty() {
+            table.extend(ancestors.into_iter().map(|a| (a, 0..0)));
+            table.sort_by(|a, b| a.0.cmp(b.0));
+        }
+
+        IndexEntries::from_parts(entries, table)
+    }
+}
+
+impl<'a> FromIterator<(&'a str, DirEntry<'a>)> for IndexEntries<'a> {
+    fn from_iter<I: IntoIterator<Item = (&'a str, DirEntry<'a>)>>(entries: I) -> Self {
+        let mut builder = IndexEntriesBuilder::default();
+        for (directory, entry) in entries {
+            builder.push(directory, entry);
+        }
+        builder.build()
+    }
+}
+
+impl<'a> IndexEntries<'a> {
+    // The entries grouped by directory along with the sorted table of directory ranges, as
+    // `parts()` returns them
+    pub(crate) fn from_parts(
+        entries: Vec<DirEntry<'a>>,
+        directories: Vec<(&'a str, Range<usize>)>,
+    ) -> IndexEntries<'a> {
+        let positions = directories
+            .iter()
+            .enumerate()
+            .map(|(position, (directory, _))| (*directory, position))
+            .collect();
+        IndexEntries {
+            entries,
+            directories,
+            positions,
+        }
+    }
+
+    // Every entry, grouped by directory, along with the table of directory ranges
+    pub(crate) fn parts(&self) -> (&[DirEntry<'a>], &[(&'a str, Range<usize>)]) {
+        (&self.entries, &self.directories)
+    }
+
+    // The position of `directory` in the directory table
+    fn position(&self, directory: &str) -> Option<usize> {
+        self.positions.get(directory).copied()
+    }
+
+    /// The entries directly in `directory`, sorted by name.
+    ///
+    /// # Arguments
+    ///
+    /// * `directory` - The path relative to the root of the repo, using "/" as the separator.
+    ///   The root is an empty string.
+    pub fn get(&self, directory: &str) -> Option<&[DirEntry<'a>]> {
+        let position = self.position(directory)?;
+        Some(&self.entries[self.directories[position].1.clone()])
+    }
+
+    /// The entries directly in `directory`, sorted by name.
+    pub fn get_mut(&mut self, directory: &str) -> Option<&mut [DirEntry<'a>]> {
+        let position = self.position(directory)?;
+        Some(&mut self.entries[self.directories[position].1.clone()])
+    }
+
+    /// Whether `directory` has any entries, directly or in its subdirectories.
+    pub fn contains_key(&self, directory: &str) -> bool {
+        self.position(directory).is_some()
+    }
+
+    /// The names of the directories directly in `directory` which have entries, in sorted order.
+    pub fn subdirectories(&self, directory: &str) -> Vec<&'a str> {
+        let prefix = match directory {
+            "" => String::new(),
+            directory => format!("{}/", directory),
+        };
+        let mut position = self.directories.partition_point(|d| d.0 <= prefix.as_str());
+        let mut names = vec![];
+        while let Some(&(path, _)) = self.directories.get(position) {
+            let name = match path.strip_prefix(prefix.as_str()) {
+                Some(name) => name,
+                None => break,
+            };
+            match name.find('/') {
+                None => {
+                    names.push(name);
+                    position += 1;
+                }
+                // The rest of a subdirectory's descendants are skipped over in one go
+                Some(end) => {
+                    let child = &path[..prefix.len() + end + 1];
+                    let rest = &self.directories[position..];
+                    position += rest.partition_point(|d| d.0.starts_with(child));
+                }
+            }
+        }
+        names
+    }
+
+    /// The directories, in sorted order.
+    pub fn keys(&self) -> impl Iterator<Item = &'a str> + '_ {
+        self.directories.iter().map(|d| d.0)
+    }
+
+    /// The directories along with their entries, in sorted order.
+    pub fn iter(&self) -> impl Iterator<Item = (&'a str, &[DirEntry<'a>])> {
+        self.directories
+            .iter()
+            .map(move |(directory, range)| (*directory, &self.entries[range.clone()]))
+    }
+
+    /// The number of directories.
+    pub fn len(&self) -> usize {
+        self.directories.len()
+    }
+
+    /// Whether there are no directories, meaning there are no entries.
+    pub fn is_empty(&self) -> bool {
+        self.directories.is_empty()
+    }
+}
+
+impl<'a> std::ops::Index<&str> for IndexEntries<'a> {
+    type Output = [DirEntry<'a>];
+
+    fn index(&self, directory: &str) -> &[DirEntry<'a>] {
+        self.get(directory).expect("no entries for directory")
+    }
+}
+
+/// A directory from the cache tree (TREE) extension.
+///
+/// The cache tree records the tree object each directory of the index would be written as.  When
+/// an entry is added or removed git invalidates the directories leading to it, so a directory
+/// that still has an `oid` is known to be unchanged since the tree was last written.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+pub struct CacheTree<'a> {
+    /// The name of the directory relative to its parent, empty for the root.
+    pub name: &'a str,
+    /// The tree object id, `None` when the directory has been invalidated.
+    pub oid: Option<[u8; 20]>,
+    pub subtrees: Vec<CacheTree<'a>>,
+}
+
+/// The untracked cache (UNTR) extension.
+///
+/// The cache remembers the untracked files of each directory along with the stat data of the
+/// directory at the time.  Adding or removing a file changes the modification time of the
+/// directory it's in, so while the stat data matches the untracked files can be reused without
+/// reading the directory.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+pub struct UntrackedCache<'a> {
+    /// The environments the cache is valid for, "Location <work tree>, system <os name>".
+    pub idents: Vec<&'a str>,
+    /// The stat data of `$GIT_DIR/info/exclude`, all zeros when it doesn't exist.
+    pub info_exclude: FileStat,
+    /// The stat data of `core.excludesFile`, all zeros when it doesn't exist.
+    pub excludes_file: FileStat,
+    /// The flags git used when listing the untracked files.
+    pub dir_flags: u32,
+    /// The name of the per directory exclude file, ".gitignore".
+    pub exclude_per_dir: &'a str,
+    pub root: Option<UntrackedDirectory<'a>>,
+}
+
+/// A directory of the untracked cache.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+pub struct UntrackedDirectory<'a> {
+    /// The name of the directory relative to its parent, empty for the root.
+    pub name: &'a str,
+    /// The untracked files and directories, directories end in "/".
+    pub untracked: Vec<&'a str>,
+    pub subdirectories: Vec<UntrackedDirectory<'a>>,
+    /// The stat data of the directory when `untracked` was recorded, `None` when invalidated.
+    pub stat: Option<FileStat>,
+    /// Only recorded whether the directory has any untracked files.
+    pub check_only: bool,
+    /// The object id of the directory's exclude file, `None` when there isn't one.
+    pub exclude_oid: Option<[u8; 20]>,
+}
+
+/// The file system monitor cache (FSMN) extension.
+///
+/// Records where the file system monitor was up to when the index was written, along with the
+/// entries which weren't known to be unchanged at the time.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+pub struct FsMonitorCache<'a> {
+    /// The token to give the fsmonitor hook, version 1 of the extension has a timestamp instead.
+    pub token: Option<&'a str>,
+    /// The full paths of the entries which may have changed.
+    pub dirty: Vec<&'a str>,
+}
+
+impl<'a> UntrackedDirectory<'a> {
+    // Calls `f` on this directory and all of its subdirectories, in the depth first order the
+    // directories are stored in the extension.
+    fn visit<F: FnMut(&mut UntrackedDirectory<'a>)>(&mut self, f: &mut F) {
+        f(self);
+        for subdirectory in &mut self.subdirectories {
+            subdirectory.visit(f);
+        }
+    }
+}
+
+/// The entries of an index along with what else about them is costly to work out, this is what
+/// an `IndexCache` holds.
+#[derive(PartialEq, Eq, Debug, Default)]
+pub(crate) struct ParsedEntries<'a> {
+    pub entries: IndexEntries<'a>,
+    /// The offset from the start of the index file to the extensions.
+    pub end: usize,
+    pub fsmonitor_cache: Option<FsMonitorCache<'a>>,
+}
+
+/// The split index (link) extension, how the entries of the index are combined with those of the
+/// shared index.
+#[derive(PartialEq, Eq, Debug, Default, Clone)]
+struct SplitIndexLink {
+    // The object id of the shared index, `$GIT_DIR/sharedindex.<oid>`
+    oid: [u8; 20],
+    // One bit per shared index entry
+    deleted: Vec<bool>,
+    replaced: Vec<bool>,
 }
 
 #[derive(PartialEq, Eq, Debug, Default, Clone)]
@@ -90,115 +745,802 @@ struct Header {
     entries: u32,
 }
 
-impl Index {
-    /// Returns the index for the git repo at `path`.
+// The size of the header, "DIRC", version, and number of entries.
+const HEADER_SIZE: usize = 12;
+
+// The size of the trailing checksum of the index file.
+const CHECKSUM_SIZE: usize = 20;
+
+/// An extension found after the entries of the index, the data is everything after the signature
+/// and size.
+#[derive(PartialEq, Eq, Debug, Clone)]
+struct Extension<'a> {
+    signature: &'a [u8],
+    data: &'a [u8],
+}
+
+/// The fields of an entry which come before the path.
+#[derive(PartialEq, Eq, Debug, Clone)]
+struct EntryFields {
+    stat: FileStat,
+    mode: u16,
+    sha: [u8; 20],
+    name_size: u16,
+    // Offset from the start of the entry to the end of the flags, 62 or 64 with extended flags
+    flags_end: usize,
+    // From the extended flags, the entry is outside of the sparse checkout
+    skip_worktree: bool,
+}
+
+/// A block of entries as listed in the Index Entry Offset Table (IEOT) extension.
+#[derive(PartialEq, Eq, Debug, Clone)]
+struct EntryBlock {
+    // Offset from the start of the index file to the first entry of the block
+    offset: usize,
+    // The number of the first entry in the block, counting from the start of the index
+    first_entry: usize,
+    entries: usize,
+}
+
+impl<'a> Index<'a> {
+    /// Returns the index parsed from `file`.
+    ///
+    /// # Arguments
+    ///
+    /// * `file` - The index file, see `IndexFile::open()`.
+    ///
+    /// When the index has an entry offset table, the blocks of entries are parsed in parallel.
+    /// Otherwise the entries are parsed one after the other.
+    ///
+    /// A split index, `core.splitIndex`, only holds the changes to the shared index it links to.
+    /// The shared index is loaded from next to `file` and the entries of both are combined.
+    pub fn new(file: &'a IndexFile) -> Result<Index<'a>, StatusError> {
+        let oid: [u8; 20] = [0; 20];
+        let (_, header) = Index::read_header(file)?;
+        let parsed = match file.cache.as_ref().and_then(|cache| cache.load()) {
+            Some(parsed) => parsed,
+            None => {
+                let parsed = Index::parse_entries(file, &header)?;
+                if let Some(cache) = &file.cache {
+                    cache.store(&parsed);
+                }
+                parsed
+            }
+        };
+
+        let (_, extensions) = Index::read_extensions(Index::extensions(file, parsed.end))?;
+        let cache_tree = match extensions.iter().find(|e| e.signature == b"TREE") {
+            Some(extension) => Some(Index::read_cache_tree(extension.data)?.1),
+            None => None,
+        };
+        let untracked_cache = match extensions.iter().find(|e| e.signature == b"UNTR") {
+            Some(extension) => Some(Index::read_untracked_cache(extension.data)?.1),
+            None => None,
+        };
+        let split = extensions
+            .iter()
+            .any(|e| e.signature == b"link" && e.data.get(..20) != Some(&[0; 20][..]));
+        let index = Index {
+            path: String::from(file.path().to_str().unwrap()),
+            oid,
+            header,
+            entries: parsed.entries,
+            cache_tree,
+            untracked_cache,
+            fsmonitor_cache: parsed.fsmonitor_cache,
+            modified: file.modified,
+            split,
+        };
+        Ok(index)
+    }
+
+    /// Parses the entries of `file`, combining them with the shared index of a split index.
+    fn parse_entries(
+        file: &'a IndexFile,
+        header: &Header,
+    ) -> Result<ParsedEntries<'a>, StatusError> {
+        let paths = Index::decoded_paths(file, header)?;
+        let mut entries = IndexEntriesBuilder::with_capacity(header.entries as usize);
+        let end_of_entries = Index::read_all_entries(file, header, paths, |directory, entry| {
+            entries.push(directory, entry)
+        })?;
+
+        let (_, extensions) = Index::read_extensions(Index::extensions(file, end_of_entries))?;
+        let split_index = match extensions.iter().find(|e| e.signature == b"link") {
+            Some(extension) => Some(Index::read_split_index_link(extension.data)?.1),
+            None => None,
+        };
+        let split_index = split_index.filter(|link| link.oid != [0; 20]);
+        if let Some(link) = &split_index {
+            entries = Index::merge_shared_index(file, entries, link)?;
+        }
+        let fsmonitor_cache = match extensions.iter().find(|e| e.signature == b"FSMN") {
+            // The dirty bits of a split index are numbered by the merged entries, rather than
+            // work out the merged order it's treated as if the extension wasn't there.
+            Some(_) if split_index.is_some() => None,
+            Some(extension) => {
+                let (_, (token, dirty)) = Index::read_fsmonitor_cache(extension.data)?;
+                let numbers: Vec<usize> = dirty
+                    .iter()
+                    .take(header.entries as usize)
+                    .enumerate()
+                    .filter_map(|(number, dirty)| if *dirty { Some(number) } else { None })
+                    .collect();
+                let dirty = Index::entry_paths(file, header, paths, &numbers)?;
+                Some(FsMonitorCache { token, dirty })
+            }
+            None => None,
+        };
+        Ok(ParsedEntries {
+            entries: entries.build(),
+            end: end_of_entries,
+            fsmonitor_cache,
+        })
+    }
+
+    // The extensions of `file`, which start at `end_of_entries`.  Being lenient with a missing
+    // checksum, only an index without extensions can get away without one.
+    fn extensions(file: &'a IndexFile, end_of_entries: usize) -> &'a [u8] {
+        file.get(end_of_entries..file.len().saturating_sub(CHECKSUM_SIZE))
+            .unwrap_or_default()
+    }
+
+    /// Returns the cache tree of the index, when the index has one.
+    pub fn cache_tree(&self) -> Option<&CacheTree<'a>> {
+        self.cache_tree.as_ref()
+    }
+
+    /// Returns the untracked cache of the index, when the index has one.
+    pub fn untracked_cache(&self) -> Option<&UntrackedCache<'a>> {
+        self.untracked_cache.as_ref()
+    }
+
+    /// Returns the file system monitor cache of the index, when the index has one.
+    pub fn fsmonitor_cache(&self) -> Option<&FsMonitorCache<'a>> {
+        self.fsmonitor_cache.as_ref()
+    }
+
+    /// The path of the index file this index was parsed from.
+    pub fn path(&self) -> &Path {
+        Path::new(&self.path)
+    }
+
+    /// When the index file was last written, files modified at or after this time may have
+    /// changed without their stat data changing.
+    pub fn modified(&self) -> Option<SystemTime> {
+        self.modified
+    }
+
+    /// Whether this is a split index, `core.splitIndex`, its entries were combined with those of
+    /// a shared index.
+    pub fn is_split(&self) -> bool {
+        self.split
+    }
+
+    /// Calls `f` with the offset from the start of `file` to each entry, along with the entry's
+    /// full path, in the order they are stored.  Returns the offset to the end of the entries.
+    pub(crate) fn visit_entry_offsets<F: FnMut(usize, &'a str)>(
+        file: &'a IndexFile,
+        mut f: F,
+    ) -> Result<usize, StatusError> {
+        let (mut contents, header) = Index::read_header(file)?;
+        let paths = Index::decoded_paths(file, &header)?;
+        for entry_number in 0..header.entries as usize {
+            let offset = file.len() - contents.len();
+            let (local_contents, name) = match paths {
+                None => {
+                    let (local_contents, (_, name)) = Index::read_entry_path(contents)?;
+                    (local_contents, name)
+                }
+                Some(paths) => {
+                    let (local_contents, _) =
+                        tuple((Index::read_entry_fields, Index::read_compressed_path))(contents)?;
+                    (local_contents, paths.get(entry_number))
+                }
+            };
+            f(offset, name);
+            contents = local_contents;
+        }
+        Ok(file.len() - contents.len())
+    }
+
+    /// Returns the oid(Object ID) for the index.
+    ///
+    /// The object ID of an index is the object ID of the tree which the index represents.
+    pub fn oid(&self) -> &[u8] {
+        &self.oid
+    }
+
+    /// Reads in the header from the provided stream
+    ///
+    ///
+    fn read_header(stream: &[u8]) -> IResult<&[u8], Header> {
+        let signature = tag("DIRC");
+
+        let (input, (_, version, entries)) = tuple((signature, be_u32, be_u32))(stream)?;
+
+        Ok((input, Header { version, entries }))
+    }
+
+    /// The decoded paths of `file` when it's a version 4 index.
+    fn decoded_paths(
+        file: &'a IndexFile,
+        header: &Header,
+    ) -> Result<Option<&'a DecodedPaths>, StatusError> {
+        match header.version {
+            2 | 3 => Ok(None),
+            4 => match file
+                .paths
+                .get_or_init(|| Index::decode_paths(file, header).ok())
+            {
+                Some(paths) => Ok(Some(paths)),
+                None => Err(StatusError {
+                    message: format!("Unable to decode the paths of {:?}", file.path()),
+                }),
+            },
+            version => Err(StatusError {
+                message: format!("Unsupported index version {}", version),
+            }),
+        }
+    }
+
+    /// Reads in all of the entries of `file`, calling `f` with each entry and the directory it
+    /// belongs in, in the order they are stored.  Returns the offset to the extensions.
+    ///
+    /// When the index has an entry offset table, the blocks of entries are parsed in parallel.
+    fn read_all_entries<F: FnMut(&'a str, DirEntry<'a>)>(
+        file: &'a IndexFile,
+        header: &Header,
+        paths: Option<&'a DecodedPaths>,
+        mut f: F,
+    ) -> Result<usize, StatusError> {
+        match Index::entry_blocks(file, header) {
+            Some((extensions_offset, blocks)) => {
+                let parsed: Result<Vec<_>, StatusError> = blocks
+                    .par_iter()
+                    .map(|block| {
+                        let stream = &file[block.offset..];
+                        Index::read_entries(stream, block.first_entry, block.entries, paths)
+                    })
+                    .collect();
+                for (directory, entry) in parsed?.into_iter().flatten() {
+                    f(directory, entry);
+                }
+                Ok(extensions_offset)
+            }
+            None => {
+                let (mut contents, _) = Index::read_header(file)?;
+                for entry_number in 0..header.entries as usize {
+                    let (local_contents, (directory, entry)) = match paths {
+                        None => Index::read_entry(contents)?,
+                        Some(paths) => Index::read_entry_v4(contents, paths.get(entry_number))?,
+                    };
+                    f(directory, entry);
+                    contents = local_contents;
+                }
+                Ok(file.len() - contents.len())
+            }
+        }
+    }
+
+    /// Combines the entries of a split index, `file`, with the entries of its shared index.
+    ///
+    /// The shared index entries are taken in order, those with the replace bit set are swapped
+    /// for the next of the leading entries of `delta`, keeping the shared entry's name since the
+    /// replacements may have empty names.  Those with the delete bit set are dropped.  The rest of
+    /// the entries in `delta` are new and are added to the end, leaving
+    /// `IndexEntriesBuilder::build()` to sort them into place.
+    fn merge_shared_index(
+        file: &'a IndexFile,
+        delta: IndexEntriesBuilder<'a>,
+        link: &SplitIndexLink,
+    ) -> Result<IndexEntriesBuilder<'a>, StatusError> {
+        let shared = file.shared_index(&link.oid)?;
+        let (_, shared_header) = Index::read_header(shared)?;
+        let shared_paths = Index::decoded_paths(shared, &shared_header)?;
+
+        let replaced_count = link.replaced.iter().filter(|r| **r).count();
+        if replaced_count > delta.entries.len() {
+            return Err(StatusError {
+                message: format!("Too few replacement entries in {:?}", file.path()),
+            });
+        }
+        let capacity = shared_header.entries as usize + delta.entries.len();
+        let mut entries = IndexEntriesBuilder::with_capacity(capacity);
+        let mut delta = delta.into_entries();
+        let mut replacements = delta.by_ref().take(replaced_count);
+
+        let mut number = 0;
+        Index::read_all_entries(shared, &shared_header, shared_paths, |directory, entry| {
+            let mut entry = entry;
+            if link.replaced.get(number) == Some(&true) {
+                let (_, replacement) = replacements.next().unwrap();
+                entry = DirEntry {
+                    name: entry.name,
+                    ..replacement
+                };
+            }
+            if link.deleted.get(number) != Some(&true) {
+                entries.push(directory, entry);
+            }
+            number += 1;
+        })?;
+        for (directory, entry) in delta {
+            entries.push(directory, entry);
+        }
+        Ok(entries)
+    }
+
+    /// Reads in `count` entries from the provided stream, `first_entry` is the number of the
+    /// first entry in the stream, used to find the decoded `paths` of a version 4 index.
+    fn read_entries(
+        stream: &'a [u8],
+        first_entry: usize,
+        count: usize,
+        paths: Option<&'a DecodedPaths>,
+    ) -> Result<Vec<(&'a str, DirEntry<'a>)>, StatusError> {
+        let mut entries = Vec::with_capacity(count);
+        let mut contents = stream;
+        for entry_number in first_entry..first_entry + count {
+            let (local_contents, entry) = match paths {
+                None => Index::read_entry(contents)?,
+                Some(paths) => Index::read_entry_v4(contents, paths.get(entry_number))?,
+            };
+            entries.push(entry);
+            contents = local_contents;
+        }
+        Ok(entries)
+    }
+
+    /// Returns the full paths of the entries numbered `numbers`, which need to be in increasing
+    /// order.
     ///
-    /// # Arguments
+    /// Version 2 and 3 entries have to be stepped through to find the path of an entry, this
+    /// starts from the closest block of the entry offset table when the index has one.
+    fn entry_paths(
+        file: &'a IndexFile,
+        header: &Header,
+        paths: Option<&'a DecodedPaths>,
+        numbers: &[usize],
+    ) -> Result<Vec<&'a str>, StatusError> {
+        if let Some(paths) = paths {
+            return Ok(numbers.iter().map(|n| paths.get(*n)).collect());
+        }
+        let blocks = match Index::entry_blocks(file, header) {
+            Some((_, blocks)) => blocks,
+            None => vec![EntryBlock {
+                offset: HEADER_SIZE,
+                first_entry: 0,
+                entries: header.entries as usize,
+            }],
+        };
+        let mut names = Vec::with_capacity(numbers.len());
+        let mut contents: &[u8] = &[];
+        let mut current = 0;
+        for &number in numbers {
+            let block = &blocks[blocks.partition_point(|b| b.first_entry <= number) - 1];
+            if current <= block.first_entry {
+                contents = &file[block.offset..];
+                current = block.first_entry;
+            }
+            for _ in current..number {
+                contents = Index::read_entry_path(contents)?.0;
+            }
+            let (local_contents, (_, name)) = Index::read_entry_path(contents)?;
+            names.push(name);
+            contents = local_contents;
+            current = number + 1;
+        }
+        Ok(names)
+    }
+
+    /// Decodes the prefix compressed paths of a version 4 index.
     ///
-    /// * `path` - The path to a git repo.  This logic will _not_ search up parent directories for
-    ///     a git repo
-    pub fn new(path: &Path) -> Result<Index, StatusError> {
-        let oid: [u8; 20] = [0; 20];
-        let mut buffer: Vec<u8> = Vec::new();
-        File::open(&path).and_then(|mut f| f.read_to_end(&mut buffer))?;
-        let (mut contents, header) = Index::read_header(&buffer)?;
-        let mut entries = HashMap::new();
+    /// Each entry's path is stored as the number of bytes to remove from the end of the previous
+    /// path followed by the NUL terminated bytes to append.  The path is rebuilt in one reusable
+    /// buffer and then copied to the end of all the decoded paths.
+    fn decode_paths(stream: &[u8], header: &Header) -> Result<DecodedPaths, StatusError> {
+        let (mut contents, _) = Index::read_header(stream)?;
+        let mut paths = DecodedPaths {
+            names: String::with_capacity(contents.len()),
+            ends: Vec::with_capacity(header.entries as usize),
+        };
+        let mut path: Vec<u8> = vec![];
         for _ in 0..header.entries {
-            let (local_contents, (directory, entry)) = Index::read_entry(&contents)?;
-            let directory_entry = Index::get_directory_entry(&directory, &mut entries);
-            directory_entry.push(entry);
+            let (local_contents, (_, (strip, suffix))) =
+                tuple((Index::read_entry_fields, Index::read_compressed_path))(contents)?;
+            if strip > path.len() {
+                return Err(StatusError {
+                    message: "Invalid version 4 path prefix".to_string(),
+                });
+            }
+            path.truncate(path.len() - strip);
+            path.extend_from_slice(suffix);
+            let name = std::str::from_utf8(&path).map_err(|e| StatusError {
+                message: e.to_string(),
+            })?;
+            paths.names.push_str(name);
+            paths.ends.push(paths.names.len());
             contents = local_contents;
         }
-        let index = Index {
-            path: String::from(path.to_str().unwrap()),
-            oid,
-            header,
-            entries,
-        };
-        Ok(index)
+        Ok(paths)
     }
 
-    /// Returns the oid(Object ID) for the index.
-    ///
-    /// The object ID of an index is the object ID of the tree which the index represents.
-    pub fn oid(&self) -> &[u8] {
-        &self.oid
+    /// Reads in the prefix compressed path of a version 4 entry, the number of bytes to strip
+    /// from the previous path and the NUL terminated suffix.
+    fn read_compressed_path(stream: &[u8]) -> IResult<&[u8], (usize, &[u8])> {
+        let (output, (strip, suffix, _)) =
+            tuple((parse_varint, take_until("\0"), take(1usize)))(stream)?;
+        Ok((output, (strip, suffix)))
     }
 
-    /// Reads in the header from the provided stream
+    /// Returns the offset to the extensions and the blocks of entries from the Index Entry Offset
+    /// Table (IEOT) extension.
     ///
+    /// The extensions can only be found without parsing all the entries when the End Of Index
+    /// Entry (EOIE) extension is present. `None` is returned when either extension is missing or
+    /// doesn't agree with the header, or when there is only one block, since that's no better than
+    /// parsing serially.
+    fn entry_blocks(stream: &[u8], header: &Header) -> Option<(usize, Vec<EntryBlock>)> {
+        let extensions_offset = Index::read_end_of_index_entry(stream)?;
+        let (_, extensions) =
+            Index::read_extensions(&stream[extensions_offset..stream.len() - CHECKSUM_SIZE])
+                .ok()?;
+        let offset_table = extensions.iter().find(|e| e.signature == b"IEOT")?;
+        let (_, blocks) = Index::read_entry_offset_table(offset_table.data).ok()?;
+
+        let total = blocks.last().map_or(0, |b| b.first_entry + b.entries);
+        let in_bounds = blocks
+            .iter()
+            .all(|b| b.offset >= HEADER_SIZE && b.offset < extensions_offset);
+        if blocks.len() < 2 || total != header.entries as usize || !in_bounds {
+            return None;
+        }
+        Some((extensions_offset, blocks))
+    }
+
+    /// Reads the End Of Index Entry (EOIE) extension and returns the offset to the first
+    /// extension.
     ///
-    fn read_header(stream: &[u8]) -> IResult<&[u8], Header> {
-        let signature = tag("DIRC");
+    /// EOIE is always the last extension, right before the checksum of the index file.  The hash
+    /// of the extension headers it contains is not verified, instead the extension headers are
+    /// walked from the offset and have to end exactly at the EOIE extension.
+    fn read_end_of_index_entry(stream: &[u8]) -> Option<usize> {
+        let eoie_size = 4 + 4 + 4 + 20;
+        if stream.len() < HEADER_SIZE + eoie_size + CHECKSUM_SIZE {
+            return None;
+        }
+        let extensions_end = stream.len() - CHECKSUM_SIZE;
+        let eoie = &stream[extensions_end - eoie_size..extensions_end];
+        let parsed: IResult<&[u8], (&[u8], u32, u32)> =
+            tuple((tag("EOIE"), verify(be_u32, |size| *size == 24), be_u32))(eoie);
+        let (_, (_, _, offset)) = parsed.ok()?;
 
-        let (input, (_, version, entries)) = tuple((signature, be_u32, be_u32))(stream)?;
+        let offset = offset as usize;
+        if offset < HEADER_SIZE || offset > extensions_end - eoie_size {
+            return None;
+        }
+        let (_, extensions) = Index::read_extensions(&stream[offset..extensions_end]).ok()?;
+        match extensions.last() {
+            Some(last) if last.signature == b"EOIE" => Some(offset),
+            _ => None,
+        }
+    }
 
-        Ok((input, Header { version, entries }))
+    /// Reads in all of the extensions in the provided stream
+    fn read_extensions(stream: &[u8]) -> IResult<&[u8], Vec<Extension<'_>>> {
+        let mut extensions = vec![];
+        let mut contents = stream;
+        while !contents.is_empty() {
+            let (local_contents, extension) = do_parse!(
+                contents,
+                signature: take!(4) >> size: be_u32 >> data: take!(size) >> (Extension { signature, data })
+            )?;
+            extensions.push(extension);
+            contents = local_contents;
+        }
+        Ok((contents, extensions))
     }
 
-    /// Reads in entry from the provided stream
+    /// Reads in the Index Entry Offset Table (IEOT) extension data.
     ///
+    /// - 32-bit version (currently 1)
+    /// - A number of 32-bit offset, 32-bit entry count pairs
+    fn read_entry_offset_table(stream: &[u8]) -> IResult<&[u8], Vec<EntryBlock>> {
+        let (mut contents, _) = verify(be_u32, |version| *version == 1)(stream)?;
+        let mut blocks = vec![];
+        let mut first_entry = 0;
+        while !contents.is_empty() {
+            let (local_contents, (offset, entries)) = tuple((be_u32, be_u32))(contents)?;
+            blocks.push(EntryBlock {
+                offset: offset as usize,
+                first_entry,
+                entries: entries as usize,
+            });
+            first_entry += entries as usize;
+            contents = local_contents;
+        }
+        Ok((contents, blocks))
+    }
+
+    /// Reads in a directory of the cache tree (TREE) extension along with all of its subtrees.
     ///
-    fn read_entry(stream: &[u8]) -> IResult<&[u8], (String, DirEntry)> {
-        let (output, (mtime, mode, size, sha, full_name)) = do_parse!(
-            stream,
-            take!(8)
-                >> mtime: be_u32
-                >> take!(14)
-                >> mode: be_u16
-                >> take!(8)
-                >> size: be_u32
-                >> sha: take!(20)
-                >> name_size: parse_name_size
-                >> name: take!(name_size)
-                >> take!(8 - ((62 + name_size) % 8))
-                >> (
-                    mtime,
-                    mode,
-                    size,
-                    sha,
-                    String::from_utf8(name.to_vec()).unwrap()
-                )
-        )?;
+    /// - NUL terminated path component, relative to the parent directory
+    /// - ASCII decimal number of entries covered by the directory, negative when invalidated
+    /// - A space
+    /// - ASCII decimal number of subtrees
+    /// - A newline
+    /// - The 20 byte object id of the tree, only when the number of entries isn't negative
+    fn read_cache_tree(stream: &'a [u8]) -> IResult<&'a [u8], CacheTree<'a>> {
+        let (mut contents, (name, _, entry_count, _, subtree_count, _)) = tuple((
+            map_res(take_until("\0"), std::str::from_utf8),
+            take(1usize),
+            map_res(take_until(" "), parse_decimal::<i32>),
+            take(1usize),
+            map_res(take_until("\n"), parse_decimal::<usize>),
+            take(1usize),
+        ))(stream)?;
+        let mut oid = None;
+        if entry_count >= 0 {
+            let (local_contents, sha) = take(20usize)(contents)?;
+            oid = Some(sha.try_into().unwrap());
+            contents = local_contents;
+        }
+        let mut subtrees = Vec::with_capacity(subtree_count);
+        for _ in 0..subtree_count {
+            let (local_contents, subtree) = Index::read_cache_tree(contents)?;
+            subtrees.push(subtree);
+            contents = local_contents;
+        }
+        Ok((
+            contents,
+            CacheTree {
+                name,
+                oid,
+                subtrees,
+            },
+        ))
+    }
 
-        let object_bits = mode >> 12;
-        let object_type = match object_bits {
-            0b1110 => ObjectType::GitLink,
-            0b1010 => ObjectType::SymLink,
-            _ => ObjectType::Regular,
+    /// Reads in the untracked cache (UNTR) extension data.
+    ///
+    /// - The size of the ident strings, as a varint
+    /// - The NUL terminated ident strings
+    /// - Stat data of `$GIT_DIR/info/exclude` and `core.excludesFile`
+    /// - 32-bit dir flags
+    /// - Object ids of `$GIT_DIR/info/exclude` and `core.excludesFile`
+    /// - NUL terminated name of the per directory exclude file
+    /// - The number of directory blocks, as a varint, the extension ends here when zero
+    /// - The directory blocks, in depth first order
+    /// - EWAH bitmaps of the valid, check only, and exclude oid flags of each directory
+    /// - Stat data for each valid directory
+    /// - Exclude oids for each directory with the flag set
+    fn read_untracked_cache(stream: &'a [u8]) -> IResult<&'a [u8], UntrackedCache<'a>> {
+        let (contents, ident_size) = parse_varint(stream)?;
+        let (contents, (idents, info_exclude, excludes_file, dir_flags, _, exclude_per_dir, _)) =
+            tuple((
+                map_res(take(ident_size), std::str::from_utf8),
+                Index::read_stat_data,
+                Index::read_stat_data,
+                be_u32,
+                take(40usize),
+                map_res(take_until("\0"), std::str::from_utf8),
+                take(1usize),
+            ))(contents)?;
+        let mut cache = UntrackedCache {
+            idents: idents.split('\0').filter(|i| !i.is_empty()).collect(),
+            info_exclude,
+            excludes_file,
+            dir_flags,
+            exclude_per_dir,
+            root: None,
         };
+        let (contents, directory_count) = parse_varint(contents)?;
+        if directory_count == 0 {
+            return Ok((contents, cache));
+        }
 
-        let full_path = Path::new(&full_name);
-        let parent_path = full_path.parent().unwrap().to_str().unwrap();
-        let name = full_path.file_name().unwrap().to_str().unwrap().to_string();
-        let entry = DirEntry {
-            stat: FileStat { mtime, size },
-            sha: sha.try_into().unwrap(),
+        let (contents, mut root) = Index::read_untracked_directory(contents)?;
+        let (contents, (valid, check_only, exclude_valid)) =
+            tuple((parse_ewah, parse_ewah, parse_ewah))(contents)?;
+        let valid_count = valid.iter().filter(|v| **v).count();
+        let exclude_count = exclude_valid.iter().filter(|v| **v).count();
+        let (contents, (stats, oids)) = tuple((
+            count(Index::read_stat_data, valid_count),
+            count(
+                map(take(20usize), |oid: &[u8]| oid.try_into().unwrap()),
+                exclude_count,
+            ),
+        ))(contents)?;
+
+        let mut stats = stats.into_iter();
+        let mut oids = oids.into_iter();
+        let mut number = 0;
+        root.visit(&mut |directory| {
+            if valid.get(number) == Some(&true) {
+                directory.stat = stats.next();
+            }
+            directory.check_only = check_only.get(number) == Some(&true);
+            if exclude_valid.get(number) == Some(&true) {
+                directory.exclude_oid = oids.next();
+            }
+            number += 1;
+        });
+        cache.root = Some(root);
+        Ok((contents, cache))
+    }
+
+    /// Reads in a directory block of the untracked cache along with all of its subdirectories.
+    ///
+    /// - The number of untracked entries, as a varint
+    /// - The number of subdirectory blocks, as a varint
+    /// - NUL terminated directory name
+    /// - The NUL terminated untracked entries
+    fn read_untracked_directory(stream: &'a [u8]) -> IResult<&'a [u8], UntrackedDirectory<'a>> {
+        let nul_terminated = || {
+            map(
+                tuple((map_res(take_until("\0"), std::str::from_utf8), take(1usize))),
+                |(name, _)| name,
+            )
+        };
+        let (contents, (untracked_count, subdirectory_count)) =
+            tuple((parse_varint, parse_varint))(stream)?;
+        let (mut contents, (name, untracked)) =
+            tuple((nul_terminated(), count(nul_terminated(), untracked_count)))(contents)?;
+        let mut subdirectories = Vec::with_capacity(subdirectory_count);
+        for _ in 0..subdirectory_count {
+            let (local_contents, subdirectory) = Index::read_untracked_directory(contents)?;
+            subdirectories.push(subdirectory);
+            contents = local_contents;
+        }
+        let directory = UntrackedDirectory {
             name,
-            object_type,
+            untracked,
+            subdirectories,
+            ..Default::default()
         };
-        Ok((output, (parent_path.to_string(), entry)))
+        Ok((contents, directory))
     }
 
-    // Get the directory entry and populate any parent entries that don't exist
-    fn get_directory_entry<'a>(
-        name: &str,
-        directory_map: &'a mut HashMap<String, Vec<DirEntry>>,
-    ) -> &'a mut Vec<DirEntry> {
-        let _entry = directory_map.get(name);
-        let directory_entry = match _entry {
-            Some(_entry) => directory_map.get_mut(name).unwrap(),
-            None => {
-                for ancestor in Path::new(name).ancestors() {
-                    directory_map
-                        .entry(ancestor.to_str().unwrap().to_string())
-                        .or_insert_with(Vec::<DirEntry>::new);
-                }
-                directory_map.get_mut(name).unwrap()
-            }
+    /// Reads in the stat data used by the extensions, everything from the ctime to the file size
+    /// of an entry without the mode.
+    fn read_stat_data(stream: &[u8]) -> IResult<&[u8], FileStat> {
+        let (output, fields) = tuple((
+            be_u32, be_u32, be_u32, be_u32, be_u32, be_u32, be_u32, be_u32, be_u32,
+        ))(stream)?;
+        let (ctime, ctime_nsec, mtime, mtime_nsec, dev, ino, uid, gid, size) = fields;
+        let stat = FileStat {
+            ctime: (ctime, ctime_nsec),
+            mtime: (mtime, mtime_nsec),
+            dev,
+            ino,
+            uid,
+            gid,
+            size,
+        };
+        Ok((output, stat))
+    }
+
+    /// Reads in the split index (link) extension data.
+    ///
+    /// - 20 byte object id of the shared index, all zeros when there isn't one
+    /// - EWAH bitmap of the shared index entries which are deleted
+    /// - EWAH bitmap of the shared index entries which are replaced
+    ///
+    /// The bitmaps are left out when nothing has been deleted or replaced.
+    fn read_split_index_link(stream: &[u8]) -> IResult<&[u8], SplitIndexLink> {
+        let (contents, oid) = map(take(20usize), |oid: &[u8]| oid.try_into().unwrap())(stream)?;
+        let mut link = SplitIndexLink {
+            oid,
+            ..Default::default()
+        };
+        if contents.is_empty() {
+            return Ok((contents, link));
+        }
+        let (contents, (deleted, replaced)) = tuple((parse_ewah, parse_ewah))(contents)?;
+        link.deleted = deleted;
+        link.replaced = replaced;
+        Ok((contents, link))
+    }
+
+    /// Reads in the file system monitor cache (FSMN) extension data.
+    ///
+    /// - 32-bit version, 1 or 2
+    /// - Version 1 has a 64-bit timestamp, version 2 has a NUL terminated token
+    /// - 32-bit size of the bitmap
+    /// - EWAH bitmap, the bit for each entry which isn't known to be unchanged is set
+    fn read_fsmonitor_cache(stream: &'a [u8]) -> IResult<&'a [u8], (Option<&'a str>, Vec<bool>)> {
+        let (contents, version) = verify(be_u32, |v| *v == 1 || *v == 2)(stream)?;
+        let (contents, token) = match version {
+            1 => map(be_u64, |_| None)(contents)?,
+            _ => map(
+                tuple((map_res(take_until("\0"), std::str::from_utf8), take(1usize))),
+                |(token, _)| Some(token),
+            )(contents)?,
+        };
+        let (contents, (_, dirty)) = tuple((be_u32, parse_ewah))(contents)?;
+        Ok((contents, (token, dirty)))
+    }
+
+    /// Reads in entry from the provided stream
+    ///
+    /// This is for version 2 and 3 entries which have the full path followed by NUL padding.
+    fn read_entry(stream: &'a [u8]) -> IResult<&'a [u8], (&'a str, DirEntry<'a>)> {
+        let (output, (fields, full_name)) = Index::read_entry_path(stream)?;
+        Ok((output, Index::create_entry(fields, full_name)))
+    }
+
+    /// Reads in the fields and the full path of a version 2 or 3 entry.
+    fn read_entry_path(stream: &'a [u8]) -> IResult<&'a [u8], (EntryFields, &'a str)> {
+        do_parse!(
+            stream,
+            fields: Index::read_entry_fields
+                >> name: take!(fields.name_size)
+                >> take!(8 - ((fields.flags_end + fields.name_size as usize) % 8))
+                >> ((fields, std::str::from_utf8(name).unwrap()))
+        )
+    }
+
+    /// Reads in a version 4 entry from the provided stream.
+    ///
+    /// The prefix compressed path is skipped over in favor of `full_name` which was decoded by
+    /// `decode_paths()`.
+    fn read_entry_v4(
+        stream: &'a [u8],
+        full_name: &'a str,
+    ) -> IResult<&'a [u8], (&'a str, DirEntry<'a>)> {
+        let (output, (fields, _)) =
+            tuple((Index::read_entry_fields, Index::read_compressed_path))(stream)?;
+        Ok((output, Index::create_entry(fields, full_name)))
+    }
+
+    /// Reads in the fields common to all versions of entries, everything before the path.
+    fn read_entry_fields(stream: &[u8]) -> IResult<&[u8], EntryFields> {
+        let start = stream.len();
+        let (output, (ctime, ctime_nsec, mtime, mtime_nsec, dev, ino)) =
+            tuple((be_u32, be_u32, be_u32, be_u32, be_u32, be_u32))(stream)?;
+        let (output, (_, mode, uid, gid, size)) =
+            tuple((be_u16, be_u16, be_u32, be_u32, be_u32))(output)?;
+        let (output, (sha, (extended, name_size))) = tuple((take(20usize), parse_flags))(output)?;
+        let (output, extended_flags) = take(if extended { 2usize } else { 0 })(output)?;
+        let fields = EntryFields {
+            stat: FileStat {
+                ctime: (ctime, ctime_nsec),
+                mtime: (mtime, mtime_nsec),
+                dev,
+                ino,
+                uid,
+                gid,
+                size,
+            },
+            mode,
+            sha: sha.try_into().unwrap(),
+            name_size,
+            flags_end: start - output.len(),
+            skip_worktree: extended_flags.first().copied().unwrap_or(0) & 0x40 != 0,
         };
+        Ok((output, fields))
+    }
 
-        directory_entry
+    /// Creates the directory entry for `fields`, returning it along with the directory it
+    /// belongs in.
+    fn create_entry(fields: EntryFields, full_name: &'a str) -> (&'a str, DirEntry<'a>) {
+        let mode = fields.mode;
+        let object_type = ObjectType::from_mode(mode);
+
+        // The replacement entries of a split index can have empty names
+        let full_path = Path::new(full_name);
+        let parent_path = full_path.parent().map_or("", |p| p.to_str().unwrap());
+        let name = full_path.file_name().map_or("", |n| n.to_str().unwrap());
+        let entry = DirEntry {
+            stat: fields.stat,
+            mode,
+            sha: fields.sha,
+            name,
+            object_type,
+            skip_worktree: fields.skip_worktree,
+        };
+        (parent_path, entry)
     }
 }
 
@@ -285,15 +1627,22 @@ mod tests {
             Ok((
                 &b""[..],
                 (
-                    "some/file".to_string(),
+                    "some/file",
                     DirEntry {
                         stat: FileStat {
-                            mtime: 20,
+                            ctime: (0, 10),
+                            mtime: (20, 25),
+                            dev: 30,
+                            ino: 30,
+                            uid: 50,
+                            gid: 60,
                             size: 70,
                         },
+                        mode: 40,
                         sha: *sha,
                         object_type: ObjectType::Regular,
-                        name: "name".to_string(),
+                        name: "name",
+                        skip_worktree: false,
                     }
                 )
             ))
@@ -316,12 +1665,14 @@ mod tests {
             Ok((
                 &b""[..],
                 (
-                    "a/different/name/to/a/file".to_string(),
+                    "a/different/name/to/a/file",
                     DirEntry {
                         object_type: ObjectType::Regular,
-                        stat: FileStat { mtime: 0, size: 0 },
+                        stat: FileStat::default(),
+                        mode: 0,
                         sha: *sha,
-                        name: "with.ext".to_string()
+                        name: "with.ext",
+                        skip_worktree: false
                     }
                 )
             ))
@@ -347,12 +1698,14 @@ mod tests {
             Ok((
                 &suffix[..],
                 (
-                    "a".to_string(),
+                    "a",
                     DirEntry {
                         object_type: ObjectType::Regular,
-                        stat: FileStat { mtime: 0, size: 0 },
+                        stat: FileStat::default(),
+                        mode: 0,
                         sha: *sha,
-                        name: "file".to_string()
+                        name: "file",
+                        skip_worktree: false
                     }
                 )
             ))
@@ -378,12 +1731,14 @@ mod tests {
             Ok((
                 &suffix[..],
                 (
-                    "".to_string(),
+                    "",
                     DirEntry {
                         object_type: ObjectType::Regular,
-                        stat: FileStat { mtime: 0, size: 0 },
+                        stat: FileStat::default(),
+                        mode: 0,
                         sha: *sha,
-                        name: "niners999".to_string()
+                        name: "niners999",
+                        skip_worktree: false
                     }
                 )
             ))
@@ -409,38 +1764,84 @@ mod tests {
             Ok((
                 &suffix[..],
                 (
-                    "".to_string(),
+                    "",
                     DirEntry {
                         object_type: ObjectType::Regular,
-                        stat: FileStat { mtime: 0, size: 0 },
+                        stat: FileStat::default(),
+                        mode: 0,
                         sha: *sha,
-                        name: "22".to_string()
+                        name: "22",
+                        skip_worktree: false
                     }
                 )
             ))
         );
     }
 
+    // An entry for each full path, in the order given
+    fn directory_entries<'a>(paths: &[&'a str]) -> Vec<(&'a str, DirEntry<'a>)> {
+        paths
+            .iter()
+            .map(|path| {
+                let (directory, name) = path.rsplit_once('/').unwrap_or(("", path));
+                let entry = DirEntry {
+                    name,
+                    ..Default::default()
+                };
+                (directory, entry)
+            })
+            .collect()
+    }
+
     #[test]
-    fn test_get_directory_entry_at_root() {
-        let rooted_dir = "";
-        let mut map = HashMap::new();
-        Index::get_directory_entry(rooted_dir, &mut map);
-        assert_eq!(true, map.len() == 1 && map.contains_key(""));
+    fn test_index_entries_at_root() {
+        let entries = IndexEntries::from_iter(directory_entries(&["a", "b"]));
+        assert_eq!(entries.keys().collect::<Vec<_>>(), vec![""]);
+        let names: Vec<&str> = entries[""].iter().map(|e| e.name).collect();
+        assert_eq!(names, vec!["a", "b"]);
     }
+
     #[test]
-    fn test_get_directory_3_levels_deep() {
-        let deep_dir = "1/2/3";
-        let mut map = HashMap::new();
-        Index::get_directory_entry(deep_dir, &mut map);
+    fn test_index_entries_3_levels_deep() {
+        let entries = IndexEntries::from_iter(directory_entries(&["1/2/3/file"]));
+        let directories: Vec<&str> = entries.keys().collect();
+        assert_eq!(directories, vec!["", "1", "1/2", "1/2/3"]);
+        assert_eq!(entries.get("1/2").unwrap().len(), 0);
+        assert_eq!(entries.get("1/2/3").unwrap()[0].name, "file");
+        assert_eq!(entries.get("1/2/4"), None);
+    }
 
-        let directories = vec!["", "1", "1/2", "1/2/3"];
+    #[test]
+    fn test_index_entries_grouped_by_directory() {
+        let paths = ["a/b/c", "a/b/d", "a/c", "a/d/e", "a/f", "b", "c/d"];
+        let entries = IndexEntries::from_iter(directory_entries(&paths));
+        let grouped: Vec<(&str, Vec<&str>)> = entries
+            .iter()
+            .map(|(d, e)| (d, e.iter().map(|e| e.name).collect()))
+            .collect();
         assert_eq!(
-            true,
-            map.len() == directories.len() && directories.iter().all(|d| map.contains_key(*d))
+            grouped,
+            vec![
+                ("", vec!["b"]),
+                ("a", vec!["c", "f"]),
+                ("a/b", vec!["c", "d"]),
+                ("a/d", vec!["e"]),
+                ("c", vec!["d"]),
+            ]
         );
     }
 
+    #[test]
+    fn test_index_subdirectories() {
+        let paths = ["a-b/c", "a/b/c/d", "a/b-c/d", "a/e/f", "a/g", "b", "c/d/e"];
+        let entries = IndexEntries::from_iter(directory_entries(&paths));
+        assert_eq!(entries.subdirectories(""), vec!["a", "a-b", "c"]);
+        assert_eq!(entries.subdirectories("a"), vec!["b", "b-c", "e"]);
+        assert_eq!(entries.subdirectories("a/b"), vec!["c"]);
+        assert!(entries.subdirectories("a/b/c").is_empty());
+        assert!(entries.subdirectories("missing").is_empty());
+    }
+
     #[test]
     fn test_merged_file() {
         let temp_dir = TempDir::default();
@@ -480,7 +1881,7 @@ mod tests {
             //Slot 3: “theirs”, the being-merged-in version.
             let stage = match entry {
                 0 => 0,
-                _ => 0b0100000000000000,
+                _ => 0b0001000000000000,
             };
             name_length |= stage;
             stream.extend(&name_length.to_be_bytes());
@@ -490,9 +1891,552 @@ mod tests {
         }
         let index_file = temp_dir.join("some_index");
         fs::write(&index_file, stream).unwrap();
-        let index = Index::new(&index_file).unwrap();
+        let file = IndexFile::open(&index_file).unwrap();
+        let index = Index::new(&file).unwrap();
         let root = index.entries.get("").unwrap();
 
         assert_eq!(root.len(), 2);
     }
+
+    #[test]
+    fn test_mapped_and_read_files_match() {
+        let temp_dir = TempDir::default();
+        let index_file = temp_dir.join("some_index");
+        fs::write(&index_file, b"DIRC\0\0\0\x02\0\0\0\0").unwrap();
+        let mapped = IndexFile::open(&index_file).unwrap();
+        let read = IndexFile::read(&index_file).unwrap();
+        assert_eq!(&mapped[..], &read[..]);
+        assert_eq!(Index::new(&mapped).unwrap().entries.len(), 0);
+    }
+
+    #[test]
+    fn test_empty_file_falls_back_to_read() {
+        let temp_dir = TempDir::default();
+        let index_file = temp_dir.join("empty_index");
+        fs::write(&index_file, b"").unwrap();
+        let file = IndexFile::open(&index_file).unwrap();
+        assert_eq!(file.len(), 0);
+        assert!(Index::new(&file).is_err());
+    }
+
+    // Creates an index stream for `names`, when `block_size` is provided the entry offset table
+    // and end of index entry extensions are added with blocks of `block_size` entries.
+    fn index_stream(names: &[&str], block_size: Option<usize>) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(b"DIRC");
+        stream.extend(&2u32.to_be_bytes());
+        stream.extend(&(names.len() as u32).to_be_bytes());
+        let mut offsets = vec![];
+        for name in names {
+            offsets.push(stream.len() as u32);
+            stream.extend(vec![0; 40]);
+            stream.extend(b"abacadaba2376182368a");
+            stream.extend(&(name.len() as u16).to_be_bytes());
+            stream.extend(name.as_bytes());
+            stream.extend(vec![0; 8 - ((62 + name.len()) % 8)]);
+        }
+        if let Some(block_size) = block_size {
+            let extensions_offset = stream.len() as u32;
+            let mut table: Vec<u8> = vec![];
+            table.extend(&1u32.to_be_bytes());
+            for (block, offset) in offsets.iter().step_by(block_size).enumerate() {
+                let entries = (names.len() - block * block_size).min(block_size) as u32;
+                table.extend(&offset.to_be_bytes());
+                table.extend(&entries.to_be_bytes());
+            }
+            stream.extend(b"IEOT");
+            stream.extend(&(table.len() as u32).to_be_bytes());
+            stream.extend(table);
+            stream.extend(b"EOIE");
+            stream.extend(&24u32.to_be_bytes());
+            stream.extend(&extensions_offset.to_be_bytes());
+            stream.extend(&[0; 20]);
+        }
+        stream.extend(&[0; 20]);
+        stream
+    }
+
+    #[test]
+    fn test_entry_blocks_from_offset_table() {
+        let names = ["a", "b/c", "b/d", "e/f/g", "h"];
+        let stream = index_stream(&names, Some(2));
+        let (_, header) = Index::read_header(&stream).unwrap();
+        let (_, blocks) = Index::entry_blocks(&stream, &header).unwrap();
+        assert_eq!(
+            blocks,
+            vec![
+                EntryBlock {
+                    offset: 12,
+                    first_entry: 0,
+                    entries: 2
+                },
+                EntryBlock {
+                    offset: 148,
+                    first_entry: 2,
+                    entries: 2
+                },
+                EntryBlock {
+                    offset: 292,
+                    first_entry: 4,
+                    entries: 1
+                }
+            ]
+        );
+    }
+
+    #[test]
+    fn test_no_entry_blocks_without_extensions() {
+        let stream = index_stream(&["a", "b", "c"], None);
+        let (_, header) = Index::read_header(&stream).unwrap();
+        assert_eq!(Index::entry_blocks(&stream, &header), None);
+    }
+
+    #[test]
+    fn test_no_entry_blocks_when_end_of_index_entry_is_wrong() {
+        let mut stream = index_stream(&["a", "b", "c"], Some(1));
+        let eoie_offset = stream.len() - 20 - 24;
+        stream[eoie_offset..eoie_offset + 4].copy_from_slice(&100u32.to_be_bytes());
+        let (_, header) = Index::read_header(&stream).unwrap();
+        assert_eq!(Index::entry_blocks(&stream, &header), None);
+    }
+
+    #[test]
+    fn test_parallel_and_serial_parse_match() {
+        let names = ["a", "b/c", "b/d", "b/e/f", "g/h", "i"];
+        let serial = IndexFile::from(index_stream(&names, None));
+        let parallel = IndexFile::from(index_stream(&names, Some(2)));
+        let serial = Index::new(&serial).unwrap();
+        let parallel = Index::new(&parallel).unwrap();
+        assert_eq!(parallel.entries.len(), 4);
+        assert_eq!(parallel.entries, serial.entries);
+    }
+
+    #[test]
+    fn test_parse_varint() {
+        assert_eq!(parse_varint(&[0x05, 0xff]), Ok((&[0xff][..], 5)));
+        assert_eq!(parse_varint(&[0x7f]), Ok((&b""[..], 127)));
+        assert_eq!(parse_varint(&[0x80, 0x00]), Ok((&b""[..], 128)));
+        assert_eq!(parse_varint(&[0x80, 0x80, 0x00]), Ok((&b""[..], 16512)));
+    }
+
+    #[test]
+    fn test_read_of_extended_entry() {
+        let name = b"a/file";
+        let sha = b"ab7ca9aba237a18e3f8a";
+        let mut stream: Vec<u8> = vec![0; 40];
+        stream.extend(sha);
+        let flags: u16 = 0x4000 | name.len() as u16;
+        stream.extend(&flags.to_be_bytes());
+        let extended_flags: u16 = 0x4000;
+        stream.extend(&extended_flags.to_be_bytes());
+        stream.extend(name);
+        let pad_length = 8 - ((64 + name.len()) % 8);
+        stream.extend(vec![0; pad_length]);
+        let suffix = b"next";
+        stream.extend(suffix);
+        let (rest, (directory, entry)) = Index::read_entry(&stream).unwrap();
+        assert_eq!(rest, &suffix[..]);
+        assert_eq!(directory, "a");
+        assert_eq!(entry.name, "file");
+        assert!(entry.skip_worktree);
+    }
+
+    // Creates a version 4 index stream for `names`
+    fn index_stream_v4(names: &[&str]) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(b"DIRC");
+        stream.extend(&4u32.to_be_bytes());
+        stream.extend(&(names.len() as u32).to_be_bytes());
+        let mut previous = "";
+        for name in names {
+            let common = previous
+                .bytes()
+                .zip(name.bytes())
+                .take_while(|(a, b)| a == b)
+                .count();
+            stream.extend(vec![0; 40]);
+            stream.extend(b"abacadaba2376182368a");
+            stream.extend(&(name.len() as u16).to_be_bytes());
+            // All of the test names are short enough for a one byte varint
+            stream.push((previous.len() - common) as u8);
+            stream.extend(&name.as_bytes()[common..]);
+            stream.push(0);
+            previous = name;
+        }
+        stream.extend(&[0; 20]);
+        stream
+    }
+
+    #[test]
+    fn test_decode_paths_v4() {
+        let names = ["a/b/file_1", "a/b/file_2", "a/c", "d", "dir/nested/file"];
+        let stream = index_stream_v4(&names);
+        let (_, header) = Index::read_header(&stream).unwrap();
+        let paths = Index::decode_paths(&stream, &header).unwrap();
+        let decoded: Vec<&str> = (0..names.len()).map(|e| paths.get(e)).collect();
+        assert_eq!(decoded, names);
+    }
+
+    #[test]
+    fn test_v4_and_v2_parse_match() {
+        let names = ["a", "b/c", "b/d", "b/e/f", "g/h", "i"];
+        let v2 = IndexFile::from(index_stream(&names, None));
+        let v4 = IndexFile::from(index_stream_v4(&names));
+        let v2 = Index::new(&v2).unwrap();
+        let v4 = Index::new(&v4).unwrap();
+        assert_eq!(v4.entries, v2.entries);
+    }
+
+    #[test]
+    fn test_bad_v4_prefix_is_an_error() {
+        let mut stream = index_stream_v4(&["a", "b"]);
+        // The strip count of the first entry, can't strip from an empty path
+        stream[12 + 62] = 3;
+        let file = IndexFile::from(stream);
+        assert!(Index::new(&file).is_err());
+    }
+
+    #[test]
+    fn test_read_cache_tree() {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(b"\0-1 2\n");
+        stream.extend(b"a\03 0\n");
+        stream.extend(b"abacadaba2376182368a");
+        stream.extend(b"b\0-1 0\n");
+        stream.extend(b"tail");
+        let (rest, tree) = Index::read_cache_tree(&stream).unwrap();
+        assert_eq!(rest, b"tail");
+        assert_eq!(
+            tree,
+            CacheTree {
+                name: "",
+                oid: None,
+                subtrees: vec![
+                    CacheTree {
+                        name: "a",
+                        oid: Some(*b"abacadaba2376182368a"),
+                        subtrees: vec![]
+                    },
+                    CacheTree {
+                        name: "b",
+                        oid: None,
+                        subtrees: vec![]
+                    }
+                ]
+            }
+        );
+    }
+
+    #[test]
+    fn test_parse_ewah() {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(&131u32.to_be_bytes());
+        stream.extend(&3u32.to_be_bytes());
+        // A run of two words of set bits followed by one literal word
+        let run_length_word: u64 = (1 << 33) | (2 << 1) | 1;
+        stream.extend(&run_length_word.to_be_bytes());
+        stream.extend(&0b101u64.to_be_bytes());
+        // A second run length word with nothing in it
+        stream.extend(&0u64.to_be_bytes());
+        stream.extend(&2u32.to_be_bytes());
+        stream.extend(b"tail");
+        let (rest, bits) = parse_ewah(&stream).unwrap();
+        assert_eq!(rest, b"tail");
+        let mut expected = vec![true; 128];
+        expected.extend(&[true, false, true]);
+        assert_eq!(bits, expected);
+    }
+
+    fn stat_data_stream(seed: u32) -> Vec<u8> {
+        (seed..seed + 9)
+            .flat_map(|v| v.to_be_bytes().to_vec())
+            .collect()
+    }
+
+    fn stat_data(seed: u32) -> FileStat {
+        FileStat {
+            ctime: (seed, seed + 1),
+            mtime: (seed + 2, seed + 3),
+            dev: seed + 4,
+            ino: seed + 5,
+            uid: seed + 6,
+            gid: seed + 7,
+            size: seed + 8,
+        }
+    }
+
+    // An EWAH bitmap of up to 64 bits, as one literal word
+    fn ewah_stream(bit_count: u32, bits: u64) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(&bit_count.to_be_bytes());
+        stream.extend(&2u32.to_be_bytes());
+        stream.extend(&(1u64 << 33).to_be_bytes());
+        stream.extend(&bits.to_be_bytes());
+        stream.extend(&0u32.to_be_bytes());
+        stream
+    }
+
+    #[test]
+    fn test_read_untracked_cache() {
+        let mut stream: Vec<u8> = vec![];
+        let ident = b"Location /some/repo, system Linux\0";
+        stream.push(ident.len() as u8);
+        stream.extend(ident);
+        stream.extend(stat_data_stream(10));
+        stream.extend(&[0u8; 36]);
+        stream.extend(&6u32.to_be_bytes());
+        stream.extend(&[0u8; 40]);
+        stream.extend(b".gitignore\0");
+        stream.push(3);
+        // The root, "a" with two untracked entries, and "b" which was invalidated
+        stream.extend(b"\x01\x02\0new.txt\0");
+        stream.extend(b"\x02\x00a\0one.txt\0dir/\0");
+        stream.extend(b"\x00\x00b\0");
+        stream.extend(ewah_stream(3, 0b011));
+        stream.extend(ewah_stream(3, 0b000));
+        stream.extend(ewah_stream(3, 0b010));
+        stream.extend(stat_data_stream(20));
+        stream.extend(stat_data_stream(30));
+        stream.extend(b"abacadaba2376182368a");
+        stream.push(0);
+
+        let (rest, cache) = Index::read_untracked_cache(&stream).unwrap();
+        assert_eq!(rest, b"\0");
+        let expected_root = UntrackedDirectory {
+            name: "",
+            untracked: vec!["new.txt"],
+            subdirectories: vec![
+                UntrackedDirectory {
+                    name: "a",
+                    untracked: vec!["one.txt", "dir/"],
+                    subdirectories: vec![],
+                    stat: Some(stat_data(30)),
+                    check_only: false,
+                    exclude_oid: Some(*b"abacadaba2376182368a"),
+                },
+                UntrackedDirectory {
+                    name: "b",
+                    ..Default::default()
+                },
+            ],
+            stat: Some(stat_data(20)),
+            check_only: false,
+            exclude_oid: None,
+        };
+        assert_eq!(
+            cache,
+            UntrackedCache {
+                idents: vec!["Location /some/repo, system Linux"],
+                info_exclude: stat_data(10),
+                excludes_file: FileStat::default(),
+                dir_flags: 6,
+                exclude_per_dir: ".gitignore",
+                root: Some(expected_root),
+            }
+        );
+    }
+
+    #[test]
+    fn test_read_empty_untracked_cache() {
+        let mut stream: Vec<u8> = vec![0];
+        stream.extend(&[0u8; 36 + 36 + 4 + 40]);
+        stream.extend(b".gitignore\0");
+        stream.push(0);
+        let (rest, cache) = Index::read_untracked_cache(&stream).unwrap();
+        assert_eq!(rest.len(), 0);
+        assert_eq!(cache.idents.len(), 0);
+        assert_eq!(cache.root, None);
+    }
+
+    #[test]
+    fn test_entry_paths() {
+        let names = ["a", "b/c", "b/d", "e/f/g", "h"];
+        for block_size in &[None, Some(2)] {
+            let file = IndexFile::from(index_stream(&names, *block_size));
+            let (_, header) = Index::read_header(&file).unwrap();
+            let paths = Index::entry_paths(&file, &header, None, &[1, 3, 4]).unwrap();
+            assert_eq!(paths, vec!["b/c", "e/f/g", "h"]);
+        }
+    }
+
+    // Adds an extension to the end of an index stream without an EOIE extension
+    fn with_extension(mut stream: Vec<u8>, signature: &[u8], data: &[u8]) -> Vec<u8> {
+        stream.truncate(stream.len() - CHECKSUM_SIZE);
+        stream.extend(signature);
+        stream.extend(&(data.len() as u32).to_be_bytes());
+        stream.extend(data);
+        stream.extend(&[0; CHECKSUM_SIZE]);
+        stream
+    }
+
+    fn fsmonitor_stream(token: &str, entries: u32, dirty: u64) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(&2u32.to_be_bytes());
+        stream.extend(token.as_bytes());
+        stream.push(0);
+        let bitmap = ewah_stream(entries, dirty);
+        stream.extend(&(bitmap.len() as u32).to_be_bytes());
+        stream.extend(bitmap);
+        stream
+    }
+
+    #[test]
+    fn test_read_fsmonitor_cache() {
+        let stream = fsmonitor_stream("a token", 3, 0b100);
+        let (rest, (token, dirty)) = Index::read_fsmonitor_cache(&stream).unwrap();
+        assert_eq!(rest.len(), 0);
+        assert_eq!(token, Some("a token"));
+        assert_eq!(dirty, vec![false, false, true]);
+    }
+
+    #[test]
+    fn test_read_fsmonitor_cache_version_1() {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(&1u32.to_be_bytes());
+        stream.extend(&1_000_000u64.to_be_bytes());
+        let bitmap = ewah_stream(2, 0b01);
+        stream.extend(&(bitmap.len() as u32).to_be_bytes());
+        stream.extend(bitmap);
+        let (_, (token, dirty)) = Index::read_fsmonitor_cache(&stream).unwrap();
+        assert_eq!(token, None);
+        assert_eq!(dirty, vec![true, false]);
+    }
+
+    #[test]
+    fn test_fsmonitor_dirty_entries() {
+        let names = ["a", "b/c", "b/d", "e/f/g", "h"];
+        let extension = fsmonitor_stream("a token", 5, 0b01010);
+        let v2 = with_extension(index_stream(&names, None), b"FSMN", &extension);
+        let v4 = with_extension(index_stream_v4(&names), b"FSMN", &extension);
+        for stream in vec![v2, v4] {
+            let file = IndexFile::from(stream);
+            let index = Index::new(&file).unwrap();
+            let cache = index.fsmonitor_cache().unwrap();
+            assert_eq!(cache.token, Some("a token"));
+            assert_eq!(cache.dirty, vec!["b/c", "e/f/g"]);
+        }
+    }
+
+    fn split_index_link_stream(oid: &[u8; 20], deleted: u64, replaced: u64, bits: u32) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(oid);
+        stream.extend(ewah_stream(bits, deleted));
+        stream.extend(ewah_stream(bits, replaced));
+        stream
+    }
+
+    #[test]
+    fn test_read_split_index_link() {
+        let stream = split_index_link_stream(&[3; 20], 0b100, 0b011, 3);
+        let (rest, link) = Index::read_split_index_link(&stream).unwrap();
+        assert_eq!(rest.len(), 0);
+        assert_eq!(
+            link,
+            SplitIndexLink {
+                oid: [3; 20],
+                deleted: vec![false, false, true],
+                replaced: vec![true, true, false],
+            }
+        );
+    }
+
+    #[test]
+    fn test_read_split_index_link_without_bitmaps() {
+        let (_, link) = Index::read_split_index_link(&[4; 20]).unwrap();
+        assert_eq!(link.oid, [4; 20]);
+        assert!(link.deleted.is_empty());
+        assert!(link.replaced.is_empty());
+    }
+
+    #[test]
+    fn test_split_index_merges_shared_index() {
+        let temp_dir = TempDir::default();
+        let oid = [1; 20];
+        let shared = index_stream(&["a", "b/c", "b/d", "e"], Some(2));
+        let shared_name = format!("sharedindex.{}", "01".repeat(20));
+        fs::write(temp_dir.join(shared_name), shared).unwrap();
+
+        // Replace "b/c", giving it a new size, delete "e" and add "b/e" and "f"
+        let link = split_index_link_stream(&oid, 0b1000, 0b0010, 4);
+        let mut delta = with_extension(index_stream(&["", "b/e", "f"], None), b"link", &link);
+        delta[HEADER_SIZE + 36..HEADER_SIZE + 40].copy_from_slice(&10u32.to_be_bytes());
+        let index_file = temp_dir.join("index");
+        fs::write(&index_file, delta).unwrap();
+
+        let file = IndexFile::open(&index_file).unwrap();
+        let index = Index::new(&file).unwrap();
+        let names = |directory: &str| -> Vec<&str> {
+            index.entries[directory].iter().map(|e| e.name).collect()
+        };
+        assert_eq!(names(""), vec!["a", "f"]);
+        assert_eq!(names("b"), vec!["c", "d", "e"]);
+        let sizes: Vec<u32> = index.entries["b"].iter().map(|e| e.stat.size).collect();
+        assert_eq!(sizes, vec![10, 0, 0]);
+    }
+
+    #[test]
+    fn test_shared_index_is_dropped_with_its_split_indices() {
+        let temp_dir = TempDir::default();
+        let oid = [5; 20];
+        let shared = index_stream(&["a", "b"], None);
+        let shared_name = format!("sharedindex.{}", "05".repeat(20));
+        fs::write(temp_dir.join(shared_name), shared).unwrap();
+        let link = split_index_link_stream(&oid, 0, 0, 0);
+        let index_file = temp_dir.join("index");
+        fs::write(
+            &index_file,
+            with_extension(index_stream(&["c"], None), b"link", &link),
+        )
+        .unwrap();
+
+        let first = IndexFile::open(&index_file).unwrap();
+        let second = IndexFile::open(&index_file).unwrap();
+        assert_eq!(Index::new(&first).unwrap().entries[""].len(), 3);
+        assert_eq!(Index::new(&second).unwrap().entries[""].len(), 3);
+        let shared = first.shared.get().unwrap();
+        assert!(Arc::ptr_eq(shared, second.shared.get().unwrap()));
+        let shared = Arc::downgrade(shared);
+        drop(first);
+        assert!(shared.upgrade().is_some());
+        drop(second);
+        assert!(shared.upgrade().is_none());
+    }
+
+    #[test]
+    fn test_split_index_without_shared_index_is_an_error() {
+        let temp_dir = TempDir::default();
+        let link = split_index_link_stream(&[2; 20], 0, 0, 0);
+        let index_file = temp_dir.join("index");
+        fs::write(
+            &index_file,
+            with_extension(index_stream(&["a"], None), b"link", &link),
+        )
+        .unwrap();
+        let file = IndexFile::open(&index_file).unwrap();
+        assert!(Index::new(&file).is_err());
+    }
+
+    #[test]
+    fn test_split_index_with_no_shared_index() {
+        let link = split_index_link_stream(&[0; 20], 0, 0, 0);
+        let file = IndexFile::from(with_extension(index_stream(&["a"], None), b"link", &link));
+        let index = Index::new(&file).unwrap();
+        assert_eq!(index.entries[""].len(), 1);
+    }
+
+    #[test]
+    fn test_sparse_directory_entries() {
+        let mut stream = index_stream(&["dir.txt", "dir/"], None);
+        // "dir.txt" takes up 72 bytes, the mode is 24 bytes into an entry
+        let mode_offset = HEADER_SIZE + 72 + 24;
+        stream[mode_offset..mode_offset + 4].copy_from_slice(&0o040000u32.to_be_bytes());
+        let file = IndexFile::from(with_extension(stream, b"sdir", &[]));
+        let index = Index::new(&file).unwrap();
+        let names: Vec<&str> = index.entries[""].iter().map(|e| e.name).collect();
+        assert_eq!(names, vec!["dir", "dir.txt"]);
+        assert_eq!(
+            index.entries[""][0].object_type,
+            ObjectType::SparseDirectory
+        );
+    }
 }
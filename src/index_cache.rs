@@ -0,0 +1,487 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::direntry::{DirEntry, FileStat, ObjectType};
+use crate::index::{FsMonitorCache, IndexEntries, ParsedEntries};
+use memmap2::Mmap;
+use nom::bytes::complete::{tag, take};
+use nom::combinator::verify;
+use nom::number::complete::{le_u32, le_u64};
+use nom::sequence::tuple;
+use nom::IResult;
+use std::convert::TryInto;
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::time::{SystemTime, UNIX_EPOCH};
+
+// Bumped whenever the layout changes, a cache of any other version is rebuilt
+const CACHE_VERSION: u32 = 2;
+
+// The size of each fixed size record, see `IndexCache`
+const ENTRY_SIZE: usize = 68;
+const DIRECTORY_SIZE: usize = 16;
+const DIRTY_SIZE: usize = 8;
+
+// Set in the flags of the header when the index has a file system monitor cache, and when that
+// cache has a token
+const HAS_FSMONITOR: u32 = 1;
+const HAS_TOKEN: u32 = 2;
+
+/// An on disk cache of the entries parsed from an index file.
+///
+/// Status is often run over and over against the same index, like from a shell prompt.  Rather
+/// than parse the index each time the parsed entries are written out in a form which can be
+/// loaded straight from a memory map, the names are borrowed from the cache file just like they
+/// are from the index file.  Version 4 paths don't need to be decoded, the entries are already
+/// grouped by directory, and the shared index of a split index doesn't need to be read.
+///
+/// A cache belongs to the index file with the same trailing checksum, size, and modification
+/// time.  Git never rewrites an index without changing its checksum, the stat data guards against
+/// an index written with `index.skipHash`, which are never cached since their checksum is all
+/// zeros.
+///
+/// The cache is laid out as, with all numbers little endian:
+///
+/// ```text
+/// "WGSC" | version: u32 | index checksum: [u8; 20] | index size: u64
+/// index mtime seconds: u64 | index mtime nanoseconds: u32
+/// entry count: u32 | directory count: u32 | dirty count: u32
+/// offset of the index extensions: u64 | names size: u32
+/// fsmonitor token offset: u32 | fsmonitor token size: u32 | flags: u32
+/// entries: ctime seconds: u32 | ctime nanoseconds: u32 | mtime seconds: u32
+///          mtime nanoseconds: u32 | dev: u32 | ino: u32 | uid: u32 | gid: u32 | size: u32
+///          mode: u16 | skip worktree: u8 | 0: u8 | sha: [u8; 20] | name offset: u32
+///          name size: u32
+/// directories: name offset: u32 | name size: u32 | first entry: u32 | end entry: u32
+/// dirty paths: offset: u32 | size: u32
+/// names: the UTF-8 names the records point into
+/// ```
+#[derive(Debug)]
+pub struct IndexCache {
+    path: PathBuf,
+    key: CacheKey,
+    // The cache file, only when it was written for the same index file
+    contents: Option<Mmap>,
+}
+
+/// What ties a cache to the index file it was written from.
+#[derive(PartialEq, Eq, Debug, Clone, Copy)]
+struct CacheKey {
+    checksum: [u8; 20],
+    size: u64,
+    // Seconds and nanoseconds since the epoch
+    modified: (u64, u32),
+}
+
+#[derive(PartialEq, Eq, Debug, Clone)]
+struct Header {
+    key: CacheKey,
+    entries: usize,
+    directories: usize,
+    dirty: usize,
+    end: usize,
+    names: usize,
+    token: (usize, usize),
+    flags: u32,
+}
+
+// The size of `Header` in the cache file
+const HEADER_SIZE: usize = 84;
+
+impl CacheKey {
+    fn new(index: &[u8], modified: SystemTime) -> Option<CacheKey> {
+        let checksum: [u8; 20] = index.get(index.len().checked_sub(20)?..)?.try_into().ok()?;
+        if checksum == [0; 20] {
+            return None;
+        }
+        let modified = modified.duration_since(UNIX_EPOCH).ok()?;
+        Some(CacheKey {
+            checksum,
+            size: index.len() as u64,
+            modified: (modified.as_secs(), modified.subsec_nanos()),
+        })
+    }
+}
+
+impl IndexCache {
+    /// Opens the cache at `path` for an index file.
+    ///
+    /// `None` when the index file can't be cached.  A missing cache, or one for a different
+    /// index file, isn't an error, there is just nothing to load until `store()` is called.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the cache file.
+    /// * `index` - The contents of the index file.
+    /// * `modified` - When the index file was last modified.
+    pub fn open(path: &Path, index: &[u8], modified: Option<SystemTime>) -> Option<IndexCache> {
+        let key = CacheKey::new(index, modified?)?;
+
+        // Safety: the cache is only ever replaced by renaming a new file over the top, it's
+        // never modified in place.
+        let contents = File::open(path)
+            .ok()
+            .and_then(|file| unsafe { Mmap::map(&file) }.ok())
+            .filter(|contents| matches!(read_header(contents), Ok((_, h)) if h.key == key));
+        Some(IndexCache {
+            path: PathBuf::from(path),
+            key,
+            contents,
+        })
+    }
+
+    /// The entries held in the cache, `None` when the cache wasn't written for this index file
+    /// or it's malformed.
+    pub fn load(&self) -> Option<ParsedEntries<'_>> {
+        let contents = self.contents.as_deref()?;
+        let (records, header) = read_header(contents).ok()?;
+        let entries_size = header.entries.checked_mul(ENTRY_SIZE)?;
+        let directories_size = header.directories.checked_mul(DIRECTORY_SIZE)?;
+        let dirty_size = header.dirty.checked_mul(DIRTY_SIZE)?;
+        let (entries, records) = split(records, entries_size)?;
+        let (directories, records) = split(records, directories_size)?;
+        let (dirty, records) = split(records, dirty_size)?;
+        let names = std::str::from_utf8(records.get(..header.names)?).ok()?;
+
+        // Collecting into an `Option` can't size the vector up front
+        let mut entry_list = Vec::with_capacity(header.entries);
+        for record in entries.chunks_exact(ENTRY_SIZE) {
+            entry_list.push(read_entry(record, names)?);
+        }
+        let entries = entry_list;
+        let directories = directories
+            .chunks_exact(DIRECTORY_SIZE)
+            .map(|record| {
+                let name = read_name(record, names)?;
+                let start = read_u32(&record[8..]) as usize;
+                let end = read_u32(&record[12..]) as usize;
+                if start > end || end > entries.len() {
+                    return None;
+                }
+                Some((name, start..end))
+            })
+            .collect::<Option<Vec<_>>>()?;
+        let fsmonitor_cache = match header.flags & HAS_FSMONITOR {
+            0 => None,
+            _ => {
+                let token = match header.flags & HAS_TOKEN {
+                    0 => None,
+                    _ => Some(names.get(header.token.0..header.token.0 + header.token.1)?),
+                };
+                let dirty = dirty
+                    .chunks_exact(DIRTY_SIZE)
+                    .map(|record| read_name(record, names))
+                    .collect::<Option<Vec<_>>>()?;
+                Some(FsMonitorCache { token, dirty })
+            }
+        };
+        Some(ParsedEntries {
+            entries: IndexEntries::from_parts(entries, directories),
+            end: header.end,
+            fsmonitor_cache,
+        })
+    }
+
+    /// Replaces the cache with `parsed`, the entries parsed from the index file.
+    ///
+    /// The new cache is written next to the old one then renamed over the top, so a status
+    /// running at the same time sees either the old cache or the new one.  The cache is only an
+    /// optimization, failing to write it is ignored.
+    pub fn store(&self, parsed: &ParsedEntries) {
+        let _ = self.write(parsed);
+    }
+
+    fn write(&self, parsed: &ParsedEntries) -> io::Result<()> {
+        let (entries, directories) = parsed.entries.parts();
+        let mut names = String::new();
+        let mut records =
+            Vec::with_capacity(entries.len() * ENTRY_SIZE + directories.len() * DIRECTORY_SIZE);
+        for entry in entries {
+            let stat = &entry.stat;
+            let fields = [
+                stat.ctime.0,
+                stat.ctime.1,
+                stat.mtime.0,
+                stat.mtime.1,
+                stat.dev,
+                stat.ino,
+                stat.uid,
+                stat.gid,
+                stat.size,
+            ];
+            for field in &fields {
+                records.extend(&field.to_le_bytes());
+            }
+            records.extend(&entry.mode.to_le_bytes());
+            records.extend(&[entry.skip_worktree as u8, 0]);
+            records.extend(&entry.sha);
+            records.extend(&add_name(&mut names, entry.name)?);
+        }
+        for (directory, range) in directories {
+            records.extend(&add_name(&mut names, directory)?);
+            records.extend(&(range.start as u32).to_le_bytes());
+            records.extend(&(range.end as u32).to_le_bytes());
+        }
+        let (mut flags, mut token, mut dirty) = (0, [0; 8], &[][..]);
+        if let Some(fsmonitor_cache) = &parsed.fsmonitor_cache {
+            flags |= HAS_FSMONITOR;
+            dirty = &fsmonitor_cache.dirty;
+            for path in dirty {
+                records.extend(&add_name(&mut names, path)?);
+            }
+            if let Some(value) = fsmonitor_cache.token {
+                flags |= HAS_TOKEN;
+                token = add_name(&mut names, value)?;
+            }
+        }
+        let names_size = names.len() as u32;
+
+        let mut contents = Vec::with_capacity(HEADER_SIZE + records.len() + names.len());
+        contents.extend(b"WGSC");
+        contents.extend(&CACHE_VERSION.to_le_bytes());
+        contents.extend(&self.key.checksum);
+        contents.extend(&self.key.size.to_le_bytes());
+        contents.extend(&self.key.modified.0.to_le_bytes());
+        contents.extend(&self.key.modified.1.to_le_bytes());
+        contents.extend(&(entries.len() as u32).to_le_bytes());
+        contents.extend(&(directories.len() as u32).to_le_bytes());
+        contents.extend(&(dirty.len() as u32).to_le_bytes());
+        contents.extend(&(parsed.end as u64).to_le_bytes());
+        contents.extend(&names_size.to_le_bytes());
+        contents.extend(&token);
+        contents.extend(&flags.to_le_bytes());
+        contents.extend(&records);
+        contents.extend(names.as_bytes());
+
+        if let Some(directory) = self.path.parent() {
+            fs::create_dir_all(directory)?;
+        }
+        let mut temporary = self.path.clone().into_os_string();
+        temporary.push(format!(".{}.tmp", std::process::id()));
+        fs::write(&temporary, &contents)?;
+        let renamed = fs::rename(&temporary, &self.path);
+        if renamed.is_err() {
+            let _ = fs::remove_file(&temporary);
+        }
+        renamed
+    }
+}
+
+fn read_header(stream: &[u8]) -> IResult<&[u8], Header> {
+    let (input, (_, _, checksum, size, seconds, nanoseconds)) = tuple((
+        tag("WGSC"),
+        verify(le_u32, |version| *version == CACHE_VERSION),
+        take(20usize),
+        le_u64,
+        le_u64,
+        le_u32,
+    ))(stream)?;
+    let (input, (entries, directories, dirty, end, names, token_offset, token_size, flags)) =
+        tuple((
+            le_u32, le_u32, le_u32, le_u64, le_u32, le_u32, le_u32, le_u32,
+        ))(input)?;
+    let header = Header {
+        key: CacheKey {
+            checksum: checksum.try_into().unwrap(),
+            size,
+            modified: (seconds, nanoseconds),
+        },
+        entries: entries as usize,
+        directories: directories as usize,
+        dirty: dirty as usize,
+        end: end as usize,
+        names: names as usize,
+        token: (token_offset as usize, token_size as usize),
+        flags,
+    };
+    Ok((input, header))
+}
+
+// Adds `name` to the end of `names`, returning the offset and size record which points to it
+fn add_name(names: &mut String, name: &str) -> io::Result<[u8; 8]> {
+    if names.len() + name.len() > u32::MAX as usize {
+        return Err(io::Error::other("index too large to cache"));
+    }
+    let offset = names.len() as u32;
+    names.push_str(name);
+    let mut record = [0; 8];
+    record[..4].copy_from_slice(&offset.to_le_bytes());
+    record[4..].copy_from_slice(&(name.len() as u32).to_le_bytes());
+    Ok(record)
+}
+
+// The first `size` bytes of `records` along with the rest
+fn split(records: &[u8], size: usize) -> Option<(&[u8], &[u8])> {
+    match records.len() >= size {
+        true => Some(records.split_at(size)),
+        false => None,
+    }
+}
+
+fn read_u32(record: &[u8]) -> u32 {
+    u32::from_le_bytes(record[..4].try_into().unwrap())
+}
+
+// The name a record points to, its offset and size are the first 8 bytes of the record
+fn read_name<'a>(record: &[u8], names: &'a str) -> Option<&'a str> {
+    let offset = read_u32(record) as usize;
+    let size = read_u32(&record[4..]) as usize;
+    names.get(offset..offset + size)
+}
+
+fn read_entry<'a>(record: &[u8], names: &'a str) -> Option<DirEntry<'a>> {
+    let field = |number: usize| read_u32(&record[number * 4..]);
+    let mode = u16::from_le_bytes(record[36..38].try_into().unwrap());
+    Some(DirEntry {
+        object_type: ObjectType::from_mode(mode),
+        stat: FileStat {
+            ctime: (field(0), field(1)),
+            mtime: (field(2), field(3)),
+            dev: field(4),
+            ino: field(5),
+            uid: field(6),
+            gid: field(7),
+            size: field(8),
+        },
+        mode,
+        sha: record[40..60].try_into().unwrap(),
+        name: read_name(&record[60..], names)?,
+        skip_worktree: record[38] != 0,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::time::Duration;
+    use temp_testdir::TempDir;
+
+    // An index file, only the trailing checksum and size of which matter to the cache
+    fn index_contents(checksum: u8) -> Vec<u8> {
+        let mut contents = b"DIRC".to_vec();
+        contents.extend(&[checksum; 20]);
+        contents
+    }
+
+    fn modified() -> Option<SystemTime> {
+        Some(UNIX_EPOCH + Duration::new(1_600_000_000, 123))
+    }
+
+    fn entry(name: &str, mode: u16) -> DirEntry<'_> {
+        DirEntry {
+            object_type: ObjectType::from_mode(mode),
+            stat: FileStat {
+                ctime: (9, 99),
+                mtime: (10, 100),
+                ino: 11,
+                size: name.len() as u32,
+                ..Default::default()
+            },
+            mode,
+            sha: [name.len() as u8; 20],
+            name,
+            skip_worktree: mode == 0o040000,
+        }
+    }
+
+    fn parsed_entries() -> ParsedEntries<'static> {
+        let entries = vec![
+            ("", entry("a.txt", 0o100644)),
+            ("dir", entry("link", 0o120000)),
+            ("dir/sub", entry("file", 0o100755)),
+            ("", entry("sparse", 0o040000)),
+        ];
+        ParsedEntries {
+            entries: entries.into_iter().collect(),
+            end: 1234,
+            fsmonitor_cache: Some(FsMonitorCache {
+                token: Some("token"),
+                dirty: vec!["dir/link", "a.txt"],
+            }),
+        }
+    }
+
+    #[test]
+    fn test_cache_round_trip() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("win-git-status/index.cache");
+        let index = index_contents(1);
+        let parsed = parsed_entries();
+        let cache = IndexCache::open(&path, &index, modified()).unwrap();
+        assert_eq!(cache.load(), None);
+        cache.store(&parsed);
+
+        let cache = IndexCache::open(&path, &index, modified()).unwrap();
+        assert_eq!(cache.load(), Some(parsed));
+    }
+
+    #[test]
+    fn test_cache_without_fsmonitor_token() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("index.cache");
+        let index = index_contents(1);
+        let mut parsed = parsed_entries();
+        parsed.fsmonitor_cache = Some(FsMonitorCache::default());
+        IndexCache::open(&path, &index, modified())
+            .unwrap()
+            .store(&parsed);
+        let cache = IndexCache::open(&path, &index, modified()).unwrap();
+        assert_eq!(cache.load().as_ref(), Some(&parsed));
+
+        // A new path, Windows won't rename over a file which is mapped
+        let path = temp_dir.join("other.cache");
+        parsed.fsmonitor_cache = None;
+        IndexCache::open(&path, &index, modified())
+            .unwrap()
+            .store(&parsed);
+        let cache = IndexCache::open(&path, &index, modified()).unwrap();
+        assert_eq!(cache.load(), Some(parsed));
+    }
+
+    #[test]
+    fn test_cache_of_another_index_is_not_loaded() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("index.cache");
+        let index = index_contents(1);
+        IndexCache::open(&path, &index, modified())
+            .unwrap()
+            .store(&parsed_entries());
+
+        let other = index_contents(2);
+        let cache = IndexCache::open(&path, &other, modified()).unwrap();
+        assert_eq!(cache.load(), None);
+
+        let later = modified().map(|m| m + Duration::from_nanos(1));
+        let cache = IndexCache::open(&path, &index, later).unwrap();
+        assert_eq!(cache.load(), None);
+    }
+
+    #[test]
+    fn test_index_without_checksum_is_not_cached() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("index.cache");
+        assert!(IndexCache::open(&path, &index_contents(0), modified()).is_none());
+        assert!(IndexCache::open(&path, &index_contents(1), None).is_none());
+    }
+
+    #[test]
+    fn test_truncated_cache_is_not_loaded() {
+        let temp_dir = TempDir::default();
+        let path = temp_dir.join("index.cache");
+        let index = index_contents(1);
+        IndexCache::open(&path, &index, modified())
+            .unwrap()
+            .store(&parsed_entries());
+        let contents = fs::read(&path).unwrap();
+        fs::write(&path, &contents[..contents.len() - 1]).unwrap();
+
+        let cache = IndexCache::open(&path, &index, modified()).unwrap();
+        assert_eq!(cache.load(), None);
+    }
+}
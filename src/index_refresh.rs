@@ -0,0 +1,545 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::direntry::FileStat;
+use crate::error::StatusError;
+use crate::index::{UntrackedCache, UntrackedDirectory};
+use crate::sha1::Sha1;
+use crate::worktree::is_racy;
+use crate::{Index, IndexFile};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::env;
+use std::fs;
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::path::PathBuf;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+// The size of the stat data at the start of each entry, ctime through the file size
+const STAT_SIZE: usize = 40;
+
+// Where the object id and the flags are from the start of an entry
+const SHA_OFFSET: usize = 40;
+const FLAGS_OFFSET: usize = 60;
+
+// The 2 bit merge stage in the flags
+const STAGE_MASK: u16 = 0x3000;
+
+/// The stat data of a tracked file whose contents were found to match its index entry.
+#[derive(PartialEq, Eq, Debug, Clone)]
+pub struct RefreshedEntry {
+    /// The path relative to the root of the repo, using "/" as the separator.
+    pub path: String,
+    /// The object id the contents matched, once converted the way git converts them when
+    /// hashing, see `Conversion`.
+    pub sha: [u8; 20],
+    pub stat: FileStat,
+}
+
+/// An index file with the stat data of some entries refreshed, ready to replace the index file.
+///
+/// When the stat data of a file no longer matches the index, after a checkout or a build which
+/// rewrote the same contents, the file has to be hashed to know it's unchanged.  Like git's status
+/// the new stat data is written back to the index, so only the first status pays for hashing.
+///
+/// This is git's opportunistic update, it's skipped when `GIT_OPTIONAL_LOCKS` is false and when
+/// anything else has the index locked or has written it since it was read.
+#[derive(Debug)]
+pub struct IndexRefresh {
+    path: PathBuf,
+    // The checksum of the index file the entries were refreshed in
+    checksum: [u8; 20],
+    contents: Vec<u8>,
+}
+
+/// Whether optional operations which need to lock the index are allowed, `GIT_OPTIONAL_LOCKS`.
+pub fn optional_locks() -> bool {
+    match env::var("GIT_OPTIONAL_LOCKS") {
+        Ok(value) => !matches!(value.to_lowercase().as_str(), "0" | "false" | "no" | "off"),
+        Err(_) => true,
+    }
+}
+
+impl IndexRefresh {
+    /// The contents of `file` with the stat data of `entries` refreshed.
+    ///
+    /// `None` when there is nothing to refresh.  Entries which are being merged, or which were
+    /// modified in the same second as now, are left alone, the latter would be racily clean
+    /// again in the new index.  Split indices, and indices without a checksum or a modification
+    /// time, aren't refreshed.
+    ///
+    /// The new index is written later than the old one, so any other entry which is racily clean
+    /// would no longer look racy, whether or not it was looked at.  Like git, these entries are
+    /// smudged by recording a size of 0, which forces their contents to be compared next time.
+    /// The untracked cache is dropped when any of its directories are racily clean.
+    ///
+    /// # Arguments
+    ///
+    /// * `file` - The index file.
+    /// * `index` - The index parsed from `file`.
+    /// * `entries` - The entries to refresh, see `WorkTree::refreshed`.
+    pub fn new(
+        file: &IndexFile,
+        index: &Index,
+        entries: &[RefreshedEntry],
+    ) -> Result<Option<IndexRefresh>, StatusError> {
+        let checksum_start = match (file.len().checked_sub(20), index.modified()) {
+            (Some(start), Some(_)) if !entries.is_empty() && !index.is_split() => start,
+            _ => return Ok(None),
+        };
+        let mut checksum = [0; 20];
+        checksum.copy_from_slice(&file[checksum_start..]);
+        if checksum == [0; 20] {
+            return Ok(None);
+        }
+
+        let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap();
+        let now = now.as_secs() as u32;
+        let refreshed: HashMap<&str, &RefreshedEntry> =
+            entries.iter().map(|e| (e.path.as_str(), e)).collect();
+        let mut contents = file.to_vec();
+        let mut count = 0;
+        let end_of_entries = Index::visit_entry_offsets(file, |offset, name| {
+            let fields = &mut contents[offset..offset + FLAGS_OFFSET + 2];
+            let flags = u16::from_be_bytes([fields[FLAGS_OFFSET], fields[FLAGS_OFFSET + 1]]);
+            let entry = refreshed.get(name).filter(|entry| {
+                flags & STAGE_MASK == 0
+                    && fields[SHA_OFFSET..FLAGS_OFFSET] == entry.sha
+                    && entry.stat.mtime.0 < now
+            });
+            match entry {
+                Some(entry) => {
+                    write_stat(&mut fields[..STAT_SIZE], &entry.stat);
+                    count += 1;
+                }
+                None => smudge_racy(&mut fields[..STAT_SIZE], index.modified()),
+            }
+        })?;
+        if count == 0 {
+            return Ok(None);
+        }
+        let untracked_cache = index.untracked_cache();
+        if untracked_cache.map_or(false, |c| is_racy_cache(c, index.modified()))
+            && remove_extension(&mut contents, end_of_entries, b"UNTR").is_none()
+        {
+            return Ok(None);
+        }
+
+        let checksum_start = contents.len() - 20;
+        let new_checksum = Sha1::digest(&contents[..checksum_start]);
+        contents[checksum_start..].copy_from_slice(&new_checksum);
+        Ok(Some(IndexRefresh {
+            path: PathBuf::from(file.path()),
+            checksum,
+            contents,
+        }))
+    }
+
+    /// Replaces the index file with the refreshed one, returning whether it was replaced.
+    ///
+    /// The new index is written to `index.lock` and renamed over the index, the way git does.
+    /// Nothing is written when the lock is already taken or the index changed since it was read.
+    /// The index file this was created from needs to be closed first, a mapped file can't be
+    /// replaced on Windows.
+    pub fn write(&self) -> Result<bool, StatusError> {
+        let mut lock_path = self.path.clone().into_os_string();
+        lock_path.push(".lock");
+        let lock = match OpenOptions::new()
+            .write(true)
+            .create_new(true)
+            .open(&lock_path)
+        {
+            Ok(lock) => lock,
+            Err(_) => return Ok(false),
+        };
+        let written = self.write_lock(lock).and_then(|unchanged| match unchanged {
+            true => fs::rename(&lock_path, &self.path).map(|_| true),
+            false => Ok(false),
+        });
+        if !matches!(written, Ok(true)) {
+            let _ = fs::remove_file(&lock_path);
+        }
+        Ok(written?)
+    }
+
+    // Writes the refreshed index to the `lock` file when the index is still the one which was
+    // refreshed
+    fn write_lock(&self, mut lock: File) -> io::Result<bool> {
+        let mut index = File::open(&self.path)?;
+        if index.metadata()?.len() != self.contents.len() as u64 {
+            return Ok(false);
+        }
+        let mut checksum = [0; 20];
+        index.seek(SeekFrom::End(-20))?;
+        index.read_exact(&mut checksum)?;
+        if checksum != self.checksum {
+            return Ok(false);
+        }
+        lock.write_all(&self.contents)?;
+        Ok(true)
+    }
+}
+
+// Writes `stat` in the layout of the start of an index entry, the mode in the middle is kept
+fn write_stat(fields: &mut [u8], stat: &FileStat) {
+    let values = [
+        (0, stat.ctime.0),
+        (4, stat.ctime.1),
+        (8, stat.mtime.0),
+        (12, stat.mtime.1),
+        (16, stat.dev),
+        (20, stat.ino),
+        (28, stat.uid),
+        (32, stat.gid),
+        (36, stat.size),
+    ];
+    for (offset, value) in &values {
+        fields[*offset..*offset + 4].copy_from_slice(&value.to_be_bytes());
+    }
+}
+
+// Records a size of 0 in the stat data `fields` of an entry when it's racily clean against the
+// index written at `index_modified`, git's `ce_smudge_racily_clean_entry()`
+fn smudge_racy(fields: &mut [u8], index_modified: Option<SystemTime>) {
+    let read = |offset: usize| u32::from_be_bytes(fields[offset..offset + 4].try_into().unwrap());
+    let stat = FileStat {
+        mtime: (read(8), read(12)),
+        ..FileStat::default()
+    };
+    if is_racy(&stat, index_modified) {
+        fields[36..40].copy_from_slice(&0u32.to_be_bytes());
+    }
+}
+
+// Whether any of the stat data recorded in the untracked `cache` is racily clean against the
+// index written at `index_modified`
+fn is_racy_cache(cache: &UntrackedCache, index_modified: Option<SystemTime>) -> bool {
+    fn is_racy_directory(
+        directory: &UntrackedDirectory,
+        index_modified: Option<SystemTime>,
+    ) -> bool {
+        directory
+            .stat
+            .map_or(false, |s| is_racy(&s, index_modified))
+            || directory
+                .subdirectories
+                .iter()
+                .any(|d| is_racy_directory(d, index_modified))
+    }
+    let is_racy_file =
+        |stat: &FileStat| *stat != FileStat::default() && is_racy(stat, index_modified);
+    is_racy_file(&cache.info_exclude)
+        || is_racy_file(&cache.excludes_file)
+        || cache
+            .root
+            .as_ref()
+            .map_or(false, |r| is_racy_directory(r, index_modified))
+}
+
+// Removes the extension with `signature` from the index `contents`, whose extensions start at
+// `end_of_entries`.  The hash of the extension headers in the End Of Index Entry (EOIE) extension
+// is updated to match.  `None` when the extensions can't be read.
+fn remove_extension(contents: &mut Vec<u8>, end_of_entries: usize, signature: &[u8]) -> Option<()> {
+    let extensions = extension_offsets(contents, end_of_entries)?;
+    if let Some(&(start, end)) = extensions
+        .iter()
+        .find(|(start, _)| &contents[*start..*start + 4] == signature)
+    {
+        contents.drain(start..end);
+    }
+
+    let extensions = extension_offsets(contents, end_of_entries)?;
+    if let Some((&(eoie_start, _), others)) = extensions.split_last() {
+        if &contents[eoie_start..eoie_start + 4] == b"EOIE" {
+            let headers: Vec<u8> = others
+                .iter()
+                .flat_map(|&(start, _)| contents[start..start + 8].to_vec())
+                .collect();
+            let hash = Sha1::digest(&headers);
+            contents[eoie_start + 12..eoie_start + 32].copy_from_slice(&hash);
+        }
+    }
+    Some(())
+}
+
+// The start and end of each extension in the index `contents`, from `end_of_entries` up to the
+// checksum
+fn extension_offsets(contents: &[u8], end_of_entries: usize) -> Option<Vec<(usize, usize)>> {
+    let extensions_end = contents.len().checked_sub(20)?;
+    let mut offsets = vec![];
+    let mut start = end_of_entries;
+    while start < extensions_end {
+        let size = contents.get(start + 4..start + 8)?;
+        let size = u32::from_be_bytes(size.try_into().unwrap()) as usize;
+        let end = start + 8 + size;
+        if end > extensions_end {
+            return None;
+        }
+        offsets.push((start, end));
+        start = end;
+    }
+    Some(offsets)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::WorkTree;
+    use git2::{Repository, Signature, Time};
+    use std::path::Path;
+    use std::time::Duration;
+    use temp_testdir::TempDir;
+
+    // A repo with `names` committed, the files are given a modification time in the past so
+    // they're never racily clean
+    fn test_repo(path: &Path, names: &[&str]) {
+        let repo = Repository::init(path).unwrap();
+        let mut index = repo.index().unwrap();
+        for name in names {
+            let full_path = path.join(name);
+            fs::create_dir_all(full_path.parent().unwrap()).unwrap();
+            fs::write(&full_path, name).unwrap();
+            set_past_mtime(&full_path);
+            index.add_path(Path::new(name)).unwrap();
+        }
+        index.write().unwrap();
+        let tree_oid = index.write_tree().unwrap();
+        let tree = repo.find_tree(tree_oid).unwrap();
+        let signature = Signature::new("Tucan", "me@me.com", &Time::new(20, 0)).unwrap();
+        repo.commit(
+            Some("HEAD"),
+            &signature,
+            &signature,
+            "A message",
+            &tree,
+            &[],
+        )
+        .unwrap();
+    }
+
+    fn set_past_mtime(path: &Path) {
+        let past = SystemTime::now() - Duration::from_secs(60);
+        let file = OpenOptions::new().write(true).open(path).unwrap();
+        file.set_modified(past).unwrap();
+    }
+
+    // Rewrites the files with the same contents, returning what a status would refresh
+    fn rewrite(path: &Path, names: &[&str]) -> Vec<RefreshedEntry> {
+        let index_file = IndexFile::open(&path.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        names
+            .iter()
+            .map(|name| {
+                let full_path = path.join(name);
+                let contents = fs::read(&full_path).unwrap();
+                fs::remove_file(&full_path).unwrap();
+                fs::write(&full_path, contents).unwrap();
+                set_past_mtime(&full_path);
+                let (directory, file_name) = name.rsplit_once('/').unwrap_or(("", name));
+                let entry = &index.entries[directory]
+                    .iter()
+                    .find(|e| e.name == file_name)
+                    .unwrap();
+                let metadata = fs::symlink_metadata(&full_path).unwrap();
+                let mtime = metadata.modified().unwrap().duration_since(UNIX_EPOCH);
+                let mtime = mtime.unwrap();
+                RefreshedEntry {
+                    path: name.to_string(),
+                    sha: entry.sha,
+                    stat: FileStat {
+                        mtime: (mtime.as_secs() as u32, mtime.subsec_nanos()),
+                        ino: entry.stat.ino + 1,
+                        ..entry.stat
+                    },
+                }
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_refresh_writes_stat_data() {
+        let temp_dir = TempDir::default();
+        let names = ["a.txt", "dir/b.txt", "dir/c.txt"];
+        test_repo(&temp_dir, &names);
+        let refreshed = rewrite(&temp_dir, &names[1..]);
+
+        let index_path = temp_dir.join(".git/index");
+        let index_file = IndexFile::open(&index_path).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        let refresh = IndexRefresh::new(&index_file, &index, &refreshed).unwrap();
+        drop(index);
+        drop(index_file);
+        assert!(refresh.unwrap().write().unwrap());
+        assert!(!temp_dir.join(".git/index.lock").exists());
+
+        let contents = fs::read(&index_path).unwrap();
+        let checksum_start = contents.len() - 20;
+        assert_eq!(
+            Sha1::digest(&contents[..checksum_start]),
+            contents[checksum_start..]
+        );
+        let index_file = IndexFile::open(&index_path).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        let stats: Vec<FileStat> = index.entries["dir"].iter().map(|e| e.stat).collect();
+        let expected: Vec<FileStat> = refreshed.iter().map(|e| e.stat).collect();
+        assert_eq!(stats, expected);
+    }
+
+    #[test]
+    fn test_racily_clean_entries_are_smudged() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &["a.txt", "b.txt"]);
+        let repo = Repository::open(&temp_dir).unwrap();
+        // Rewriting a file in place changes its change time, which git can be told to ignore
+        repo.config()
+            .unwrap()
+            .set_bool("core.trustctime", false)
+            .unwrap();
+        let index_path = temp_dir.join(".git/index");
+        let recorded = {
+            let index_file = IndexFile::open(&index_path).unwrap();
+            let index = Index::new(&index_file).unwrap();
+            index.entries[""][0].stat.mtime
+        };
+
+        // "a.txt" is modified, keeping its size, in the same instant the index was written
+        let modified = UNIX_EPOCH + Duration::new(recorded.0 as u64, recorded.1);
+        let a_path = temp_dir.join("a.txt");
+        fs::write(&a_path, "A.txt").unwrap();
+        for path in [&a_path, &index_path].iter() {
+            let file = OpenOptions::new().write(true).open(path).unwrap();
+            file.set_modified(modified).unwrap();
+        }
+        rewrite(&temp_dir, &["b.txt"]);
+
+        let status = || {
+            let index_file = IndexFile::open(&index_path).unwrap();
+            let index = Index::new(&index_file).unwrap();
+            let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+            let refresh = IndexRefresh::new(&index_file, &index, &work_tree.refreshed).unwrap();
+            let names: Vec<String> = work_tree.entries.into_iter().map(|e| e.name).collect();
+            (names, refresh)
+        };
+        let (names, refresh) = status();
+        assert_eq!(names, vec!["a.txt"]);
+        assert!(refresh.unwrap().write().unwrap());
+
+        // The index is now newer than "a.txt", only its smudged size shows it wasn't refreshed
+        let (names, _) = status();
+        assert_eq!(names, vec!["a.txt"]);
+    }
+
+    #[test]
+    fn test_refresh_of_converted_contents() {
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        repo.config()
+            .unwrap()
+            .set_bool("core.autocrlf", true)
+            .unwrap();
+        let path = temp_dir.join("a.txt");
+        fs::write(&path, "one\r\ntwo\r\n").unwrap();
+        set_past_mtime(&path);
+        let mut index = repo.index().unwrap();
+        index.add_path(Path::new("a.txt")).unwrap();
+        index.write().unwrap();
+        rewrite(&temp_dir, &["a.txt"]);
+
+        let index_path = temp_dir.join(".git/index");
+        let status = || {
+            let index_file = IndexFile::open(&index_path).unwrap();
+            let index = Index::new(&index_file).unwrap();
+            let work_tree = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+            assert_eq!(work_tree.entries, vec![]);
+            let refresh = IndexRefresh::new(&index_file, &index, &work_tree.refreshed).unwrap();
+            (work_tree.refreshed.len(), refresh)
+        };
+        let (refreshed, refresh) = status();
+        assert_eq!(refreshed, 1);
+        assert!(refresh.unwrap().write().unwrap());
+
+        // The file with CRLFs matches the blob with LFs without being hashed again
+        let (refreshed, refresh) = status();
+        assert_eq!(refreshed, 0);
+        assert!(refresh.is_none());
+    }
+
+    #[test]
+    fn test_nothing_to_refresh() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &["a.txt"]);
+        let mut refreshed = rewrite(&temp_dir, &["a.txt"]);
+        let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        assert!(IndexRefresh::new(&index_file, &index, &[])
+            .unwrap()
+            .is_none());
+
+        // The contents changed again since they were found to match
+        refreshed[0].sha = [1; 20];
+        assert!(IndexRefresh::new(&index_file, &index, &refreshed)
+            .unwrap()
+            .is_none());
+
+        // Racily clean
+        refreshed = rewrite(&temp_dir, &["a.txt"]);
+        refreshed[0].stat.mtime.0 = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .unwrap()
+            .as_secs() as u32;
+        assert!(IndexRefresh::new(&index_file, &index, &refreshed)
+            .unwrap()
+            .is_none());
+    }
+
+    #[test]
+    fn test_locked_index_is_not_written() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &["a.txt"]);
+        let refreshed = rewrite(&temp_dir, &["a.txt"]);
+        let index_path = temp_dir.join(".git/index");
+        let original = fs::read(&index_path).unwrap();
+        let refresh = {
+            let index_file = IndexFile::read(&index_path).unwrap();
+            let index = Index::new(&index_file).unwrap();
+            IndexRefresh::new(&index_file, &index, &refreshed)
+                .unwrap()
+                .unwrap()
+        };
+
+        fs::write(temp_dir.join(".git/index.lock"), "").unwrap();
+        assert!(!refresh.write().unwrap());
+        assert!(temp_dir.join(".git/index.lock").exists());
+        assert_eq!(fs::read(&index_path).unwrap(), original);
+    }
+
+    #[test]
+    fn test_index_written_since_read_is_not_replaced() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &["a.txt", "b.txt"]);
+        let refreshed = rewrite(&temp_dir, &["a.txt"]);
+        let index_path = temp_dir.join(".git/index");
+        let refresh = {
+            let index_file = IndexFile::read(&index_path).unwrap();
+            let index = Index::new(&index_file).unwrap();
+            IndexRefresh::new(&index_file, &index, &refreshed)
+                .unwrap()
+                .unwrap()
+        };
+
+        let repo = Repository::open(&temp_dir).unwrap();
+        let mut index = repo.index().unwrap();
+        index.remove_path(Path::new("b.txt")).unwrap();
+        index.write().unwrap();
+        let written = fs::read(&index_path).unwrap();
+        assert!(!refresh.write().unwrap());
+        assert!(!temp_dir.join(".git/index.lock").exists());
+        assert_eq!(fs::read(&index_path).unwrap(), written);
+    }
+}
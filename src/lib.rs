@@ -4,17 +4,32 @@
  *    (See accompanying file LICENSE or copy at
  *          https://www.boost.org/LICENSE_1_0.txt)
  */
+mod changes;
+mod convert;
+mod dir_listing;
 mod direntry;
 mod error;
+mod fsmonitor;
+pub mod hash;
+mod ignores;
 mod index;
+mod index_cache;
+mod index_refresh;
+mod pathspec;
 mod repo_status;
+mod sha1;
+mod sparse;
 pub mod status;
 mod tree;
+#[cfg(all(target_os = "linux", feature = "io-uring"))]
+mod uring;
 pub mod worktree;
 
 pub use direntry::DirEntry;
 pub use error::StatusError;
-pub use index::Index;
-pub use repo_status::RepoStatus;
+pub use index::{Index, IndexFile};
+pub use index_refresh::RefreshedEntry;
+pub use pathspec::Pathspec;
+pub use repo_status::{RepoStatus, StatusOptions};
 pub use tree::TreeDiff;
-pub use worktree::WorkTree;
+pub use worktree::{UntrackedFiles, WorkTree};
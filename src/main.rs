@@ -3,6 +3,8 @@ use std::{env, process};
 use termcolor::{ColorChoice, StandardStream};
 use win_git_status::RepoStatus;
 use win_git_status::StatusError;
+use win_git_status::StatusOptions;
+use win_git_status::UntrackedFiles;
 
 fn run() -> Result<(), StatusError> {
     let matches = App::new("Win-git-status")
@@ -15,10 +17,51 @@ fn run() -> Result<(), StatusError> {
                 .takes_value(false)
                 .help("Give the output in the short-format."),
         )
+        .arg(
+            Arg::with_name("no-optional-locks")
+                .long("no-optional-locks")
+                .takes_value(false)
+                .help("Don't write refreshed stat data back to the index."),
+        )
+        .arg(
+            Arg::with_name("untracked-files")
+                .short("u")
+                .long("untracked-files")
+                .takes_value(true)
+                .min_values(0)
+                .require_equals(true)
+                .value_name("mode")
+                .possible_values(&["no", "normal", "all"])
+                .help("Show untracked files, \"all\" when no mode is given."),
+        )
+        .arg(
+            Arg::with_name("pathspec")
+                .multiple(true)
+                .index(1)
+                .help("Limit the status to the matching paths."),
+        )
         .get_matches();
 
+    if matches.is_present("no-optional-locks") {
+        env::set_var("GIT_OPTIONAL_LOCKS", "0");
+    }
+
+    let untracked_files = match matches.is_present("untracked-files") {
+        true => matches
+            .value_of("untracked-files")
+            .map_or(Some(UntrackedFiles::All), UntrackedFiles::parse),
+        false => None,
+    };
+    let pathspecs = matches
+        .values_of("pathspec")
+        .map_or(vec![], |v| v.map(String::from).collect());
+    let options = StatusOptions {
+        untracked_files,
+        pathspecs,
+    };
+
     let path = env::current_dir()?;
-    let status = RepoStatus::new(&path)?;
+    let status = RepoStatus::new_with_options(&path, &options)?;
     let mut stdout = StandardStream::stdout(ColorChoice::Auto);
     if matches.is_present("short") {
         status.write_short_message(&mut stdout)?;
@@ -0,0 +1,186 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::error::StatusError;
+use core::cmp::Ordering;
+use globset::{GlobBuilder, GlobMatcher};
+
+/// The paths a status is limited to, git's pathspecs without any of the ":(magic)".
+///
+/// A pathspec without wildcards matches the path itself and everything under it.  A pathspec
+/// with wildcards is a glob whose "*" also matches "/", so "src/*.c" matches "src/a/b.c".
+///
+/// The walks of the work tree and the index only go into the directories which something could
+/// match under, and stop checking once a whole directory matches.
+#[derive(Debug, Clone)]
+pub struct Pathspec {
+    items: Vec<Item>,
+}
+
+#[derive(Debug, Clone)]
+struct Item {
+    // The pathspec up to its first wildcard, all of it for a literal pathspec
+    literal: String,
+    glob: Option<GlobMatcher>,
+}
+
+impl Pathspec {
+    /// The pathspecs `specs`, relative to the work tree relative `directory`, "" for the root.
+    ///
+    /// An error is returned for a pathspec outside of the work tree or a glob git wouldn't take.
+    pub fn new<S: AsRef<str>>(directory: &str, specs: &[S]) -> Result<Pathspec, StatusError> {
+        let mut items = vec![];
+        for spec in specs {
+            let spec = spec.as_ref();
+            let path = normalize(directory, spec).ok_or_else(|| StatusError {
+                message: format!("fatal: {}: '{}' is outside repository", spec, spec),
+            })?;
+            let wildcard = path.find(['*', '?', '[', '\\']);
+            let glob = match wildcard {
+                Some(_) => {
+                    let glob = GlobBuilder::new(&path).build().map_err(|e| StatusError {
+                        message: format!("fatal: invalid pathspec '{}': {}", spec, e),
+                    })?;
+                    Some(glob.compile_matcher())
+                }
+                None => None,
+            };
+            let literal = path[..wildcard.unwrap_or(path.len())].to_string();
+            items.push(Item { literal, glob });
+        }
+        Ok(Pathspec { items })
+    }
+
+    /// Whether the work tree relative `path` is matched, along with everything under it.
+    pub fn matches(&self, path: &str) -> bool {
+        self.items.iter().any(|item| item.matches(path))
+    }
+
+    /// Whether anything under the work tree relative `directory` could be matched.
+    pub fn may_match_under(&self, directory: &str) -> bool {
+        self.items
+            .iter()
+            .any(|item| item.may_match_under(directory))
+    }
+
+    /// Whether the work tree relative `path` needs to be looked at, it's matched or it's a
+    /// directory with something under it which could be.
+    pub fn includes(&self, path: &str, is_dir: bool) -> bool {
+        self.matches(path) || (is_dir && self.may_match_under(path))
+    }
+}
+
+impl Item {
+    fn matches(&self, path: &str) -> bool {
+        match &self.glob {
+            Some(glob) => glob.is_match(path),
+            None => is_under(path, &self.literal),
+        }
+    }
+
+    fn may_match_under(&self, directory: &str) -> bool {
+        if self.literal.is_empty() || directory.is_empty() {
+            return true;
+        }
+        // Anything the pathspec matches starts with its literal part, which can end part way
+        // through a name for a glob
+        let literal = self.literal.as_bytes();
+        let directory = directory.as_bytes();
+        let common = literal.len().min(directory.len());
+        if literal[..common] != directory[..common] {
+            return false;
+        }
+        match literal.len().cmp(&directory.len()) {
+            Ordering::Greater => literal[directory.len()] == b'/',
+            Ordering::Equal => true,
+            Ordering::Less => self.glob.is_some() || directory[literal.len()] == b'/',
+        }
+    }
+}
+
+// Whether `path` is `directory` or is under it, everything is under the root ""
+fn is_under(path: &str, directory: &str) -> bool {
+    match path.strip_prefix(directory) {
+        Some(rest) => directory.is_empty() || rest.is_empty() || rest.starts_with('/'),
+        None => false,
+    }
+}
+
+// The work tree relative path of `spec`, given relative to `directory`.  The "." and ".."
+// components are resolved, `None` when the path leaves the work tree.
+fn normalize(directory: &str, spec: &str) -> Option<String> {
+    // Windows separators, elsewhere a backslash escapes a wildcard
+    let spec = match cfg!(windows) {
+        true => spec.replace('\\', "/"),
+        false => spec.to_string(),
+    };
+    let mut components: Vec<&str> = directory.split('/').filter(|c| !c.is_empty()).collect();
+    for component in spec.split('/') {
+        match component {
+            "" | "." => {}
+            ".." => {
+                components.pop()?;
+            }
+            component => components.push(component),
+        }
+    }
+    Some(components.join("/"))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pathspec(specs: &[&str]) -> Pathspec {
+        Pathspec::new("", specs).unwrap()
+    }
+
+    #[test]
+    fn test_literal_pathspec_matches_everything_under_it() {
+        let spec = pathspec(&["src/app"]);
+        assert!(spec.matches("src/app"));
+        assert!(spec.matches("src/app/main.rs"));
+        assert!(!spec.matches("src/application.rs"));
+        assert!(!spec.matches("src"));
+        assert!(spec.may_match_under("src"));
+        assert!(spec.may_match_under("src/app"));
+        assert!(!spec.may_match_under("src/ap"));
+        assert!(!spec.may_match_under("lib"));
+        assert!(spec.may_match_under("src/app/deeper"));
+    }
+
+    #[test]
+    fn test_glob_pathspec() {
+        let spec = pathspec(&["src/a*.c"]);
+        assert!(spec.matches("src/a.c"));
+        assert!(spec.matches("src/abc/d.c"));
+        assert!(!spec.matches("src/b.c"));
+        assert!(spec.may_match_under("src"));
+        assert!(spec.may_match_under("src/abc"));
+        assert!(!spec.may_match_under("src/b"));
+        assert!(!spec.may_match_under("lib"));
+
+        let spec = pathspec(&["*.md"]);
+        assert!(spec.matches("docs/deep/readme.md"));
+        assert!(spec.may_match_under("docs"));
+    }
+
+    #[test]
+    fn test_pathspec_relative_to_directory() {
+        let spec = Pathspec::new("src/app", &["main.rs", "../lib", "."]).unwrap();
+        assert!(spec.matches("src/app/main.rs"));
+        assert!(spec.matches("src/lib/mod.rs"));
+        assert!(spec.matches("src/app/other.rs"));
+        assert!(!spec.matches("src/other.rs"));
+
+        let everything = Pathspec::new("", &["."]).unwrap();
+        assert!(everything.matches("any/path"));
+        assert!(everything.may_match_under("any"));
+
+        assert!(Pathspec::new("src", &["../../outside"]).is_err());
+    }
+}
@@ -6,8 +6,9 @@
  */
 
 use crate::error::StatusError;
+use crate::index_refresh::{optional_locks, IndexRefresh};
 use crate::status::{Status, StatusEntry};
-use crate::{Index, TreeDiff, WorkTree};
+use crate::{Index, IndexFile, Pathspec, TreeDiff, UntrackedFiles, WorkTree};
 use git2::{Repository, RepositoryState};
 use indoc::formatdoc;
 use std::fmt;
@@ -46,10 +47,21 @@ impl StatusColorSlot {
     }
 }
 
+/// What a status looks at, the defaults are those of `git status` without any arguments.
+#[derive(Debug, Default, Clone)]
+pub struct StatusOptions {
+    /// Which untracked files to show, `None` for those of `status.showUntrackedFiles`.
+    pub untracked_files: Option<UntrackedFiles>,
+    /// The pathspecs to limit the status to, relative to the path the status is of.  Everything
+    /// is shown when there are none.
+    pub pathspecs: Vec<String>,
+}
+
 pub struct RepoStatus {
     repo: Repository,
     index_diff: TreeDiff,
     work_tree_diff: WorkTree,
+    untracked_files: UntrackedFiles,
 }
 
 impl Debug for RepoStatus {
@@ -70,6 +82,14 @@ impl RepoStatus {
     /// * `path` - The path to a git repo.  This logic will search up parent directories for
     ///     a git repo
     pub fn new(path: &Path) -> Result<RepoStatus, StatusError> {
+        RepoStatus::new_with_options(path, &StatusOptions::default())
+    }
+
+    /// Like `new()`, with the `options` rather than git's defaults.
+    pub fn new_with_options(
+        path: &Path,
+        options: &StatusOptions,
+    ) -> Result<RepoStatus, StatusError> {
         let repo: Repository;
         let discovery = Repository::discover(path);
         match discovery {
@@ -88,16 +108,60 @@ impl RepoStatus {
         };
         let repo_path = repo.path();
         let index_file = repo_path.join("index");
-        let index = Index::new(&*index_file)?;
+        let cache_index = repo.config()?.get_bool("winGitStatus.indexCache");
+        let index_file = match cache_index {
+            Ok(true) => {
+                let cache_file = repo_path.join("win-git-status/index.cache");
+                IndexFile::open_cached(&index_file, &cache_file)?
+            }
+            _ => IndexFile::open(&index_file)?,
+        };
+        let index = Index::new(&index_file)?;
         let workdir = repo.workdir().unwrap();
+        let untracked_files = options
+            .untracked_files
+            .unwrap_or_else(|| UntrackedFiles::load(workdir));
+        let pathspec = match options.pathspecs.is_empty() {
+            true => None,
+            false => Some(Pathspec::new(
+                &work_tree_prefix(path, workdir),
+                &options.pathspecs,
+            )?),
+        };
+        let pathspec = pathspec.as_ref();
         let (work_tree_diff, index_diff) = rayon::join(
-            || WorkTree::diff_against_index(workdir, index).unwrap(),
-            || TreeDiff::diff_against_index(&path),
+            || {
+                WorkTree::diff_against_index_with_pathspec(
+                    workdir,
+                    &index,
+                    untracked_files,
+                    pathspec,
+                )
+                .unwrap()
+            },
+            || {
+                let repo = Repository::open(workdir).unwrap();
+                TreeDiff::diff_against_index_with_pathspec(&repo, &index, pathspec)
+            },
         );
+
+        // Like git, the stat data of files found to be unchanged is written back to the index,
+        // on a best effort basis, so they don't need to be hashed again next time
+        let refresh = match optional_locks() {
+            true => IndexRefresh::new(&index_file, &index, &work_tree_diff.refreshed),
+            false => Ok(None),
+        };
+        // A mapped index can't be replaced on Windows
+        drop(index);
+        drop(index_file);
+        if let Ok(Some(refresh)) = refresh {
+            let _ = refresh.write();
+        }
         Ok(RepoStatus {
             repo,
             index_diff,
             work_tree_diff,
+            untracked_files,
         })
     }
 
@@ -122,7 +186,8 @@ impl RepoStatus {
         let staged = self.write_staged_message(writer);
         let unstaged = self.write_unstaged_message(writer);
         let untracked = self.write_untracked_message(writer);
-        RepoStatus::write_epilog(writer, staged, unstaged, untracked);
+        let listed = self.untracked_files != UntrackedFiles::No;
+        RepoStatus::write_epilog(writer, staged, unstaged, untracked, listed);
         Ok(())
     }
 
@@ -365,8 +430,16 @@ impl RepoStatus {
         staged: bool,
         unstaged: bool,
         untracked: bool,
+        untracked_listed: bool,
     ) {
         if staged {
+            if !untracked_listed {
+                writer
+                    .write_all(
+                        b"Untracked files not listed (use -u option to show untracked files)\n",
+                    )
+                    .unwrap();
+            }
             return;
         }
         if unstaged {
@@ -381,6 +454,12 @@ impl RepoStatus {
             writer.write_all(b"nothing added to commit but untracked files present (use \"git add\" to track)\n").unwrap();
             return;
         }
+        if !untracked_listed {
+            writer
+                .write_all(b"nothing to commit (use -u to show untracked files)\n")
+                .unwrap();
+            return;
+        }
         writer
             .write_all(b"nothing to commit, working tree clean\n")
             .unwrap();
@@ -477,6 +556,19 @@ impl RepoStatus {
     }
 }
 
+// The work tree relative directory of `path`, "" when it's the root of the `work_tree` or
+// outside of it
+fn work_tree_prefix(path: &Path, work_tree: &Path) -> String {
+    let (path, work_tree) = match (path.canonicalize(), work_tree.canonicalize()) {
+        (Ok(path), Ok(work_tree)) => (path, work_tree),
+        _ => return String::new(),
+    };
+    let prefix = path
+        .strip_prefix(work_tree)
+        .unwrap_or_else(|_| Path::new(""));
+    prefix.to_str().unwrap().replace("\\", "/")
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -1076,6 +1168,33 @@ mod tests {
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
     }
 
+    #[test]
+    fn test_pathspec_relative_to_subdirectory() {
+        let file_names = vec!["one", "sub/two", "sub/three", "other/four"];
+        let files = file_names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        let repo = test_repo(temp_dir.to_str().unwrap(), &files);
+
+        write_to_file(&repo, Path::new("one"), "changed");
+        write_to_file(&repo, Path::new("sub/two"), "changed");
+        write_to_file(&repo, Path::new("other/four"), "changed");
+        write_to_file(&repo, Path::new("sub/new_file"), "stuff");
+
+        let options = StatusOptions {
+            pathspecs: vec![String::from("t*"), String::from("../other")],
+            ..Default::default()
+        };
+        let sub = repo.workdir().unwrap().join("sub");
+        let status = RepoStatus::new_with_options(&sub, &options).unwrap();
+        let names: Vec<&str> = status
+            .work_tree_diff
+            .entries
+            .iter()
+            .map(|e| e.name.as_str())
+            .collect();
+        assert_eq!(names, ["other/four", "sub/two"]);
+    }
+
     #[test]
     fn test_untracked_file_and_directory() {
         let file_names = vec!["one", "two", "three", "four"];
@@ -1109,7 +1228,7 @@ mod tests {
     fn test_no_change_epilog() {
         let expected = "nothing to commit, working tree clean\n".to_string();
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, false, false, false);
+        RepoStatus::write_epilog(&mut writer, false, false, false, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
     }
 
@@ -1118,14 +1237,14 @@ mod tests {
         let expected =
             "no changes added to commit (use \"git add\" and/or \"git commit -a\")\n".to_string();
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, false, true, false);
+        RepoStatus::write_epilog(&mut writer, false, true, false, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
     }
 
     #[test]
     fn test_staged_epilog() {
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, true, false, false);
+        RepoStatus::write_epilog(&mut writer, true, false, false, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), "");
     }
 
@@ -1136,7 +1255,7 @@ mod tests {
                 .to_string();
 
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, false, false, true);
+        RepoStatus::write_epilog(&mut writer, false, false, true, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
     }
 
@@ -1145,17 +1264,30 @@ mod tests {
         let expected =
             "no changes added to commit (use \"git add\" and/or \"git commit -a\")\n".to_string();
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, false, true, true);
+        RepoStatus::write_epilog(&mut writer, false, true, true, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
     }
 
     #[test]
     fn test_staged_overrides_unstaged_epilog() {
         let mut writer = Buffer::no_color();
-        RepoStatus::write_epilog(&mut writer, true, true, false);
+        RepoStatus::write_epilog(&mut writer, true, true, false, true);
         assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), "");
     }
 
+    #[test]
+    fn test_untracked_not_listed_epilog() {
+        let mut writer = Buffer::no_color();
+        RepoStatus::write_epilog(&mut writer, false, false, false, false);
+        let expected = "nothing to commit (use -u to show untracked files)\n";
+        assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
+
+        let mut writer = Buffer::no_color();
+        RepoStatus::write_epilog(&mut writer, true, false, false, false);
+        let expected = "Untracked files not listed (use -u option to show untracked files)\n";
+        assert_eq!(String::from_utf8(writer.into_inner()).unwrap(), expected);
+    }
+
     #[test]
     fn test_default_untracked_color() {
         let file_names = vec!["one", "two", "three", "four"];
@@ -0,0 +1,339 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// The size of the blocks SHA-1 works on
+const BLOCK_SIZE: usize = 64;
+
+/// A SHA-1 hash, fed in pieces with `update()`.
+///
+/// Git uses SHA-1 for object ids as well as the checksum at the end of an index file.  The
+/// algorithm is described in https://datatracker.ietf.org/doc/html/rfc3174.  The SHA extensions
+/// of x86_64 and ARMv8 CPUs are used when the CPU has them, see `is_accelerated()`.
+#[derive(Debug, Clone)]
+pub struct Sha1 {
+    state: [u32; 5],
+    // The start of a block which hasn't been filled yet
+    buffer: [u8; BLOCK_SIZE],
+    buffered: usize,
+    // The number of bytes hashed so far
+    length: u64,
+}
+
+impl Default for Sha1 {
+    fn default() -> Self {
+        Sha1 {
+            state: [0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0],
+            buffer: [0; BLOCK_SIZE],
+            buffered: 0,
+            length: 0,
+        }
+    }
+}
+
+impl Sha1 {
+    /// The SHA-1 of `data`.
+    pub fn digest(data: &[u8]) -> [u8; 20] {
+        let mut sha = Sha1::default();
+        sha.update(data);
+        sha.finish()
+    }
+
+    /// Adds `data` to the hash.
+    pub fn update(&mut self, data: &[u8]) {
+        self.length += data.len() as u64;
+        let mut data = data;
+        if self.buffered > 0 {
+            let count = data.len().min(BLOCK_SIZE - self.buffered);
+            self.buffer[self.buffered..self.buffered + count].copy_from_slice(&data[..count]);
+            self.buffered += count;
+            data = &data[count..];
+            if self.buffered < BLOCK_SIZE {
+                return;
+            }
+            let block = self.buffer;
+            compress(&mut self.state, &block);
+            self.buffered = 0;
+        }
+        let whole = data.len() - data.len() % BLOCK_SIZE;
+        compress(&mut self.state, &data[..whole]);
+        let remainder = &data[whole..];
+        self.buffer[..remainder.len()].copy_from_slice(remainder);
+        self.buffered = remainder.len();
+    }
+
+    /// The hash of everything added.
+    pub fn finish(mut self) -> [u8; 20] {
+        // A 1 bit, zeros up to 8 bytes short of a block, then the length in bits
+        let bits = self.length.wrapping_mul(8);
+        let padding = match self.buffered < BLOCK_SIZE - 8 {
+            true => BLOCK_SIZE - 8 - self.buffered,
+            false => 2 * BLOCK_SIZE - 8 - self.buffered,
+        };
+        let mut trailer = [0u8; 2 * BLOCK_SIZE];
+        trailer[0] = 0x80;
+        trailer[padding..padding + 8].copy_from_slice(&bits.to_be_bytes());
+        let length = self.length;
+        self.update(&trailer[..padding + 8]);
+        self.length = length;
+
+        let mut digest = [0; 20];
+        for (bytes, word) in digest.chunks_exact_mut(4).zip(&self.state) {
+            bytes.copy_from_slice(&word.to_be_bytes());
+        }
+        digest
+    }
+}
+
+/// Whether the CPU's SHA instructions are used.
+pub fn is_accelerated() -> bool {
+    #[cfg(target_arch = "x86_64")]
+    {
+        is_x86_feature_detected!("sha")
+            && is_x86_feature_detected!("sse2")
+            && is_x86_feature_detected!("ssse3")
+            && is_x86_feature_detected!("sse4.1")
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        std::arch::is_aarch64_feature_detected!("sha2")
+    }
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    {
+        false
+    }
+}
+
+// Mixes `blocks`, a multiple of 64 bytes, into `state`.  The CPU features are detected once per
+// call, so callers should pass as many blocks at a time as they can.
+fn compress(state: &mut [u32; 5], blocks: &[u8]) {
+    if blocks.is_empty() {
+        return;
+    }
+    if is_accelerated() {
+        // Safe as the features the instructions need were just detected
+        #[cfg(target_arch = "x86_64")]
+        unsafe {
+            return x86::compress(state, blocks);
+        }
+        #[cfg(target_arch = "aarch64")]
+        unsafe {
+            return aarch64::compress(state, blocks);
+        }
+    }
+    for block in blocks.chunks_exact(BLOCK_SIZE) {
+        compress_portable(state, block);
+    }
+}
+
+// Mixes one 64 byte block into `state`
+fn compress_portable(state: &mut [u32; 5], block: &[u8]) {
+    let mut words = [0u32; 80];
+    for (word, bytes) in words.iter_mut().zip(block.chunks_exact(4)) {
+        *word = u32::from_be_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]);
+    }
+    for i in 16..80 {
+        words[i] = (words[i - 3] ^ words[i - 8] ^ words[i - 14] ^ words[i - 16]).rotate_left(1);
+    }
+
+    let [mut a, mut b, mut c, mut d, mut e] = *state;
+    for (i, word) in words.iter().enumerate() {
+        let (f, k) = match i {
+            0..=19 => ((b & c) | (!b & d), 0x5A827999),
+            20..=39 => (b ^ c ^ d, 0x6ED9EBA1),
+            40..=59 => ((b & c) | (b & d) | (c & d), 0x8F1BBCDC),
+            _ => (b ^ c ^ d, 0xCA62C1D6),
+        };
+        let temp = a
+            .rotate_left(5)
+            .wrapping_add(f)
+            .wrapping_add(e)
+            .wrapping_add(k)
+            .wrapping_add(*word);
+        e = d;
+        d = c;
+        c = b.rotate_left(30);
+        b = a;
+        a = temp;
+    }
+    for (value, new) in state.iter_mut().zip(&[a, b, c, d, e]) {
+        *value = value.wrapping_add(*new);
+    }
+}
+
+// The Intel SHA extensions, each instruction does 4 rounds or 4 words of the message schedule.
+// The words of a block are worked on in groups of 4, a, b, c, and d are kept in one vector with a
+// in the highest lane.  The instructions derive e from what a was 4 rounds earlier.
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use super::BLOCK_SIZE;
+    use std::arch::x86_64::*;
+
+    #[target_feature(enable = "sha,sse2,ssse3,sse4.1")]
+    pub unsafe fn compress(state: &mut [u32; 5], blocks: &[u8]) {
+        // Reverses the bytes of the vector, the message words are big endian
+        let mask = _mm_set_epi64x(0x0001_0203_0405_0607, 0x0809_0a0b_0c0d_0e0f);
+        let mut abcd = _mm_set_epi32(
+            state[0] as i32,
+            state[1] as i32,
+            state[2] as i32,
+            state[3] as i32,
+        );
+        let mut e = _mm_set_epi32(state[4] as i32, 0, 0, 0);
+
+        for block in blocks.chunks_exact(BLOCK_SIZE) {
+            let block = block.as_ptr() as *const __m128i;
+            let mut words = [_mm_setzero_si128(); 4];
+            for (i, word) in words.iter_mut().enumerate() {
+                *word = _mm_shuffle_epi8(_mm_loadu_si128(block.add(i)), mask);
+            }
+            let abcd_start = abcd;
+            let e_start = e;
+
+            // What abcd was before the previous 4 rounds
+            let mut previous = abcd;
+            let mut e_words = _mm_add_epi32(e, words[0]);
+            abcd = _mm_sha1rnds4_epu32::<0>(abcd, e_words);
+            for group in 1..20 {
+                if group >= 4 {
+                    words[group % 4] = _mm_sha1msg2_epu32(
+                        _mm_xor_si128(
+                            _mm_sha1msg1_epu32(words[group % 4], words[(group + 1) % 4]),
+                            words[(group + 2) % 4],
+                        ),
+                        words[(group + 3) % 4],
+                    );
+                }
+                e_words = _mm_sha1nexte_epu32(previous, words[group % 4]);
+                previous = abcd;
+                abcd = match group / 5 {
+                    0 => _mm_sha1rnds4_epu32::<0>(abcd, e_words),
+                    1 => _mm_sha1rnds4_epu32::<1>(abcd, e_words),
+                    2 => _mm_sha1rnds4_epu32::<2>(abcd, e_words),
+                    _ => _mm_sha1rnds4_epu32::<3>(abcd, e_words),
+                };
+            }
+            e = _mm_sha1nexte_epu32(previous, e_start);
+            abcd = _mm_add_epi32(abcd, abcd_start);
+        }
+
+        state[0] = _mm_extract_epi32::<3>(abcd) as u32;
+        state[1] = _mm_extract_epi32::<2>(abcd) as u32;
+        state[2] = _mm_extract_epi32::<1>(abcd) as u32;
+        state[3] = _mm_extract_epi32::<0>(abcd) as u32;
+        state[4] = _mm_extract_epi32::<3>(e) as u32;
+    }
+}
+
+// The ARMv8 cryptographic extensions, like on x86_64 the instructions work on 4 rounds or 4 words
+// at a time.  Here a is in the lowest lane and e is kept on its own.
+#[cfg(target_arch = "aarch64")]
+mod aarch64 {
+    use super::BLOCK_SIZE;
+    use std::arch::aarch64::*;
+
+    const K: [u32; 4] = [0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6];
+
+    #[target_feature(enable = "sha2")]
+    pub unsafe fn compress(state: &mut [u32; 5], blocks: &[u8]) {
+        let mut abcd = vld1q_u32(state.as_ptr());
+        let mut e = state[4];
+
+        for block in blocks.chunks_exact(BLOCK_SIZE) {
+            let mut words = [vdupq_n_u32(0); 4];
+            for (i, word) in words.iter_mut().enumerate() {
+                let bytes = vrev32q_u8(vld1q_u8(block.as_ptr().add(i * 16)));
+                *word = vreinterpretq_u32_u8(bytes);
+            }
+            let abcd_start = abcd;
+            let e_start = e;
+
+            for group in 0..20 {
+                if group >= 4 {
+                    words[group % 4] = vsha1su1q_u32(
+                        vsha1su0q_u32(
+                            words[group % 4],
+                            words[(group + 1) % 4],
+                            words[(group + 2) % 4],
+                        ),
+                        words[(group + 3) % 4],
+                    );
+                }
+                let words_k = vaddq_u32(words[group % 4], vdupq_n_u32(K[group / 5]));
+                let next_e = vsha1h_u32(vgetq_lane_u32::<0>(abcd));
+                abcd = match group / 5 {
+                    0 => vsha1cq_u32(abcd, e, words_k),
+                    2 => vsha1mq_u32(abcd, e, words_k),
+                    _ => vsha1pq_u32(abcd, e, words_k),
+                };
+                e = next_e;
+            }
+            abcd = vaddq_u32(abcd, abcd_start);
+            e = e.wrapping_add(e_start);
+        }
+
+        vst1q_u32(state.as_mut_ptr(), abcd);
+        state[4] = e;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hex(digest: [u8; 20]) -> String {
+        digest.iter().map(|b| format!("{:02x}", b)).collect()
+    }
+
+    #[test]
+    fn test_digest_of_known_values() {
+        let known = vec![
+            (&b""[..], "da39a3ee5e6b4b0d3255bfef95601890afd80709"),
+            (&b"abc"[..], "a9993e364706816aba3e25717850c26c9cd0d89d"),
+            (
+                &b"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"[..],
+                "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+            ),
+        ];
+        for (data, digest) in known {
+            assert_eq!(hex(Sha1::digest(data)), digest);
+        }
+    }
+
+    #[test]
+    fn test_update_in_pieces() {
+        let data: Vec<u8> = (0..1000u32).map(|i| (i * 7) as u8).collect();
+        let whole = Sha1::digest(&data);
+        for piece in &[1, 3, 63, 64, 65, 200] {
+            let mut sha = Sha1::default();
+            for chunk in data.chunks(*piece) {
+                sha.update(chunk);
+            }
+            assert_eq!(sha.finish(), whole, "{}", piece);
+        }
+    }
+
+    #[test]
+    fn test_accelerated_matches_portable() {
+        let data: Vec<u8> = (0..64 * 37u32).map(|i| (i * 31 + i / 7) as u8).collect();
+        let mut portable = [1, 2, 3, 4, 5];
+        for block in data.chunks_exact(BLOCK_SIZE) {
+            compress_portable(&mut portable, block);
+        }
+        let mut state = [1, 2, 3, 4, 5];
+        compress(&mut state, &data);
+        assert_eq!(state, portable);
+    }
+
+    #[test]
+    fn test_million_a() {
+        let data = vec![b'a'; 1_000_000];
+        assert_eq!(
+            hex(Sha1::digest(&data)),
+            "34aa973cd4c4daa4f61eeb2bdbad27316534016f"
+        );
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+use crate::Index;
+use git2::Repository;
+use std::collections::HashSet;
+use std::fs;
+use std::path::Path;
+
+/// The directories of a cone mode sparse checkout.
+///
+/// Cone mode only allows patterns which include whole directories, `$GIT_DIR/info/sparse-checkout`
+/// looks like:
+///
+/// ```text
+/// /*
+/// !/*/
+/// /parent/
+/// !/parent/*/
+/// /parent/recursive/
+/// ```
+///
+/// The files directly in the root and in every parent directory are in the checkout, as is
+/// everything under a recursive directory.  Any other directory is outside of the checkout and
+/// doesn't need to be looked at.
+///
+/// The format is described in https://git-scm.com/docs/git-sparse-checkout#_internalscone_pattern_set.
+#[derive(Debug, Default)]
+pub struct SparseCheckout {
+    // Directories whose files are in the checkout, but not necessarily their subdirectories
+    parents: HashSet<String>,
+    // Directories which are in the checkout along with everything under them
+    recursive: HashSet<String>,
+}
+
+impl SparseCheckout {
+    /// Loads the cone mode sparse checkout of the repo at `path`.
+    ///
+    /// `None` is returned when sparse checkout isn't enabled, or it isn't in cone mode.  Without
+    /// the cone only the skip-worktree bits of the index entries tell what's outside of the
+    /// checkout.
+    ///
+    /// # Arguments
+    ///
+    /// * `path` - The path to the work tree of the repo.
+    /// * `index` - The index of the repo, the sparse checkout file is next to it.
+    pub fn load(path: &Path, index: &Index) -> Option<SparseCheckout> {
+        let repo = Repository::open(path).ok()?;
+        let config = repo.config().ok()?;
+        let enabled = |name| config.get_bool(name).unwrap_or(false);
+        if !enabled("core.sparseCheckout") || !enabled("core.sparseCheckoutCone") {
+            return None;
+        }
+        let git_dir = index.path().parent()?;
+        let patterns = fs::read_to_string(git_dir.join("info/sparse-checkout")).ok()?;
+        SparseCheckout::from_patterns(&patterns)
+    }
+
+    // Builds the directories from the cone `patterns`, `None` when a pattern isn't one of the
+    // cone forms.
+    fn from_patterns(patterns: &str) -> Option<SparseCheckout> {
+        let mut sparse = SparseCheckout::default();
+        let patterns = patterns
+            .lines()
+            .map(|p| p.trim_end())
+            .filter(|p| !p.is_empty() && !p.starts_with('#'));
+        for pattern in patterns {
+            match pattern {
+                "/*" | "!/*/" => {}
+                _ => match pattern.strip_prefix("!/") {
+                    // A parent directory, excluding its subdirectories
+                    Some(parent) => {
+                        let directory = unescape(parent.strip_suffix("/*/")?);
+                        sparse.recursive.remove(&directory);
+                        sparse.parents.insert(directory);
+                    }
+                    None => {
+                        let directory = pattern.strip_prefix('/')?.strip_suffix('/')?;
+                        sparse.recursive.insert(unescape(directory));
+                    }
+                },
+            }
+        }
+        Some(sparse)
+    }
+
+    /// Whether any of the files directly in `directory` are in the sparse checkout.
+    ///
+    /// # Arguments
+    ///
+    /// * `directory` - The path relative to the root of the work tree, using "/" as the
+    ///   separator.  The root is an empty string.
+    pub fn includes_directory(&self, directory: &str) -> bool {
+        if directory.is_empty() || self.parents.contains(directory) {
+            return true;
+        }
+        let mut ancestor = directory;
+        loop {
+            if self.recursive.contains(ancestor) {
+                return true;
+            }
+            match ancestor.rfind('/') {
+                Some(end) => ancestor = &ancestor[..end],
+                None => return false,
+            }
+        }
+    }
+}
+
+// Removes the backslashes git uses to escape the glob characters in directory names
+fn unescape(directory: &str) -> String {
+    let mut unescaped = String::with_capacity(directory.len());
+    let mut characters = directory.chars();
+    while let Some(c) = characters.next() {
+        match c {
+            '\\' => unescaped.extend(characters.next()),
+            _ => unescaped.push(c),
+        }
+    }
+    unescaped
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_cone_patterns() {
+        let patterns = "/*\n!/*/\n/a/\n!/a/*/\n/a/b/\n/c/\n";
+        let sparse = SparseCheckout::from_patterns(patterns).unwrap();
+        for directory in &["", "a", "a/b", "a/b/deeper", "c", "c/d"] {
+            assert!(sparse.includes_directory(directory), "{}", directory);
+        }
+        for directory in &["a/other", "ab", "d", "d/c"] {
+            assert!(!sparse.includes_directory(directory), "{}", directory);
+        }
+    }
+
+    #[test]
+    fn test_escaped_cone_pattern() {
+        let sparse = SparseCheckout::from_patterns("/*\n!/*/\n/a\\*b/\n").unwrap();
+        assert!(sparse.includes_directory("a*b"));
+        assert!(!sparse.includes_directory("axb"));
+    }
+
+    #[test]
+    fn test_non_cone_patterns() {
+        assert!(SparseCheckout::from_patterns("/*\n!/*/\n*.txt\n").is_none());
+    }
+
+    #[test]
+    fn test_only_root_files() {
+        let sparse = SparseCheckout::from_patterns("/*\n!/*/\n").unwrap();
+        assert!(sparse.includes_directory(""));
+        assert!(!sparse.includes_directory("a"));
+    }
+}
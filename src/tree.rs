@@ -5,8 +5,14 @@
  *          https://www.boost.org/LICENSE_1_0.txt)
  */
 
+use crate::direntry::{DirEntry, ObjectType as EntryType};
+use crate::index::CacheTree;
+use crate::pathspec::Pathspec;
 use crate::status::{Status, StatusEntry};
-use git2::{Repository, StatusOptions, StatusShow, Statuses};
+use crate::Index;
+use core::cmp::Ordering;
+use git2::{ObjectType, Oid, Repository, Tree, TreeEntry};
+use std::collections::{BTreeMap, HashMap};
 use std::path::Path;
 
 /// A tree of a repo.
@@ -16,47 +22,276 @@ pub struct TreeDiff {
     pub entries: Vec<StatusEntry>,
 }
 
+// The state of a diff of the index against a tree
+struct IndexTreeDiff<'r, 'a> {
+    repo: &'r Repository,
+    index: &'r Index<'a>,
+    entries: Vec<StatusEntry>,
+}
+
 impl TreeDiff {
-    pub fn diff_against_index(path: &Path) -> TreeDiff {
+    /// Compares the index to the HEAD commit of the repo at `path`.
+    pub fn diff_against_index(path: &Path, index: &Index) -> TreeDiff {
         let repo = Repository::open(path).unwrap();
-        TreeDiff::diff_against_index_with_repo(&repo)
+        TreeDiff::diff_against_index_with_repo(&repo, index)
+    }
+
+    /// Compares the index to the HEAD commit of `repo`.
+    ///
+    /// The directories are walked from the root, a directory whose cache tree entry is still
+    /// valid and matches the HEAD tree is skipped along with everything under it.  This means only
+    /// the directories leading to staged changes are compared.
+    pub fn diff_against_index_with_repo(repo: &Repository, index: &Index) -> TreeDiff {
+        TreeDiff::diff_against_index_with_pathspec(repo, index, None)
     }
 
-    pub fn diff_against_index_with_repo(repo: &Repository) -> TreeDiff {
-        let mut options = StatusOptions::new();
-        options.show(StatusShow::Index);
-        let diff = repo.statuses(Option::from(&mut options)).unwrap();
-        TreeDiff::convert_git2_to_treediff(&diff)
+    /// Compares the index to the HEAD commit of `repo` like `diff_against_index_with_repo()`,
+    /// limited to the `pathspec`.  Only the directories with something the pathspec could match
+    /// are compared.
+    pub fn diff_against_index_with_pathspec(
+        repo: &Repository,
+        index: &Index,
+        pathspec: Option<&Pathspec>,
+    ) -> TreeDiff {
+        let head_tree = repo.head().and_then(|head| head.peel_to_tree()).ok();
+        let mut diff = IndexTreeDiff {
+            repo,
+            index,
+            entries: vec![],
+        };
+        diff.diff_directory("", head_tree.as_ref(), index.cache_tree(), pathspec);
+        let mut entries = diff.entries;
+        entries.sort_by(|a, b| a.name.cmp(&b.name));
+        TreeDiff { entries }
     }
+}
 
-    fn convert_git2_to_treediff(statuses: &Statuses) -> TreeDiff {
-        let mut entries = vec![];
-        for status in statuses.iter() {
-            let state = TreeDiff::git2_status_to_treediff_status(status.status());
-            entries.push(StatusEntry {
-                name: status.path().unwrap().to_string(),
+impl<'r, 'a> IndexTreeDiff<'r, 'a> {
+    // Compares the directory `path`, only the entries `pathspec` matches when there is one
+    fn diff_directory(
+        &mut self,
+        path: &str,
+        tree: Option<&Tree>,
+        cache: Option<&CacheTree>,
+        pathspec: Option<&Pathspec>,
+    ) {
+        if let (Some(tree), Some(oid)) = (tree, cache.and_then(|c| c.oid)) {
+            if tree.id().as_bytes() == oid {
+                return;
+            }
+        }
+
+        let mut tree_files = vec![];
+        let mut subdirectories = BTreeMap::new();
+        for entry in tree.iter().flat_map(|t| t.iter()) {
+            if entry.kind() == Some(ObjectType::Tree) {
+                subdirectories.insert(entry.name().unwrap().to_string(), Some(entry.id()));
+            } else {
+                tree_files.push(entry);
+            }
+        }
+        tree_files.sort_by(|a, b| a.name_bytes().cmp(b.name_bytes()));
+
+        let index_files = self.index.entries.get(path).unwrap_or_default();
+        self.diff_files(path, &tree_files, index_files, pathspec);
+
+        for name in self.index.entries.subdirectories(path) {
+            subdirectories.entry(name.to_string()).or_insert(None);
+        }
+        // The directories a sparse index keeps as a single tree entry
+        let sparse_directories = index_files
+            .iter()
+            .filter(|e| e.object_type == EntryType::SparseDirectory);
+        for sparse_directory in sparse_directories {
+            let oid = subdirectories.remove(sparse_directory.name).flatten();
+            if oid.map(|o| o.as_bytes() == sparse_directory.sha) == Some(true) {
+                continue;
+            }
+            let sub_path = join_path(path, sparse_directory.name);
+            let sub_pathspec = match subdirectory_pathspec(pathspec, &sub_path) {
+                Some(sub_pathspec) => sub_pathspec,
+                None => continue,
+            };
+            let head_tree = oid.map(|oid| self.repo.find_tree(oid).unwrap());
+            let index_oid = Oid::from_bytes(&sparse_directory.sha).unwrap();
+            let index_tree = self.repo.find_tree(index_oid).ok();
+            self.diff_trees(
+                &sub_path,
+                head_tree.as_ref(),
+                index_tree.as_ref(),
+                sub_pathspec,
+            );
+        }
+        let cache_subtrees: HashMap<&str, &CacheTree> = cache
+            .iter()
+            .flat_map(|c| c.subtrees.iter())
+            .map(|c| (c.name, c))
+            .collect();
+        for (name, oid) in subdirectories {
+            let sub_path = join_path(path, &name);
+            let sub_pathspec = match subdirectory_pathspec(pathspec, &sub_path) {
+                Some(sub_pathspec) => sub_pathspec,
+                None => continue,
+            };
+            let subtree = oid.map(|oid| self.repo.find_tree(oid).unwrap());
+            let sub_cache = cache_subtrees.get(name.as_str()).copied();
+            self.diff_directory(&sub_path, subtree.as_ref(), sub_cache, sub_pathspec);
+        }
+    }
+
+    // Merge the sorted files of a tree directory with the sorted index entries of the directory
+    fn diff_files(
+        &mut self,
+        path: &str,
+        tree_files: &[TreeEntry],
+        index_files: &[DirEntry],
+        pathspec: Option<&Pathspec>,
+    ) {
+        let mut tree_iter = tree_files.iter().peekable();
+        let mut index_iter = index_files.iter().peekable();
+        let mut previous_name = None;
+        loop {
+            // Unmerged files have an entry for each stage, only the first is compared.  Sparse
+            // directories are compared as directories.
+            if let Some(i_file) = index_iter.peek() {
+                if previous_name == Some(i_file.name)
+                    || i_file.object_type == EntryType::SparseDirectory
+                {
+                    index_iter.next();
+                    continue;
+                }
+            }
+            let order = match (tree_iter.peek(), index_iter.peek()) {
+                (None, None) => break,
+                (Some(_), None) => Ordering::Less,
+                (None, Some(_)) => Ordering::Greater,
+                (Some(t_file), Some(i_file)) => t_file.name_bytes().cmp(i_file.name.as_bytes()),
+            };
+            let (name, state) = match order {
+                Ordering::Equal => {
+                    let t_file = tree_iter.next().unwrap();
+                    let i_file = index_iter.next().unwrap();
+                    previous_name = Some(i_file.name);
+                    if t_file.id().as_bytes() == i_file.sha
+                        && t_file.filemode() == i32::from(i_file.mode)
+                    {
+                        continue;
+                    }
+                    (i_file.name, Status::Modified(None))
+                }
+                Ordering::Less => {
+                    let t_file = tree_iter.next().unwrap();
+                    (t_file.name().unwrap(), Status::Deleted)
+                }
+                Ordering::Greater => {
+                    let i_file = index_iter.next().unwrap();
+                    previous_name = Some(i_file.name);
+                    (i_file.name, Status::New)
+                }
+            };
+            let name = join_path(path, name);
+            if pathspec.is_some_and(|p| !p.matches(&name)) {
+                continue;
+            }
+            self.entries.push(StatusEntry { name, state });
+        }
+    }
+
+    // Compares the tree of a sparse directory in the index, `index`, to the tree in HEAD.
+    fn diff_trees(
+        &mut self,
+        path: &str,
+        head: Option<&Tree>,
+        index: Option<&Tree>,
+        pathspec: Option<&Pathspec>,
+    ) {
+        if let (Some(head), Some(index)) = (head, index) {
+            if head.id() == index.id() {
+                return;
+            }
+        }
+        // Keyed by the name and whether it's a tree, with the HEAD and index entries
+        let mut entries = BTreeMap::new();
+        for entry in head.iter().flat_map(|t| t.iter()) {
+            let key = (
+                entry.name().unwrap().to_string(),
+                entry.kind() == Some(ObjectType::Tree),
+            );
+            entries.entry(key).or_insert((None, None)).0 = Some(entry);
+        }
+        for entry in index.iter().flat_map(|t| t.iter()) {
+            let key = (
+                entry.name().unwrap().to_string(),
+                entry.kind() == Some(ObjectType::Tree),
+            );
+            entries.entry(key).or_insert((None, None)).1 = Some(entry);
+        }
+        for ((name, is_tree), (head_entry, index_entry)) in entries {
+            let sub_path = join_path(path, &name);
+            if is_tree {
+                let sub_pathspec = match subdirectory_pathspec(pathspec, &sub_path) {
+                    Some(sub_pathspec) => sub_pathspec,
+                    None => continue,
+                };
+                let find_tree = |e: TreeEntry| self.repo.find_tree(e.id()).unwrap();
+                let head_tree = head_entry.map(find_tree);
+                let index_tree = index_entry.map(find_tree);
+                let (head_tree, index_tree) = (head_tree.as_ref(), index_tree.as_ref());
+                self.diff_trees(&sub_path, head_tree, index_tree, sub_pathspec);
+                continue;
+            }
+            if pathspec.is_some_and(|p| !p.matches(&sub_path)) {
+                continue;
+            }
+            let state = match (head_entry, index_entry) {
+                (Some(h), Some(i)) if h.id() == i.id() && h.filemode() == i.filemode() => continue,
+                (Some(_), Some(_)) => Status::Modified(None),
+                (Some(_), None) => Status::Deleted,
+                _ => Status::New,
+            };
+            self.entries.push(StatusEntry {
+                name: sub_path,
                 state,
             });
         }
-        TreeDiff { entries }
     }
-    fn git2_status_to_treediff_status(status: git2::Status) -> Status {
-        match status {
-            git2::Status::INDEX_NEW => Status::New,
-            git2::Status::INDEX_MODIFIED => Status::Modified(None),
-            git2::Status::INDEX_DELETED => Status::Deleted,
-            _ => panic!("Unsupported index status {:?}", status),
-        }
+}
+
+// The pathspec to compare the subdirectory `path` with, given the `pathspec` of its directory.
+// `None` when nothing under the subdirectory could match, `Some(None)` when all of it does.
+fn subdirectory_pathspec<'p>(
+    pathspec: Option<&'p Pathspec>,
+    path: &str,
+) -> Option<Option<&'p Pathspec>> {
+    match pathspec {
+        Some(pathspec) if pathspec.matches(path) => Some(None),
+        Some(pathspec) if !pathspec.may_match_under(path) => None,
+        pathspec => Some(pathspec),
+    }
+}
+
+pub(crate) fn join_path(directory: &str, name: &str) -> String {
+    match directory {
+        "" => name.to_string(),
+        _ => format!("{}/{}", directory, name),
     }
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::IndexFile;
     use git2::{Signature, Time};
     use std::fs;
     use temp_testdir::TempDir;
 
+    // Diff the on disk index of the repo at `path` against HEAD
+    fn diff_against_index(path: &Path) -> TreeDiff {
+        let index_file = IndexFile::open(&path.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        TreeDiff::diff_against_index(path, &index)
+    }
+
     // stage a file change so that the index version of a file differs from a tree version.
     pub fn stage_file(repo_path: &str, file: &Path) -> () {
         let repo = Repository::open(repo_path).unwrap();
@@ -102,7 +337,7 @@ mod tests {
     fn test_get_tree_diff_empty_repo() {
         let temp_dir = TempDir::default();
         test_repo(temp_dir.to_str().unwrap(), &vec![]);
-        assert_eq!(TreeDiff::diff_against_index(&temp_dir), TreeDiff::default());
+        assert_eq!(diff_against_index(&temp_dir), TreeDiff::default());
     }
 
     #[test]
@@ -114,7 +349,7 @@ mod tests {
         test_repo(repo_path, &files);
 
         stage_file(repo_path, files[0]);
-        let diff = TreeDiff::diff_against_index(&temp_dir);
+        let diff = diff_against_index(&temp_dir);
         assert_eq!(
             diff,
             TreeDiff {
@@ -136,7 +371,7 @@ mod tests {
 
         let new_file = "hello/dir/name.txt";
         stage_file(repo_path, Path::new(new_file));
-        let diff = TreeDiff::diff_against_index(&temp_dir);
+        let diff = diff_against_index(&temp_dir);
         assert_eq!(
             diff,
             TreeDiff {
@@ -160,7 +395,7 @@ mod tests {
         let mut index = repo.index().unwrap();
         index.remove_path(Path::new(names[1])).unwrap();
         index.write().unwrap();
-        let diff = TreeDiff::diff_against_index(&temp_dir);
+        let diff = diff_against_index(&temp_dir);
         assert_eq!(
             diff,
             TreeDiff {
@@ -173,8 +408,101 @@ mod tests {
     }
 
     #[test]
-    #[should_panic(expected = "Unsupported index status WT_NEW")]
-    fn test_unsupported_status_from_libgit2() {
-        TreeDiff::git2_status_to_treediff_status(git2::Status::WT_NEW);
+    fn test_get_tree_diff_with_cache_tree() {
+        let names = vec!["one.baz", "a/nested/file", "a/other/file", "b/file"];
+        let files = names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        let repo_path = temp_dir.to_str().unwrap();
+        test_repo(repo_path, &files);
+
+        stage_file(repo_path, Path::new("a/nested/file"));
+        stage_file(repo_path, Path::new("a/new_dir/new_file"));
+
+        // Writing the tree populates the cache tree, the staged changes are part of it
+        let repo = Repository::open(repo_path).unwrap();
+        let mut index = repo.index().unwrap();
+        index.write_tree().unwrap();
+        index.write().unwrap();
+        let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        assert!(index.cache_tree().unwrap().oid.is_some());
+
+        let diff = diff_against_index(&temp_dir);
+        assert_eq!(
+            diff,
+            TreeDiff {
+                entries: vec![
+                    StatusEntry {
+                        name: "a/nested/file".to_string(),
+                        state: Status::Modified(None)
+                    },
+                    StatusEntry {
+                        name: "a/new_dir/new_file".to_string(),
+                        state: Status::New
+                    }
+                ]
+            }
+        );
+    }
+
+    #[test]
+    fn test_get_tree_diff_deleted_directory() {
+        let names = vec!["one.baz", "a/nested/file", "a/nested/deeper/file"];
+        let files = names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        let repo_path = temp_dir.to_str().unwrap();
+        test_repo(repo_path, &files);
+
+        let repo = Repository::open(repo_path).unwrap();
+        let mut index = repo.index().unwrap();
+        index.remove_path(Path::new(names[1])).unwrap();
+        index.remove_path(Path::new(names[2])).unwrap();
+        index.write().unwrap();
+        let diff = diff_against_index(&temp_dir);
+        assert_eq!(
+            diff,
+            TreeDiff {
+                entries: vec![
+                    StatusEntry {
+                        name: names[2].to_string(),
+                        state: Status::Deleted
+                    },
+                    StatusEntry {
+                        name: names[1].to_string(),
+                        state: Status::Deleted
+                    }
+                ]
+            }
+        );
+    }
+
+    #[test]
+    fn test_get_tree_diff_limited_to_pathspec() {
+        let names = vec!["one.baz", "a/nested/file", "a/other/file", "b/file"];
+        let files = names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        let repo_path = temp_dir.to_str().unwrap();
+        test_repo(repo_path, &files);
+        for name in &[
+            "one.baz",
+            "a/nested/file",
+            "a/other/file",
+            "a/new.c",
+            "b/file",
+        ] {
+            stage_file(repo_path, Path::new(name));
+        }
+
+        let repo = Repository::open(repo_path).unwrap();
+        let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+        let diff_names = |specs: &[&str]| {
+            let pathspec = Pathspec::new("", specs).unwrap();
+            let diff = TreeDiff::diff_against_index_with_pathspec(&repo, &index, Some(&pathspec));
+            diff.entries.into_iter().map(|e| e.name).collect::<Vec<_>>()
+        };
+        assert_eq!(diff_names(&["a/nested"]), ["a/nested/file"]);
+        assert_eq!(diff_names(&["a/*.c", "b"]), ["a/new.c", "b/file"]);
+        assert_eq!(diff_names(&["*file"]).len(), 3);
     }
 }
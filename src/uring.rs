@@ -0,0 +1,470 @@
+/*
+ *          Copyright Nick G. 2021.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE or copy at
+ *          https://www.boost.org/LICENSE_1_0.txt)
+ */
+
+// A minimal io_uring, just enough to submit a batch of `statx` or `openat` calls and wait for
+// all of them.  On a slow or network file system the calls of a batch are in flight together
+// rather than each waiting on the one before.
+//
+// Each thread gets a ring of its own the first time it submits.  When a ring can't be set up,
+// an old kernel, or io_uring disabled by `kernel.io_uring_disabled` or a seccomp filter, the
+// functions return `None` and the caller makes the calls itself.  The layouts and constants are
+// those of linux/io_uring.h.
+
+use std::cell::RefCell;
+use std::ffi::CString;
+use std::io;
+use std::mem;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{FromRawFd, OwnedFd, RawFd};
+use std::path::Path;
+use std::ptr;
+use std::sync::atomic::{AtomicU32, Ordering};
+
+// The most calls in flight on one ring
+const RING_ENTRIES: u32 = 256;
+
+const IORING_OP_OPENAT: u8 = 18;
+const IORING_OP_STATX: u8 = 21;
+
+const IORING_ENTER_GETEVENTS: u32 = 1;
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x8000000;
+const IORING_OFF_SQES: libc::off_t = 0x10000000;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+// A submission queue entry, with the fields named for the calls made here
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    op_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    file_index: u32,
+    addr3: u64,
+    pad: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+// A mapping of part of a ring into memory
+struct Mapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Mapping {
+    fn new(fd: RawFd, len: usize, offset: libc::off_t) -> io::Result<Mapping> {
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_POPULATE,
+                fd,
+                offset,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mapping {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    // The `T` at `offset` bytes into the mapping
+    fn at<T>(&self, offset: u32) -> *mut T {
+        unsafe { self.ptr.add(offset as usize) as *mut T }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+    }
+}
+
+struct Ring {
+    // Declared before `fd` so the mappings are dropped first
+    sq_ring: Mapping,
+    cq_ring: Mapping,
+    sqes: Mapping,
+    params: Params,
+    fd: OwnedFd,
+}
+
+impl Ring {
+    fn new() -> io::Result<Ring> {
+        let mut params = Params::default();
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_setup,
+                RING_ENTRIES,
+                &mut params as *mut Params,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd as RawFd) };
+        let raw_fd = std::os::unix::io::AsRawFd::as_raw_fd(&fd);
+        let sq_len = params.sq_off.array as usize + params.sq_entries as usize * 4;
+        let cq_len = params.cq_off.cqes as usize + params.cq_entries as usize * 16;
+        let sqes_len = params.sq_entries as usize * mem::size_of::<Sqe>();
+        Ok(Ring {
+            sq_ring: Mapping::new(raw_fd, sq_len, IORING_OFF_SQ_RING)?,
+            cq_ring: Mapping::new(raw_fd, cq_len, IORING_OFF_CQ_RING)?,
+            sqes: Mapping::new(raw_fd, sqes_len, IORING_OFF_SQES)?,
+            params,
+            fd,
+        })
+    }
+
+    // Submits `sqes`, at most the size of the ring, and waits for them all to complete.  The
+    // result of each is put in `results` in the same order, a negative errno on failure.  When
+    // waiting fails the kernel may still write to the buffers of the calls, so the ring must not
+    // be used again.
+    fn submit_and_wait(&mut self, sqes: &[Sqe], results: &mut [i32]) -> io::Result<()> {
+        let count = sqes.len() as u32;
+        let sq_off = &self.params.sq_off;
+        let sq_mask = unsafe { *self.sq_ring.at::<u32>(sq_off.ring_mask) };
+        let sq_tail = unsafe { &*self.sq_ring.at::<AtomicU32>(sq_off.tail) };
+        let array = self.sq_ring.at::<u32>(sq_off.array);
+        let entries = self.sqes.at::<Sqe>(0);
+        let mut tail = sq_tail.load(Ordering::Relaxed);
+        for (number, sqe) in sqes.iter().enumerate() {
+            let index = tail & sq_mask;
+            unsafe {
+                *entries.add(index as usize) = Sqe {
+                    user_data: number as u64,
+                    ..*sqe
+                };
+                *array.add(index as usize) = index;
+            }
+            tail = tail.wrapping_add(1);
+        }
+        sq_tail.store(tail, Ordering::Release);
+
+        let mut to_submit = count;
+        let mut completed = 0;
+        while completed < count {
+            let entered = unsafe {
+                libc::syscall(
+                    libc::SYS_io_uring_enter,
+                    std::os::unix::io::AsRawFd::as_raw_fd(&self.fd),
+                    to_submit,
+                    count - completed,
+                    IORING_ENTER_GETEVENTS,
+                    ptr::null::<libc::sigset_t>(),
+                    0,
+                )
+            };
+            if entered < 0 {
+                let error = io::Error::last_os_error();
+                match error.raw_os_error() {
+                    Some(libc::EINTR) | Some(libc::EAGAIN) | Some(libc::EBUSY) => {}
+                    _ => return Err(error),
+                }
+            } else {
+                to_submit -= entered as u32;
+            }
+            completed += self.reap(results);
+        }
+        Ok(())
+    }
+
+    // Takes the completions off the completion queue, returning how many there were
+    fn reap(&mut self, results: &mut [i32]) -> u32 {
+        let cq_off = &self.params.cq_off;
+        let cq_mask = unsafe { *self.cq_ring.at::<u32>(cq_off.ring_mask) };
+        let cq_head = unsafe { &*self.cq_ring.at::<AtomicU32>(cq_off.head) };
+        let cq_tail = unsafe { &*self.cq_ring.at::<AtomicU32>(cq_off.tail) };
+        let cqes = self.cq_ring.at::<Cqe>(cq_off.cqes);
+        let mut head = cq_head.load(Ordering::Relaxed);
+        let tail = cq_tail.load(Ordering::Acquire);
+        let mut count = 0;
+        while head != tail {
+            let cqe = unsafe { *cqes.add((head & cq_mask) as usize) };
+            results[cqe.user_data as usize] = cqe.res;
+            head = head.wrapping_add(1);
+            count += 1;
+        }
+        cq_head.store(head, Ordering::Release);
+        count
+    }
+}
+
+thread_local! {
+    // `None` until the thread first submits, then the ring or why there couldn't be one
+    static RING: RefCell<Option<io::Result<Ring>>> = const { RefCell::new(None) };
+}
+
+// Submits `sqes` on this thread's ring, as many at a time as the ring takes, returning the result
+// of each.  When there is no ring nothing is submitted and the error is empty.  When the ring
+// fails part way through, the error has the results of the calls which completed, the others
+// are `-ECANCELED`.  The failed ring is dropped, so the rest of the calls on this thread are made
+// without io_uring rather than on a ring which could still have completions of the failed batch.
+fn submit_all(sqes: &[Sqe]) -> Result<Vec<i32>, Vec<i32>> {
+    RING.with(|ring| {
+        let mut ring = ring.borrow_mut();
+        let mut results = vec![-libc::ECANCELED; sqes.len()];
+        let submitted = match ring.get_or_insert_with(Ring::new) {
+            Ok(ring) => submit_chunks(ring, sqes, &mut results),
+            Err(_) => return Err(vec![]),
+        };
+        match submitted {
+            Ok(()) => Ok(results),
+            Err(error) => {
+                *ring = Some(Err(error));
+                Err(results)
+            }
+        }
+    })
+}
+
+fn submit_chunks(ring: &mut Ring, sqes: &[Sqe], results: &mut [i32]) -> io::Result<()> {
+    let chunk_size = RING_ENTRIES as usize;
+    for start in (0..sqes.len()).step_by(chunk_size) {
+        let end = (start + chunk_size).min(sqes.len());
+        ring.submit_and_wait(&sqes[start..end], &mut results[start..end])?;
+    }
+    Ok(())
+}
+
+/// Whether io_uring can be used on this thread.
+pub fn is_available() -> bool {
+    RING.with(|ring| {
+        let mut ring = ring.borrow_mut();
+        ring.get_or_insert_with(Ring::new).is_ok()
+    })
+}
+
+fn result<T>(res: i32, value: impl FnOnce(i32) -> T) -> io::Result<T> {
+    match res < 0 {
+        true => Err(io::Error::from_raw_os_error(-res)),
+        false => Ok(value(res)),
+    }
+}
+
+/// `statx` of each of `names` relative to the directory `dir_fd`, in one batch.
+///
+/// `None` when io_uring isn't available, the calls haven't been made.
+pub fn statx_all(
+    dir_fd: RawFd,
+    names: &[&str],
+    flags: i32,
+    mask: u32,
+) -> Option<Vec<io::Result<libc::statx>>> {
+    let names: Vec<CString> = names
+        .iter()
+        .map(|n| CString::new(*n).unwrap_or_default())
+        .collect();
+    let mut buffers: Vec<libc::statx> = vec![unsafe { mem::zeroed() }; names.len()];
+    let sqes: Vec<Sqe> = names
+        .iter()
+        .zip(buffers.iter_mut())
+        .map(|(name, buffer)| Sqe {
+            opcode: IORING_OP_STATX,
+            fd: dir_fd,
+            addr: name.as_ptr() as u64,
+            len: mask,
+            off: buffer as *mut libc::statx as u64,
+            op_flags: flags as u32,
+            ..Default::default()
+        })
+        .collect();
+    let results = match submit_all(&sqes) {
+        Ok(results) => results,
+        Err(_) => {
+            // The kernel may not be done with the buffers
+            mem::forget(names);
+            mem::forget(buffers);
+            return None;
+        }
+    };
+    Some(
+        results
+            .into_iter()
+            .zip(buffers)
+            .map(|(res, buffer)| result(res, |_| buffer))
+            .collect(),
+    )
+}
+
+/// Opens each of the directories at `paths`, in one batch.
+///
+/// `None` when io_uring isn't available, the directories haven't been opened.
+pub fn open_dirs(paths: &[&Path]) -> Option<Vec<io::Result<OwnedFd>>> {
+    let paths: Vec<CString> = paths
+        .iter()
+        .map(|p| CString::new(p.as_os_str().as_bytes()).unwrap_or_default())
+        .collect();
+    let flags = libc::O_RDONLY | libc::O_DIRECTORY | libc::O_CLOEXEC;
+    let sqes: Vec<Sqe> = paths
+        .iter()
+        .map(|path| Sqe {
+            opcode: IORING_OP_OPENAT,
+            fd: libc::AT_FDCWD,
+            addr: path.as_ptr() as u64,
+            op_flags: flags as u32,
+            ..Default::default()
+        })
+        .collect();
+    let results = match submit_all(&sqes) {
+        Ok(results) => results,
+        Err(completed) => {
+            // The directories are opened again without io_uring
+            for fd in completed.into_iter().filter(|fd| *fd >= 0) {
+                drop(unsafe { OwnedFd::from_raw_fd(fd) });
+            }
+            mem::forget(paths);
+            return None;
+        }
+    };
+    Some(
+        results
+            .into_iter()
+            .map(|res| result(res, |fd| unsafe { OwnedFd::from_raw_fd(fd) }))
+            .collect(),
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+    use std::os::unix::fs::MetadataExt;
+    use std::os::unix::io::AsRawFd;
+    use temp_testdir::TempDir;
+
+    #[test]
+    fn test_statx_all_matches_metadata() {
+        if !is_available() {
+            return;
+        }
+        let temp_dir = TempDir::default();
+        let names: Vec<String> = (0..600).map(|n| format!("file_{}", n)).collect();
+        for (number, name) in names.iter().enumerate() {
+            fs::write(temp_dir.join(name), vec![b'a'; number]).unwrap();
+        }
+        let mut names: Vec<&str> = names.iter().map(|n| n.as_str()).collect();
+        names.push("missing");
+        let dir = fs::File::open(&temp_dir).unwrap();
+
+        let stats = statx_all(dir.as_raw_fd(), &names, 0, libc::STATX_BASIC_STATS).unwrap();
+        assert_eq!(stats.len(), names.len());
+        for (name, stat) in names.iter().zip(&stats[..600]) {
+            let metadata = fs::metadata(temp_dir.join(name)).unwrap();
+            let stat = stat.as_ref().unwrap();
+            assert_eq!(stat.stx_size, metadata.size());
+            assert_eq!(stat.stx_ino, metadata.ino());
+            assert_eq!(stat.stx_mtime.tv_nsec as i64, metadata.mtime_nsec());
+        }
+        let missing = stats[600].as_ref().err().unwrap();
+        assert_eq!(missing.kind(), io::ErrorKind::NotFound);
+    }
+
+    #[test]
+    fn test_failed_ring_is_not_used_again() {
+        if !is_available() {
+            return;
+        }
+        // A batch which fails part way leaves the ring as if it couldn't be set up
+        RING.with(|ring| *ring.borrow_mut() = Some(Err(io::Error::other("failed"))));
+        assert!(!is_available());
+        let temp_dir = TempDir::default();
+        let dir = fs::File::open(&temp_dir).unwrap();
+        assert!(statx_all(dir.as_raw_fd(), &["file"], 0, libc::STATX_BASIC_STATS).is_none());
+        let path: &Path = temp_dir.as_ref();
+        assert!(open_dirs(&[path]).is_none());
+    }
+
+    #[test]
+    fn test_open_dirs() {
+        if !is_available() {
+            return;
+        }
+        let temp_dir = TempDir::default();
+        fs::create_dir(temp_dir.join("sub")).unwrap();
+        fs::write(temp_dir.join("file"), "").unwrap();
+        let paths = [
+            temp_dir.join("sub"),
+            temp_dir.join("file"),
+            temp_dir.join("none"),
+        ];
+        let paths: Vec<&Path> = paths.iter().map(|p| p.as_path()).collect();
+
+        let opened = open_dirs(&paths).unwrap();
+        assert!(opened[0].is_ok());
+        assert_eq!(
+            opened[1].as_ref().unwrap_err().raw_os_error(),
+            Some(libc::ENOTDIR)
+        );
+        assert_eq!(
+            opened[2].as_ref().unwrap_err().kind(),
+            io::ErrorKind::NotFound
+        );
+    }
+}
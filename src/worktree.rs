@@ -7,17 +7,69 @@
 
 use core::cmp::Ordering;
 use pathdiff::diff_paths;
+use std::borrow::Cow;
 use std::path::{Path, PathBuf};
-use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicBool, Ordering as AtomicOrdering};
+use std::sync::Arc;
 
+use crate::changes::{Changes, DirectoryChanges};
+use crate::convert::Conversion;
+use crate::dir_listing::{file_mode, file_stat, Batching, DirListing, EntryStat};
 use crate::direntry::{DirEntry, FileStat, ObjectType};
 use crate::error::StatusError;
+use crate::fsmonitor::FsMonitor;
+use crate::hash::{file_blob_oid, link_blob_oid, BlobHasher};
+use crate::ignores::Ignores;
+use crate::index::UntrackedDirectory;
+use crate::index_refresh::RefreshedEntry;
+use crate::pathspec::Pathspec;
+use crate::sparse::SparseCheckout;
 use crate::status::{Status, StatusEntry};
-use crate::{Index, TreeDiff};
+use crate::tree::join_path;
+use crate::{Index, IndexFile, TreeDiff};
 use git2::Repository;
-use ignore::gitignore::{Gitignore, GitignoreBuilder};
+use ignore::gitignore::gitconfig_excludes_path;
 use std::fs;
-use std::time::UNIX_EPOCH;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+// The flags git lists untracked files with by default.  Untracked directories are shown rather
+// than their contents, and directories without any untracked files are hidden.
+const DIR_SHOW_OTHER_DIRECTORIES: u32 = 1 << 1;
+const DIR_HIDE_EMPTY_DIRECTORIES: u32 = 1 << 2;
+
+/// Which untracked files are shown, git's `--untracked-files` and `status.showUntrackedFiles`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum UntrackedFiles {
+    /// Untracked files aren't looked for, only the tracked files are compared.
+    No,
+    /// Untracked files are shown, untracked directories are shown rather than their files.
+    Normal,
+    /// Every untracked file is shown, including those in untracked directories.
+    All,
+}
+
+impl UntrackedFiles {
+    /// The mode set by `status.showUntrackedFiles` for the repo at `path`, `Normal` when it
+    /// isn't set.
+    pub fn load(path: &Path) -> UntrackedFiles {
+        let repo = Repository::open(path).ok();
+        let config = repo.and_then(|r| r.config().ok());
+        config
+            .and_then(|c| c.get_string("status.showUntrackedFiles").ok())
+            .and_then(|value| UntrackedFiles::parse(&value))
+            .unwrap_or(UntrackedFiles::Normal)
+    }
+
+    /// The mode named by `value`, as git spells it on the command line or in the config.
+    pub fn parse(value: &str) -> Option<UntrackedFiles> {
+        match value {
+            "no" | "false" => Some(UntrackedFiles::No),
+            "normal" | "true" => Some(UntrackedFiles::Normal),
+            "all" => Some(UntrackedFiles::All),
+            _ => None,
+        }
+    }
+}
 
 #[derive(Debug)]
 pub struct ReadDirEntry {
@@ -25,6 +77,8 @@ pub struct ReadDirEntry {
     pub is_dir: bool,
     pub process: bool,
     pub stat: FileStat,
+    // The file mode as git would record it, 0 when unknown
+    pub mode: u16,
     pub parent_path: Arc<Path>,
     pub depth: usize,
 }
@@ -35,63 +89,372 @@ impl ReadDirEntry {
     }
 }
 
-#[derive(Debug, Default, Clone)]
-struct ReadWorktreeState {
+#[derive(Debug, Clone)]
+struct ReadWorktreeState<'a> {
     path: PathBuf,
-    index: Arc<Index>,
-    changed_files: Arc<Mutex<Vec<StatusEntry>>>,
-    ignores: Vec<Arc<Gitignore>>,
+    index: &'a Index<'a>,
+    changes: Changes,
+    // The changes of the directory being read
+    directory: Arc<DirectoryChanges>,
+    ignores: Ignores,
+    // The untracked cache entry for the directory about to be read
+    untracked: Option<&'a UntrackedDirectory<'a>>,
+    fsmonitor: Option<Arc<FsMonitor>>,
+    sparse: Option<Arc<SparseCheckout>>,
+    stat_check: StatCheck,
+    batching: Batching,
+    untracked_files: UntrackedFiles,
+    // What the status is limited to, `None` once everything in the directory is matched
+    pathspec: Option<Arc<Pathspec>>,
+    hasher: BlobHasher,
+    conversion: Arc<Conversion>,
+}
+
+/// Which parts of the stat data are trusted to change when a file changes.
+///
+/// Comes from `core.fileMode`, `core.trustctime`, `core.checkStat`, and `core.symlinks`.  Only
+/// unix has a change time, inode, and owner to compare, elsewhere they are left out.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct StatCheck {
+    executable_bit: bool,
+    ctime: bool,
+    // With `core.checkStat=minimal` only the whole seconds and the size are compared
+    nanoseconds: bool,
+    inode: bool,
+    symlinks: bool,
+}
+
+impl StatCheck {
+    // The stat checks for the repo at `path`, git's defaults when there's no config
+    fn load(path: &Path) -> StatCheck {
+        let repo = Repository::open(path).ok();
+        let config = repo.and_then(|r| r.config().ok());
+        let get_bool = |name| config.as_ref().and_then(|c| c.get_bool(name).ok());
+        let check_stat = config
+            .as_ref()
+            .and_then(|c| c.get_string("core.checkStat").ok());
+        let minimal = check_stat.as_deref() == Some("minimal");
+        StatCheck {
+            executable_bit: cfg!(unix) && get_bool("core.fileMode").unwrap_or(true),
+            ctime: cfg!(unix) && get_bool("core.trustctime").unwrap_or(true),
+            nanoseconds: !minimal,
+            inode: cfg!(unix) && !minimal,
+            symlinks: get_bool("core.symlinks").unwrap_or(true),
+        }
+    }
+}
+
+// How the work tree is compared with the index
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Engine {
+    // The directories are read and merged with their index entries, one task per directory
+    Walk,
+    // The index entries are stat'ed in chunks, no directory is read
+    Preload,
+}
+
+impl Engine {
+    // The engine for a status of the repo at `path` with `entries` in its index.  Untracked files
+    // can only be found by reading the directories, and a pathspec leaves most of them unread.
+    // An index which fits in one chunk of the preload is left to the walk, which still spreads
+    // its directories over the pool.  Otherwise the index entries are stat'ed directly, unless
+    // git's `core.preloadIndex` is turned off.
+    fn select(
+        path: &Path,
+        untracked_files: UntrackedFiles,
+        pathspec: Option<&Pathspec>,
+        entries: usize,
+    ) -> Engine {
+        let walk_only = untracked_files != UntrackedFiles::No || pathspec.is_some();
+        if walk_only || entries <= PRELOAD_CHUNK {
+            return Engine::Walk;
+        }
+        let repo = Repository::open(path).ok();
+        let config = repo.and_then(|r| r.config().ok());
+        let preload = config.and_then(|c| c.get_bool("core.preloadIndex").ok());
+        match preload.unwrap_or(true) {
+            true => Engine::Preload,
+            false => Engine::Walk,
+        }
+    }
+}
+
+impl<'a> ReadWorktreeState<'a> {
+    // Whether the file system monitor knows the file or directory at the work tree relative
+    // `path` hasn't changed.  Unchanged files don't need their stat data compared.
+    fn is_unchanged(&self, path: impl FnOnce() -> String) -> bool {
+        match &self.fsmonitor {
+            Some(fsmonitor) => !fsmonitor.is_dirty(&path()),
+            None => false,
+        }
+    }
+
+    // Whether the work tree relative `directory` is outside of the sparse checkout cone.  Nothing
+    // under these directories is read, or reported as added or deleted.
+    fn is_outside_cone(&self, directory: &str) -> bool {
+        match &self.sparse {
+            Some(sparse) => !sparse.includes_directory(directory),
+            None => false,
+        }
+    }
+}
+
+// How a directory compares to its entry in the untracked cache
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum CachedDirectory {
+    // The cached untracked files can be used instead of reading the directory
+    Unchanged,
+    // Files have been added or removed, the directory needs to be read
+    Modified,
+    // The exclude file changed, which invalidates the directory and everything below it
+    ExcludesChanged,
 }
 
-fn read_dir(
+// Reads the directory at `path`, `listing` is the directory when it was opened ahead of time
+fn read_dir<'a>(
     path: &Path,
-    read_dir_state: &mut ReadWorktreeState,
+    listing: Option<DirListing>,
+    read_dir_state: &mut ReadWorktreeState<'a>,
     depth: usize,
-    scope: &rayon::Scope,
+    scope: &rayon::Scope<'a>,
 ) {
-    let mut files = vec![];
-    let parent_path = Arc::from(path);
-    for entry in fs::read_dir(path).unwrap() {
-        let entry = entry.unwrap();
-        let metadata = entry.metadata().unwrap();
-        files.push(ReadDirEntry {
-            is_dir: entry.file_type().unwrap().is_dir(),
-            name: entry.file_name().to_str().unwrap().to_string(),
-            process: true,
-            stat: FileStat {
-                mtime: metadata
-                    .modified()
-                    .unwrap()
-                    .duration_since(UNIX_EPOCH)
-                    .unwrap()
-                    .as_secs() as u32,
-                size: metadata.len() as u32,
-            },
-            parent_path: Arc::clone(&parent_path),
-            depth,
-        });
-    }
+    let parent_path: Arc<Path> = Arc::from(path);
+    let relative_path = diff_paths(path, &read_dir_state.path).unwrap();
+    let unix_path = relative_path.to_str().unwrap().replace("\\", "/");
+    read_dir_state.directory = Arc::new(DirectoryChanges::new(&read_dir_state.changes, &unix_path));
+
+    // When the file system monitor knows nothing was added or removed, git's own bookkeeping of
+    // the untracked cache can be trusted without looking at the directory
+    let listing_unchanged = match &read_dir_state.fsmonitor {
+        Some(fsmonitor) => !fsmonitor.is_directory_dirty(&unix_path),
+        None => false,
+    };
+    let cached = read_dir_state.untracked.take();
+    let cached_state = cached.map(|c| match listing_unchanged && c.stat.is_some() {
+        true if !c.check_only => CachedDirectory::Unchanged,
+        _ => compare_untracked_cache(path, c, read_dir_state),
+    });
+    // Only the tracked files which the pathspec matches are compared
+    let tracked_files = read_dir_state.index.entries.get(unix_path.as_str());
+    let tracked_files: Cow<[DirEntry]> = match (tracked_files, &read_dir_state.pathspec) {
+        (Some(entries), Some(pathspec)) => entries
+            .iter()
+            .filter(|e| {
+                let name = join_path(&unix_path, e.name);
+                pathspec.includes(&name, e.object_type.is_directory())
+            })
+            .cloned()
+            .collect(),
+        (entries, _) => Cow::Borrowed(entries.unwrap_or_default()),
+    };
+    let mut files = match cached {
+        Some(cached) if cached_state == Some(CachedDirectory::Unchanged) => {
+            cached_dir_entries(path, cached, read_dir_state, &parent_path, depth)
+        }
+        _ if read_dir_state.untracked_files == UntrackedFiles::No => {
+            tracked_dir_entries(path, &tracked_files, read_dir_state, &parent_path, depth)
+        }
+        _ => {
+            let listing = listing.unwrap_or_else(|| DirListing::open(path).unwrap());
+            list_dir(
+                &listing,
+                &tracked_files,
+                read_dir_state.batching,
+                &parent_path,
+                depth,
+                |name| read_dir_state.is_unchanged(|| join_path(&unix_path, name)),
+            )
+        }
+    };
 
+    // Whether the directory has an ignore file, known from the listing or the untracked cache
+    let has_ignore_file = match cached {
+        Some(cached) if cached_state == Some(CachedDirectory::Unchanged) => {
+            cached.exclude_oid.is_some()
+        }
+        _ => files.iter().any(|f| f.name == ".gitignore"),
+    };
     files = files.into_iter().filter(|f| f.name != ".git").collect();
+    if let Some(pathspec) = &read_dir_state.pathspec {
+        files.retain(|f| pathspec.includes(&join_path(&unix_path, &f.name), f.is_dir));
+    }
     files.sort_by(|a, b| a.name.cmp(&b.name));
-    process_directory(path, read_dir_state, &mut files, scope);
+    process_directory(
+        path,
+        read_dir_state,
+        &mut files,
+        &tracked_files,
+        has_ignore_file,
+        scope,
+    );
+
+    // The files of tracked directories which are gone are deleted, like the preload finds them
+    let pathspec = read_dir_state.pathspec.as_deref();
+    for name in read_dir_state.index.entries.subdirectories(&unix_path) {
+        let directory = join_path(&unix_path, name);
+        if read_dir_state.is_outside_cone(&directory)
+            || pathspec.map_or(false, |p| !p.includes(&directory, true))
+        {
+            continue;
+        }
+        let listed = match files.binary_search_by(|f| f.name.as_str().cmp(name)) {
+            Ok(position) => files[position].is_dir,
+            Err(_) => false,
+        };
+        // Only the directories the untracked cache doesn't know of weren't listed or stat'ed
+        let unlisted = match cached {
+            Some(cached) if cached_state == Some(CachedDirectory::Unchanged) => {
+                let subdirectories = cached.subdirectories.iter().map(|d| d.name);
+                let untracked = cached.untracked.iter().filter_map(|u| u.strip_suffix('/'));
+                !subdirectories.chain(untracked).any(|known| known == name)
+            }
+            _ => false,
+        };
+        let is_dir = || fs::symlink_metadata(path.join(name)).map_or(false, |m| m.is_dir());
+        if !listed && !(unlisted && is_dir()) {
+            process_deleted_directory(&directory, read_dir_state);
+        }
+    }
 
-    let to_process = files.iter().filter(|f| f.is_dir && f.process);
-    for dir in to_process {
-        let path = path.join(&dir.name);
+    let cached = cached.filter(|_| cached_state != Some(CachedDirectory::ExcludesChanged));
+    let to_process: Vec<&ReadDirEntry> = files
+        .iter()
+        .filter(|f| {
+            f.is_dir
+                && f.process
+                && !read_dir_state.is_outside_cone(&join_path(&unix_path, &f.name))
+        })
+        .collect();
+    let paths: Vec<PathBuf> = to_process.iter().map(|d| path.join(&d.name)).collect();
+    let path_refs: Vec<&Path> = paths.iter().map(|p| p.as_path()).collect();
+    // Without untracked files the directories are never listed
+    let listings = match read_dir_state.untracked_files {
+        UntrackedFiles::No => path_refs.iter().map(|_| None).collect(),
+        _ => DirListing::open_all(&path_refs, read_dir_state.batching),
+    };
+    for ((dir, path), listing) in to_process.into_iter().zip(paths).zip(listings) {
         let mut read_dir_state = read_dir_state.clone();
+        read_dir_state.untracked =
+            cached.and_then(|c| c.subdirectories.iter().find(|d| d.name == dir.name));
+        if let Some(pathspec) = &read_dir_state.pathspec {
+            if pathspec.matches(&join_path(&unix_path, &dir.name)) {
+                read_dir_state.pathspec = None;
+            }
+        }
         scope.spawn(move |s| {
-            read_dir(&path, &mut read_dir_state, depth + 1, s);
+            read_dir(&path, listing, &mut read_dir_state, depth + 1, s);
         });
     }
 }
 
+// The number of index entries stat'ed by one task of the preload, git's `THREAD_COST`
+const PRELOAD_CHUNK: usize = 500;
+
+// The entries of one directory which a task of the preload stats
+#[derive(Debug)]
+struct PreloadSlice<'a> {
+    directory: &'a str,
+    entries: &'a [DirEntry<'a>],
+    // The changes of a directory split between tasks, the other directories get theirs when
+    // their task gets to them
+    shared: Option<Arc<DirectoryChanges>>,
+}
+
+// Compares every tracked file with the index without reading any directories, like git's
+// preload of the index.  The index entries are split into chunks of `PRELOAD_CHUNK` which are
+// stat'ed on the scope, a large directory is split between chunks.
+fn preload_index<'a>(read_dir_state: &ReadWorktreeState<'a>, scope: &rayon::Scope<'a>) {
+    let (entries, directories) = read_dir_state.index.entries.parts();
+    let mut chunk = vec![];
+    let mut chunk_length = 0;
+    for (directory, range) in directories.iter().filter(|d| !d.1.is_empty()) {
+        let shared = match range.len() > PRELOAD_CHUNK - chunk_length {
+            true => Some(Arc::new(DirectoryChanges::new(
+                &read_dir_state.changes,
+                directory,
+            ))),
+            false => None,
+        };
+        let mut entries = &entries[range.clone()];
+        while !entries.is_empty() {
+            let (slice, rest) = entries.split_at(entries.len().min(PRELOAD_CHUNK - chunk_length));
+            chunk.push(PreloadSlice {
+                directory,
+                entries: slice,
+                shared: shared.clone(),
+            });
+            chunk_length += slice.len();
+            entries = rest;
+            if chunk_length == PRELOAD_CHUNK {
+                spawn_preload(std::mem::take(&mut chunk), read_dir_state, scope);
+                chunk_length = 0;
+            }
+        }
+    }
+    spawn_preload(chunk, read_dir_state, scope);
+}
+
+fn spawn_preload<'a>(
+    chunk: Vec<PreloadSlice<'a>>,
+    read_dir_state: &ReadWorktreeState<'a>,
+    scope: &rayon::Scope<'a>,
+) {
+    if chunk.is_empty() {
+        return;
+    }
+    let mut read_dir_state = read_dir_state.clone();
+    scope.spawn(move |s| {
+        for slice in chunk {
+            let directory = slice.directory;
+            read_dir_state.directory = slice.shared.unwrap_or_else(|| {
+                Arc::new(DirectoryChanges::new(&read_dir_state.changes, directory))
+            });
+            let parent_path: Arc<Path> = Arc::from(read_dir_state.path.join(directory));
+            let depth = match directory {
+                "" => 1,
+                directory => directory.split('/').count() + 1,
+            };
+            let mut file_changes = vec![];
+            let mut previous_name = None;
+            for entry in slice.entries {
+                // Unmerged files have an entry for each stage
+                if entry.skip_worktree || previous_name == Some(entry.name) {
+                    continue;
+                }
+                previous_name = Some(entry.name);
+                // Submodules are looked at whatever the file system monitor says
+                let name = || join_path(directory, entry.name);
+                if !entry.object_type.is_directory() && read_dir_state.is_unchanged(name) {
+                    continue;
+                }
+                let change = match fs::symlink_metadata(parent_path.join(entry.name)) {
+                    Ok(metadata) => {
+                        let stat = EntryStat {
+                            stat: file_stat(&metadata),
+                            mode: file_mode(&metadata),
+                        };
+                        let name = entry.name.to_string();
+                        let mut dir_entry = read_dir_entry(name, stat, &parent_path, depth);
+                        process_tracked_item(&mut dir_entry, entry, &read_dir_state, s)
+                    }
+                    Err(_) => process_deleted_item(directory, entry),
+                };
+                file_changes.extend(change);
+            }
+            read_dir_state.directory.append(&mut file_changes);
+        }
+    });
+}
+
 /// A worktree of a repo.
 ///
 #[derive(Debug)]
 pub struct WorkTree {
     path: String,
+    /// The changes, in git's path order.
     pub entries: Vec<StatusEntry>,
+    /// The tracked files whose stat data changed but whose contents were found to be unchanged.
+    pub refreshed: Vec<RefreshedEntry>,
 }
 
 impl WorkTree {
@@ -101,131 +464,606 @@ impl WorkTree {
     /// * `path` - The path to a git repo.  This logic will _not_ search up parent directories for
     ///     a git repo
     /// * `index` - The index to compare against
-    pub fn diff_against_index(path: &Path, index: Index) -> Result<WorkTree, StatusError> {
-        let changed_files = Arc::new(Mutex::new(vec![]));
+    pub fn diff_against_index(path: &Path, index: &Index) -> Result<WorkTree, StatusError> {
+        WorkTree::diff_against_index_with_untracked(path, index, UntrackedFiles::load(path))
+    }
+
+    /// Compares an index to the on disk work tree, showing the `untracked_files` rather than
+    /// those of the repo's config.
+    pub fn diff_against_index_with_untracked(
+        path: &Path,
+        index: &Index,
+        untracked_files: UntrackedFiles,
+    ) -> Result<WorkTree, StatusError> {
+        WorkTree::diff_against_index_with_pathspec(path, index, untracked_files, None)
+    }
+
+    /// Compares an index to the on disk work tree like `diff_against_index_with_untracked()`,
+    /// limited to the `pathspec`.  Only the directories with something the pathspec could match
+    /// are read.
+    pub fn diff_against_index_with_pathspec(
+        path: &Path,
+        index: &Index,
+        untracked_files: UntrackedFiles,
+        pathspec: Option<&Pathspec>,
+    ) -> Result<WorkTree, StatusError> {
+        let entries = index.entries.parts().0.len();
+        let engine = Engine::select(path, untracked_files, pathspec, entries);
+        WorkTree::diff_with_engine(path, index, untracked_files, pathspec, engine)
+    }
+
+    fn diff_with_engine(
+        path: &Path,
+        index: &Index,
+        untracked_files: UntrackedFiles,
+        pathspec: Option<&Pathspec>,
+        engine: Engine,
+    ) -> Result<WorkTree, StatusError> {
+        let changes = Changes::default();
 
-        WorkTree::scoped_diff(path, index, &changed_files);
+        let pathspec = pathspec.map(|p| Arc::new(p.clone()));
+        WorkTree::scoped_diff(path, index, &changes, untracked_files, pathspec, engine);
 
+        let changes = changes.take();
         let work_tree = WorkTree {
             path: String::from(path.to_str().unwrap()),
-            entries: changed_files.lock().unwrap().to_vec(),
+            entries: changes.changed,
+            refreshed: changes.refreshed,
         };
         Ok(work_tree)
     }
 
-    fn scoped_diff(path: &Path, index: Index, changed_files: &Arc<Mutex<Vec<StatusEntry>>>) {
-        let (global_ignore, _) = GitignoreBuilder::new("").build_global();
+    fn scoped_diff(
+        path: &Path,
+        index: &Index,
+        changes: &Changes,
+        untracked_files: UntrackedFiles,
+        pathspec: Option<Arc<Pathspec>>,
+        engine: Engine,
+    ) {
         let mut read_dir_state = ReadWorktreeState {
             path: PathBuf::from(path),
-            index: Arc::new(index),
-            changed_files: Arc::clone(changed_files),
-            ignores: vec![Arc::new(global_ignore)],
+            index,
+            changes: changes.clone(),
+            directory: Arc::new(DirectoryChanges::new(changes, "")),
+            ignores: Ignores::root(gitconfig_excludes_path()),
+            // The untracked cache only knows of untracked directories, not the files in them
+            untracked: untracked_cache_root(path, index)
+                .filter(|_| untracked_files == UntrackedFiles::Normal && pathspec.is_none()),
+            fsmonitor: FsMonitor::query(path, index).map(Arc::new),
+            sparse: SparseCheckout::load(path, index).map(Arc::new),
+            stat_check: StatCheck::load(path),
+            batching: Batching::load(path),
+            untracked_files,
+            pathspec,
+            hasher: BlobHasher::default(),
+            conversion: Arc::new(Conversion::load(path)),
         };
 
-        rayon::scope(|s| {
-            read_dir(path, &mut read_dir_state, 1, s);
+        rayon::scope(|s| match engine {
+            Engine::Walk => read_dir(path, None, &mut read_dir_state, 1, s),
+            Engine::Preload => preload_index(&read_dir_state, s),
         });
+        read_dir_state.hasher.wait();
+    }
+}
+
+// The number of entries of a large directory which one task stats and compares, so that the
+// files of a directory with hundreds of thousands of them are spread over the pool
+const DIRECTORY_CHUNK: usize = 4096;
+
+// Maps `f` over the `items` in chunks of `DIRECTORY_CHUNK`, each chunk a task of its own when
+// there's more than one.  The results of each chunk are in the order of the items, they're left
+// for the caller to go through rather than copied into one list.
+fn map_chunks<T: Sync, R: Send, F: Fn(&[T]) -> Vec<R> + Sync>(items: &[T], f: F) -> Vec<Vec<R>> {
+    if items.len() <= DIRECTORY_CHUNK {
+        return vec![f(items)];
+    }
+    let mut results: Vec<Vec<R>> = items.chunks(DIRECTORY_CHUNK).map(|_| vec![]).collect();
+    let f = &f;
+    rayon::scope(|s| {
+        for (chunk, result) in items.chunks(DIRECTORY_CHUNK).zip(results.iter_mut()) {
+            s.spawn(move |_| *result = f(chunk));
+        }
+    });
+    results
+}
+
+fn read_dir_entry(
+    name: String,
+    stat: EntryStat,
+    parent_path: &Arc<Path>,
+    depth: usize,
+) -> ReadDirEntry {
+    ReadDirEntry {
+        is_dir: stat.is_dir(),
+        name,
+        process: true,
+        stat: stat.stat,
+        mode: stat.mode,
+        parent_path: Arc::clone(parent_path),
+        depth,
+    }
+}
+
+// Lists the directory `listing`.  Only the entries which match one of the `tracked_files` are
+// stat'ed, together once the directory has been read and in chunks for a large directory, the
+// others only need to be told apart from directories.  Tracked entries outside of the sparse
+// checkout, or which `is_unchanged` according to the file system monitor, aren't stat'ed either.
+// Entries which are gone by the time they're stat'ed are left out.
+fn list_dir<F: Fn(&str) -> bool>(
+    listing: &DirListing,
+    tracked_files: &[DirEntry],
+    batching: Batching,
+    parent_path: &Arc<Path>,
+    depth: usize,
+    is_unchanged: F,
+) -> Vec<ReadDirEntry> {
+    let listed = listing.entries().unwrap();
+    let mut files = Vec::with_capacity(listed.len());
+    let mut to_stat = vec![];
+    for entry in listed {
+        let compared = match tracked_files.binary_search_by(|e| e.name.cmp(&entry.name)) {
+            Ok(position) => !tracked_files[position].skip_worktree && !is_unchanged(&entry.name),
+            Err(_) => false,
+        };
+        match compared {
+            true => to_stat.push(entry),
+            false => {
+                let is_dir = listing.is_dir(&entry).unwrap();
+                files.push(unchanged_dir_entry(entry.name, is_dir, parent_path, depth));
+            }
+        }
+    }
+    let stats = map_chunks(&to_stat, |chunk| listing.stat_all(chunk, batching));
+    for (entry, stat) in to_stat.into_iter().zip(stats.into_iter().flatten()) {
+        if let Ok(stat) = stat {
+            files.push(read_dir_entry(entry.name, stat, parent_path, depth));
+        }
+    }
+    files
+}
+
+// An entry whose stat data isn't needed, it's untracked or known to be unchanged
+fn unchanged_dir_entry(
+    name: String,
+    is_dir: bool,
+    parent_path: &Arc<Path>,
+    depth: usize,
+) -> ReadDirEntry {
+    ReadDirEntry {
+        is_dir,
+        name,
+        process: true,
+        stat: FileStat::default(),
+        mode: 0,
+        parent_path: Arc::clone(parent_path),
+        depth,
     }
 }
 
-fn process_directory(
+// Whether the work tree `stat` differs from the `recorded` stat data of an index entry in the
+// parts `check` trusts.  Nanoseconds are skipped when git didn't record them.
+fn stat_changed(recorded: &FileStat, stat: &FileStat, check: &StatCheck) -> bool {
+    let time_changed = |recorded: (u32, u32), time: (u32, u32)| {
+        recorded.0 != time.0 || (check.nanoseconds && recorded.1 != 0 && recorded.1 != time.1)
+    };
+    time_changed(recorded.mtime, stat.mtime)
+        || (check.ctime && time_changed(recorded.ctime, stat.ctime))
+        || (check.inode
+            && (recorded.ino != stat.ino || recorded.uid != stat.uid || recorded.gid != stat.gid))
+        || recorded.size != stat.size
+}
+
+// Returns the root of the index's untracked cache when it was recorded for this work tree with
+// the same global excludes and flags this status is going to use.
+fn untracked_cache_root<'a>(
     path: &Path,
-    read_dir_state: &mut ReadWorktreeState,
-    entries: &mut Vec<ReadDirEntry>,
-    scope: &rayon::Scope,
-) {
-    update_ignores(path, &mut read_dir_state.ignores);
+    index: &'a Index<'a>,
+) -> Option<&'a UntrackedDirectory<'a>> {
+    let cache = index.untracked_cache()?;
+    let work_tree = path.to_str()?.replace("\\", "/");
+    let location = format!("Location {}, system ", work_tree.trim_end_matches('/'));
+    let info_exclude = index
+        .path()
+        .parent()
+        .and_then(|git_dir| fs::metadata(git_dir.join("info/exclude")).ok());
+    let excludes_file = gitconfig_excludes_path().and_then(|p| fs::metadata(p).ok());
+
+    let usable = cache.idents.iter().any(|i| i.starts_with(&location))
+        && cache.dir_flags == DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES
+        && cache.exclude_per_dir == ".gitignore"
+        && stat_matches(&cache.info_exclude, info_exclude.as_ref())
+        && stat_matches(&cache.excludes_file, excludes_file.as_ref());
+    match usable {
+        true => cache.root.as_ref(),
+        false => None,
+    }
+}
 
-    let index = &read_dir_state.index;
+fn compare_untracked_cache(
+    path: &Path,
+    cached: &UntrackedDirectory,
+    read_dir_state: &ReadWorktreeState,
+) -> CachedDirectory {
+    let index = read_dir_state.index;
     let relative_path = diff_paths(path, &read_dir_state.path).unwrap();
     let unix_path = relative_path.to_str().unwrap().replace("\\", "/");
+    let index_entries = index.entries.get(unix_path.as_str());
+    if exclude_oid(path, index_entries, read_dir_state) != cached.exclude_oid {
+        return CachedDirectory::ExcludesChanged;
+    }
 
-    let index_dir_entry = index.entries.get(&unix_path);
+    let metadata = fs::symlink_metadata(path).ok();
+    match cached.stat {
+        Some(stat)
+            if !cached.check_only
+                && metadata.is_some()
+                && stat_matches(&stat, metadata.as_ref())
+                && !is_racy(&stat, index.modified()) =>
+        {
+            CachedDirectory::Unchanged
+        }
+        _ => CachedDirectory::Modified,
+    }
+}
 
-    match index_dir_entry {
-        // None happens when dealing with an empty repo, normally we don't have empty index
-        // directories, since git tracks files not directories
-        None => {}
-        Some(dir_entry) => get_file_deltas(entries, dir_entry, index, read_dir_state, scope),
+// The object id of the exclude file in `path`.  When the exclude file is tracked and unchanged
+// the object id is taken from the index rather than hashing the file.
+fn exclude_oid(
+    path: &Path,
+    index_entries: Option<&[DirEntry]>,
+    read_dir_state: &ReadWorktreeState,
+) -> Option<[u8; 20]> {
+    let exclude_file = path.join(".gitignore");
+    let metadata = fs::symlink_metadata(&exclude_file).ok()?;
+    let stat = file_stat(&metadata);
+    let tracked = index_entries
+        .and_then(|entries| entries.iter().find(|e| e.name == ".gitignore"))
+        .filter(|entry| {
+            !stat_changed(&entry.stat, &stat, &read_dir_state.stat_check)
+                && !is_racy(&entry.stat, read_dir_state.index.modified())
+        });
+    if let Some(entry) = tracked {
+        return Some(entry.sha);
+    }
+    blob_oid(&exclude_file, false)
+}
+
+// The object id of the file at `path` as a blob, for a symbolic link the blob is the path it
+// links to.
+fn blob_oid(path: &Path, is_link: bool) -> Option<[u8; 20]> {
+    let oid = match is_link {
+        true => link_blob_oid(path),
+        false => file_blob_oid(path),
+    };
+    oid.ok()
+}
+
+// Compares the stat data git recorded against the current `metadata`, all zeros means the file
+// didn't exist.  Only the modification time and size are compared, the nanoseconds are skipped
+// when git didn't record them.
+fn stat_matches(stat: &FileStat, metadata: Option<&fs::Metadata>) -> bool {
+    let metadata = match metadata {
+        Some(metadata) => metadata,
+        None => return *stat == FileStat::default(),
+    };
+    let mtime = match metadata.modified().map(|m| m.duration_since(UNIX_EPOCH)) {
+        Ok(Ok(mtime)) => mtime,
+        _ => return false,
+    };
+    let (seconds, nanoseconds) = stat.mtime;
+    mtime.as_secs() as u32 == seconds
+        && (nanoseconds == 0 || mtime.subsec_nanos() == nanoseconds)
+        && metadata.len() as u32 == stat.size
+}
+
+// A file or directory modified in the same instant the index was written could have changed
+// again without its modification time changing.
+pub(crate) fn is_racy(stat: &FileStat, index_modified: Option<SystemTime>) -> bool {
+    let index_mtime = match index_modified.map(|m| m.duration_since(UNIX_EPOCH)) {
+        Some(Ok(mtime)) => mtime,
+        _ => return true,
+    };
+    let index_seconds = index_mtime.as_secs() as u32;
+    let (seconds, nanoseconds) = stat.mtime;
+    index_seconds < seconds
+        || (index_seconds == seconds
+            && (nanoseconds == 0 || index_mtime.subsec_nanos() <= nanoseconds))
+}
+
+// Lists an unchanged directory from the index and the untracked cache instead of reading it.
+// The tracked files still need their stat data, so each one is looked up on its own.  The cached
+// untracked files and directories are reported as new right away, they were already checked
+// against the ignore rules when git cached them.
+fn cached_dir_entries(
+    path: &Path,
+    cached: &UntrackedDirectory,
+    read_dir_state: &ReadWorktreeState,
+    parent_path: &Arc<Path>,
+    depth: usize,
+) -> Vec<ReadDirEntry> {
+    let index = read_dir_state.index;
+    let relative_path = diff_paths(path, &read_dir_state.path).unwrap();
+    let unix_path = relative_path.to_str().unwrap().replace("\\", "/");
+    let join = |name: &str| join_path(&unix_path, name);
+    let tracked_files: &[DirEntry] = index.entries.get(unix_path.as_str()).map_or(&[], |e| e);
+    let is_tracked_file = |name: &str| tracked_files.binary_search_by(|e| e.name.cmp(name)).is_ok();
+
+    // Files added to the index since the cache was written can still be listed as untracked, and
+    // directories are only known to be tracked from the index
+    let mut tracked_directories: Vec<&str> = vec![];
+    let subdirectories = cached.subdirectories.iter().map(|d| d.name);
+    let untracked_directories = cached.untracked.iter().filter_map(|u| u.strip_suffix('/'));
+    for name in subdirectories.chain(untracked_directories) {
+        let tracked = index.entries.contains_key(join(name).as_str());
+        if tracked && !tracked_directories.contains(&name) {
+            tracked_directories.push(name);
+        }
+    }
+
+    let mut new_files = vec![];
+    for untracked in &cached.untracked {
+        let name = untracked.strip_suffix('/').unwrap_or(untracked);
+        if !tracked_directories.contains(&name) && !is_tracked_file(name) {
+            new_files.push(StatusEntry {
+                name: join(untracked),
+                state: Status::New,
+            });
+        }
+    }
+    read_dir_state.directory.append(&mut new_files);
+
+    let mut names = tracked_names(tracked_files);
+    names.extend(tracked_directories.into_iter().map(|name| (name, true)));
+    stat_entries(path, &unix_path, names, read_dir_state, parent_path, depth)
+}
+
+// Lists a directory from the index alone, when untracked files aren't wanted.  Only the
+// `tracked_files`, those the pathspec matches, and the tracked directories the pathspec could
+// match are stat'ed, the directory itself is never read.  Directories outside of the sparse
+// checkout are absent by design and aren't stat'ed.
+fn tracked_dir_entries(
+    path: &Path,
+    tracked_files: &[DirEntry],
+    read_dir_state: &ReadWorktreeState,
+    parent_path: &Arc<Path>,
+    depth: usize,
+) -> Vec<ReadDirEntry> {
+    let relative_path = diff_paths(path, &read_dir_state.path).unwrap();
+    let unix_path = relative_path.to_str().unwrap().replace("\\", "/");
+    let pathspec = read_dir_state.pathspec.as_deref();
+    let mut names = tracked_names(tracked_files);
+    let subdirectories = read_dir_state.index.entries.subdirectories(&unix_path);
+    let subdirectories = subdirectories.into_iter().filter(|name| {
+        let directory = join_path(&unix_path, name);
+        !read_dir_state.is_outside_cone(&directory)
+            && pathspec.map_or(true, |p| p.includes(&directory, true))
+    });
+    names.extend(subdirectories.map(|name| (name, true)));
+    stat_entries(path, &unix_path, names, read_dir_state, parent_path, depth)
+}
+
+// The names of the `tracked_files` in the work tree along with whether they are directories,
+// submodules are directories
+fn tracked_names<'a>(tracked_files: &[DirEntry<'a>]) -> Vec<(&'a str, bool)> {
+    let mut names: Vec<(&str, bool)> = vec![];
+    for entry in tracked_files.iter().filter(|e| !e.skip_worktree) {
+        // Unmerged files have an entry for each stage
+        if names.last().map(|n| n.0) != Some(entry.name) {
+            names.push((entry.name, entry.object_type == ObjectType::GitLink));
+        }
     }
+    names
 }
 
-fn update_ignores(path: &Path, ignores: &mut Vec<Arc<Gitignore>>) {
-    let ignore_file = path.join(".gitignore");
-    if !ignore_file.exists() {
+// Stats each of the `names` in the directory at `path`, `unix_path` relative to the work tree,
+// one at a time within each chunk.  Names which are gone are left out.
+fn stat_entries(
+    path: &Path,
+    unix_path: &str,
+    names: Vec<(&str, bool)>,
+    read_dir_state: &ReadWorktreeState,
+    parent_path: &Arc<Path>,
+    depth: usize,
+) -> Vec<ReadDirEntry> {
+    map_chunks(&names, |chunk| {
+        chunk
+            .iter()
+            .filter_map(|&(name, is_dir)| {
+                let name = name.to_string();
+                if read_dir_state.is_unchanged(|| join_path(unix_path, &name)) {
+                    return Some(unchanged_dir_entry(name, is_dir, parent_path, depth));
+                }
+                let metadata = fs::symlink_metadata(path.join(&name)).ok()?;
+                let stat = EntryStat {
+                    stat: file_stat(&metadata),
+                    mode: file_mode(&metadata),
+                };
+                Some(read_dir_entry(name, stat, parent_path, depth))
+            })
+            .collect()
+    })
+    .into_iter()
+    .flatten()
+    .collect()
+}
+
+fn process_directory<'a>(
+    path: &Path,
+    read_dir_state: &mut ReadWorktreeState<'a>,
+    entries: &mut Vec<ReadDirEntry>,
+    index_entries: &[DirEntry],
+    has_ignore_file: bool,
+    scope: &rayon::Scope<'a>,
+) {
+    let index = read_dir_state.index;
+    let relative_path = diff_paths(path, &read_dir_state.path).unwrap();
+    let unix_path = relative_path.to_str().unwrap().replace("\\", "/");
+    let ignores = &read_dir_state.ignores;
+    read_dir_state.ignores = enter_directory(ignores, path, &unix_path, has_ignore_file);
+
+    if entries.len() <= DIRECTORY_CHUNK {
+        get_file_deltas(
+            &unix_path,
+            entries,
+            index_entries,
+            index,
+            read_dir_state,
+            scope,
+        );
         return;
     }
-    let mut builder = GitignoreBuilder::new(path);
-    builder.add(ignore_file);
-    let ignore = builder.build().unwrap();
-    ignores.insert(0, Arc::new(ignore));
+
+    // A large directory is compared in chunks, each against the index entries from its first
+    // name up to the first name of the next chunk.  The first and last chunks also take the
+    // deleted entries before and after the listing.
+    let read_dir_state = &*read_dir_state;
+    let mut chunks: Vec<&mut [ReadDirEntry]> = entries.chunks_mut(DIRECTORY_CHUNK).collect();
+    let mut bounds: Vec<usize> = chunks[1..]
+        .iter()
+        .map(|c| index_entries.partition_point(|e| e.name < c[0].name.as_str()))
+        .collect();
+    bounds.insert(0, 0);
+    bounds.push(index_entries.len());
+    rayon::scope(|s| {
+        for (chunk, range) in chunks.drain(..).zip(bounds.windows(2)) {
+            let index_entries = &index_entries[range[0]..range[1]];
+            let unix_path = &unix_path;
+            s.spawn(move |_| {
+                get_file_deltas(
+                    unix_path,
+                    chunk,
+                    index_entries,
+                    index,
+                    read_dir_state,
+                    scope,
+                );
+            });
+        }
+    });
 }
 
-fn get_file_deltas(
-    worktree: &mut Vec<ReadDirEntry>,
+// The ignore rules in effect in the directory at `path`, `unix_path` relative to the work tree,
+// given the `ignores` of the directory above it.  The ignore file isn't read until something in
+// the directory needs to be matched.
+fn enter_directory(
+    ignores: &Ignores,
+    path: &Path,
+    unix_path: &str,
+    has_ignore_file: bool,
+) -> Ignores {
+    let ignore_file = match has_ignore_file {
+        true => Some(path.join(".gitignore")),
+        false => None,
+    };
+    ignores.directory(unix_path, ignore_file)
+}
+
+fn get_file_deltas<'a>(
+    unix_path: &str,
+    worktree: &mut [ReadDirEntry],
     index_entry: &[DirEntry],
-    index: &Arc<Index>,
-    read_dir_state: &ReadWorktreeState,
-    scope: &rayon::Scope,
+    index: &Index,
+    read_dir_state: &ReadWorktreeState<'a>,
+    scope: &rayon::Scope<'a>,
 ) {
-    let file_changes = &read_dir_state.changed_files;
+    let mut file_changes = vec![];
     let mut worktree_iter = worktree.iter_mut();
     let mut index_iter = index_entry.iter();
     let mut worktree_file = worktree_iter.next();
     let mut index_file = index_iter.next();
     while let Some(w_file) = worktree_file {
         match index_file {
-            Some(i_file) => match w_file.name.cmp(&i_file.name) {
+            Some(i_file) => match w_file.name.as_str().cmp(i_file.name) {
                 Ordering::Equal => {
                     if let Some(entry) = process_tracked_item(w_file, i_file, read_dir_state, scope)
                     {
-                        file_changes.lock().unwrap().push(entry);
+                        file_changes.push(entry);
                     }
                     index_file = index_iter.next();
                     worktree_file = worktree_iter.next();
                 }
                 Ordering::Less => {
-                    if let Some(entry) = process_new_item(w_file, index, &read_dir_state.ignores) {
-                        file_changes.lock().unwrap().push(entry);
+                    if let Some(entry) = process_new_item(w_file, index, read_dir_state, scope) {
+                        file_changes.push(entry);
                     }
                     worktree_file = worktree_iter.next();
                 }
                 Ordering::Greater => {
-                    if let Some(entry) = process_deleted_item(i_file) {
-                        file_changes.lock().unwrap().push(entry);
+                    if let Some(entry) = process_deleted_item(unix_path, i_file) {
+                        file_changes.push(entry);
                     }
                     worktree_file = Some(w_file);
                     index_file = index_iter.next();
                 }
             },
             None => {
-                if let Some(entry) = process_new_item(w_file, index, &read_dir_state.ignores) {
-                    file_changes.lock().unwrap().push(entry);
+                if let Some(entry) = process_new_item(w_file, index, read_dir_state, scope) {
+                    file_changes.push(entry);
                 }
                 worktree_file = worktree_iter.next();
             }
         }
     }
     while let Some(i_file) = index_file {
-        if let Some(entry) = process_deleted_item(i_file) {
-            file_changes.lock().unwrap().push(entry);
+        if let Some(entry) = process_deleted_item(unix_path, i_file) {
+            file_changes.push(entry);
         }
         index_file = index_iter.next();
     }
+    read_dir_state.directory.append(&mut file_changes);
 }
 
-fn process_deleted_item(index_entry: &DirEntry) -> Option<StatusEntry> {
+// The deletion of `index_entry` from the work tree relative `directory`
+fn process_deleted_item(directory: &str, index_entry: &DirEntry) -> Option<StatusEntry> {
     // When a submodule is missing it is *not* reported as deleted, it's assumed the user just
-    // hasn't updated the submodules
-    if index_entry.object_type == ObjectType::GitLink {
+    // hasn't updated the submodules.  Entries outside of the sparse checkout aren't expected to
+    // be in the work tree.
+    if index_entry.object_type == ObjectType::GitLink || index_entry.skip_worktree {
         return None;
     }
     Some(StatusEntry {
-        name: index_entry.name.to_string(),
+        name: join_path(directory, index_entry.name),
         state: Status::Deleted,
     })
 }
 
+// The deletion of every entry under the work tree relative `directory`, a tracked directory which
+// isn't in the work tree.  Each directory's deletions are a run of their own, the way the preload
+// of the index reports them.
+fn process_deleted_directory(directory: &str, read_dir_state: &ReadWorktreeState) {
+    let pathspec = read_dir_state.pathspec.as_deref();
+    let (entries, directories) = read_dir_state.index.entries.parts();
+    let own = directories.binary_search_by(|d| d.0.cmp(directory)).ok();
+    let prefix = format!("{}/", directory);
+    let start = directories.partition_point(|d| d.0 < prefix.as_str());
+    let below = directories[start..]
+        .iter()
+        .take_while(|d| d.0.starts_with(&prefix));
+    for (directory, range) in own.map(|p| &directories[p]).into_iter().chain(below) {
+        let mut file_changes = vec![];
+        let mut previous_name = None;
+        for entry in &entries[range.clone()] {
+            // Unmerged files have an entry for each stage
+            if previous_name == Some(entry.name) {
+                continue;
+            }
+            previous_name = Some(entry.name);
+            let name = join_path(directory, entry.name);
+            let unchanged =
+                !entry.object_type.is_directory() && read_dir_state.is_unchanged(|| name.clone());
+            if unchanged || pathspec.map_or(false, |p| !p.matches(&name)) {
+                continue;
+            }
+            file_changes.extend(process_deleted_item(directory, entry));
+        }
+        if !file_changes.is_empty() {
+            DirectoryChanges::new(&read_dir_state.changes, directory).append(&mut file_changes);
+        }
+    }
+}
+
 fn get_relative_entry_path_name(entry: &ReadDirEntry) -> String {
     let path = entry.path();
     let root = path.ancestors().nth(entry.depth).unwrap();
@@ -233,26 +1071,44 @@ fn get_relative_entry_path_name(entry: &ReadDirEntry) -> String {
     relative_path.to_str().unwrap().replace("\\", "/")
 }
 
-fn process_new_item(
+fn process_new_item<'a>(
     dir_entry: &mut ReadDirEntry,
-    index: &Arc<Index>,
-    ignores: &[Arc<Gitignore>],
+    index: &Index,
+    read_dir_state: &ReadWorktreeState<'a>,
+    scope: &rayon::Scope<'a>,
 ) -> Option<StatusEntry> {
-    let mut name = get_relative_entry_path_name(dir_entry);
+    let name = get_relative_entry_path_name(dir_entry);
     if dir_entry.is_dir {
-        if index.entries.contains_key(&name) {
+        if index.entries.contains_key(name.as_str()) {
             return None;
         }
         dir_entry.process = false;
     }
 
-    if is_ignored(dir_entry, &name, ignores) {
+    let untracked_files = read_dir_state.untracked_files;
+    if untracked_files == UntrackedFiles::No
+        || read_dir_state.ignores.is_ignored(&name, dir_entry.is_dir)
+    {
         return None;
     }
 
-    // Done after ignore as ignore doesn't handle trailing "/"
     if dir_entry.is_dir {
-        name.push('/');
+        let path = dir_entry.path();
+        // Showing all untracked files walks into untracked directories like any other, except
+        // for other repositories which are only ever shown as a directory.  So does a pathspec
+        // which could match something under the directory but not the directory itself.
+        let expand = match &read_dir_state.pathspec {
+            Some(pathspec) => !pathspec.matches(&name),
+            None => untracked_files == UntrackedFiles::All,
+        };
+        if expand && !path.join(".git").exists() {
+            dir_entry.process = true;
+            return None;
+        }
+        // An untracked directory is only shown when it has a file which isn't ignored, which is
+        // found out on the scope so the walk carries on
+        UntrackedProbe::spawn(path, name, read_dir_state, scope);
+        return None;
     }
 
     Some(StatusEntry {
@@ -261,81 +1117,107 @@ fn process_new_item(
     })
 }
 
-fn is_ignored(entry: &mut ReadDirEntry, name: &str, ignores: &[Arc<Gitignore>]) -> bool {
-    let is_dir = entry.is_dir;
-    for ignore in ignores {
-        let matched = ignore.matched_path_or_any_parents(name, is_dir);
-
-        // Whitelisting happens when a pattern is added back to valid files via the preceding "!"
-        if matched.is_whitelist() {
-            return false;
-        }
-        if matched.is_ignore() {
-            return true;
-        }
-    }
-
-    // For directories, we need to see if there are any files in the directory that
-    // aren't ignored.
-    if is_dir {
-        let path = entry.path();
-        let root = path.ancestors().nth(entry.depth).unwrap();
-        let ignores = ignores.to_vec();
-        return !directory_has_one_trackable_file(&root, &path, ignores);
-    }
-    false
-}
-
-fn directory_has_one_trackable_file(
-    root: &Path,
-    dir: &Path,
-    mut ignores: Vec<Arc<Gitignore>>,
-) -> bool {
-    update_ignores(dir, &mut ignores);
-    for entry in fs::read_dir(dir).unwrap() {
-        let entry = entry.unwrap();
-        let path = entry.path();
-        let is_dir = entry.file_type().unwrap().is_dir();
-        if !is_dir {
-            let relative_path = diff_paths(&path, root).unwrap();
-            let name = relative_path.to_str().unwrap().replace("\\", "/");
-            let mut ignored = false;
-            for ignore in &ignores {
-                let matched = ignore.matched_path_or_any_parents(&name, false);
-                if matched.is_whitelist() {
-                    ignored = false;
-                    break;
-                }
-                if matched.is_ignore() {
-                    ignored = true;
-                    break;
-                }
+// Looks for a file which isn't ignored in an untracked directory.  Each directory below it is
+// looked in by a task of its own on the rayon scope, the first task to find a file stops the
+// others from reading any more directories.  Once the last of the tasks is done the directory is
+// added to the changes of the directory it's in, when a file was found.
+//
+// Each untracked directory is only ever looked in by one probe, the walk doesn't go into
+// untracked directories and the probes of different directories don't overlap, so there's
+// nothing to remember between them.
+#[derive(Debug)]
+struct UntrackedProbe {
+    found: AtomicBool,
+    // The work tree relative path of the untracked directory
+    name: String,
+    directory: Arc<DirectoryChanges>,
+}
+
+impl UntrackedProbe {
+    fn spawn<'a>(
+        path: PathBuf,
+        name: String,
+        read_dir_state: &ReadWorktreeState<'a>,
+        scope: &rayon::Scope<'a>,
+    ) {
+        let probe = Arc::new(UntrackedProbe {
+            found: AtomicBool::new(false),
+            name: name.clone(),
+            directory: Arc::clone(&read_dir_state.directory),
+        });
+        let ignores = read_dir_state.ignores.clone();
+        scope.spawn(move |s| probe.look_in(path, name, ignores, s));
+    }
+
+    // Looks in the directory at `path`, `unix_path` relative to the work tree, whose parent has
+    // the `ignores`
+    fn look_in<'a>(
+        self: Arc<Self>,
+        path: PathBuf,
+        unix_path: String,
+        ignores: Ignores,
+        scope: &rayon::Scope<'a>,
+    ) {
+        if self.found.load(AtomicOrdering::Relaxed) {
+            return;
+        }
+        let listing = match DirListing::open(&path) {
+            Ok(listing) => listing,
+            Err(_) => return,
+        };
+        let entries = listing.entries().unwrap_or_default();
+        let has_ignore_file = entries.iter().any(|e| e.name == ".gitignore");
+        let ignores = enter_directory(&ignores, &path, &unix_path, has_ignore_file);
+        let mut subdirectories = vec![];
+        for entry in entries {
+            let is_dir = listing.is_dir(&entry).unwrap_or(false);
+            let name = join_path(&unix_path, &entry.name);
+            if ignores.is_ignored(&name, is_dir) {
+                continue;
             }
-            if !ignored {
-                return true;
+            match is_dir {
+                true => subdirectories.push((entry.name, name)),
+                false => {
+                    self.found.store(true, AtomicOrdering::Relaxed);
+                    return;
+                }
             }
-        } else {
+        }
+        // Only once none of the files count are the directories looked in
+        for (entry_name, name) in subdirectories {
+            let probe = Arc::clone(&self);
+            let path = path.join(entry_name);
             let ignores = ignores.clone();
-            if directory_has_one_trackable_file(root, &path, ignores) {
-                return true;
-            }
+            scope.spawn(move |s| probe.look_in(path, name, ignores, s));
         }
     }
-    false
 }
 
-fn submodule_status(
+impl Drop for UntrackedProbe {
+    fn drop(&mut self) {
+        if *self.found.get_mut() {
+            self.directory.push(StatusEntry {
+                name: format!("{}/", self.name),
+                state: Status::New,
+            });
+        }
+    }
+}
+
+fn submodule_status<'a>(
     dir_entry: &ReadDirEntry,
     index_entry: &DirEntry,
-    read_dir_state: &ReadWorktreeState,
-    scope: &rayon::Scope,
+    read_dir_state: &ReadWorktreeState<'a>,
+    scope: &rayon::Scope<'a>,
 ) {
     let name = get_relative_entry_path_name(dir_entry);
     let path = dir_entry.path();
     let sha = index_entry.sha.to_vec();
-    let changed_clone = Arc::clone(&read_dir_state.changed_files);
+    let directory = Arc::clone(&read_dir_state.directory);
+    let untracked_files = read_dir_state.untracked_files;
     scope.spawn(move |_s| {
-        submodule_spawned_status(name, path.to_str().unwrap().to_string(), sha, changed_clone)
+        let path = path.to_str().unwrap().to_string();
+        submodule_spawned_status(name, path, sha, directory, untracked_files)
     });
 }
 
@@ -343,17 +1225,21 @@ fn submodule_spawned_status(
     name: String,
     path: String,
     index_sha: Vec<u8>,
-    changed_files: Arc<Mutex<Vec<StatusEntry>>>,
+    directory: Arc<DirectoryChanges>,
+    untracked_files: UntrackedFiles,
 ) {
     let path = Path::new(&path);
     let repo = Repository::open(&path).unwrap();
     let repo_path = repo.path();
     let index_file = repo_path.join("index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
     let workdir = repo.workdir().unwrap();
-    let work_tree_diff = WorkTree::diff_against_index(workdir, index).unwrap();
-    let index_diff = TreeDiff::diff_against_index_with_repo(&repo);
+    // Like git, a submodule's untracked content is only looked for when untracked files are shown
+    let work_tree_diff =
+        WorkTree::diff_against_index_with_untracked(workdir, &index, untracked_files).unwrap();
+    let index_diff = TreeDiff::diff_against_index_with_repo(&repo, &index);
 
     let mut messages = vec![];
     let oid = repo.head().unwrap().peel_to_commit().unwrap().id();
@@ -379,19 +1265,26 @@ fn submodule_spawned_status(
 
     if !messages.is_empty() {
         let message = messages.join(", ");
-        changed_files.lock().unwrap().push(StatusEntry {
+        directory.push(StatusEntry {
             name,
             state: Status::Modified(Some(message)),
         });
     }
 }
 
-fn process_tracked_item(
+fn process_tracked_item<'a>(
     dir_entry: &mut ReadDirEntry,
     index_entry: &DirEntry,
-    read_dir_state: &ReadWorktreeState,
-    scope: &rayon::Scope,
+    read_dir_state: &ReadWorktreeState<'a>,
+    scope: &rayon::Scope<'a>,
 ) -> Option<StatusEntry> {
+    // Whatever is in the work tree for entries outside of the sparse checkout, including the
+    // directories of a sparse index, is left alone
+    if index_entry.skip_worktree {
+        dir_entry.process = false;
+        return None;
+    }
+
     if dir_entry.is_dir {
         // Be sure and don't walk into submodules from here
         dir_entry.process = false;
@@ -399,25 +1292,89 @@ fn process_tracked_item(
         return None;
     }
 
-    if dir_entry.stat != index_entry.stat {
+    if read_dir_state.is_unchanged(|| get_relative_entry_path_name(dir_entry)) {
+        return None;
+    }
+
+    // Like git, a change of type or executable bit, or of a size git recorded, is a change
+    // without needing to look at the contents.  A size of 0 is what git records for an entry
+    // it couldn't trust the stat data of.
+    let check = &read_dir_state.stat_check;
+    let recorded = &index_entry.stat;
+    let changed_bits = dir_entry.mode ^ index_entry.mode;
+    let is_link = dir_entry.mode == 0o120000;
+    let type_changed = match index_entry.mode {
+        0o120000 if !check.symlinks => !is_link && dir_entry.mode & 0o170000 != 0o100000,
+        _ => changed_bits & 0o170000 != 0,
+    };
+    let mode_changed = check.executable_bit && !is_link && changed_bits & 0o100 != 0;
+    let size_changed = recorded.size != 0 && recorded.size != dir_entry.stat.size;
+    if type_changed || mode_changed || size_changed {
         let name = get_relative_entry_path_name(dir_entry);
         return Some(StatusEntry {
             name,
             state: Status::Modified(None),
         });
     }
+
+    let index_modified = read_dir_state.index.modified();
+    if stat_changed(recorded, &dir_entry.stat, check) || is_racy(recorded, index_modified) {
+        verify_contents(dir_entry, index_entry, read_dir_state);
+    }
     None
 }
 
+// Hashes a file whose stat data can't tell if it changed, comparing it to the object id in the
+// index.  Like git the contents are converted first, see `Conversion`.  The hashing is spawned on
+// the hashing pool so the walk of the work tree carries on.
+fn verify_contents(
+    dir_entry: &ReadDirEntry,
+    index_entry: &DirEntry,
+    read_dir_state: &ReadWorktreeState,
+) {
+    let name = get_relative_entry_path_name(dir_entry);
+    let path = dir_entry.path();
+    let is_link = dir_entry.mode == 0o120000;
+    let sha = index_entry.sha;
+    // Only what was read from the work tree replaces what git recorded
+    let stat = match cfg!(unix) {
+        true => dir_entry.stat,
+        false => FileStat {
+            mtime: dir_entry.stat.mtime,
+            size: dir_entry.stat.size,
+            ..index_entry.stat
+        },
+    };
+    let directory = Arc::clone(&read_dir_state.directory);
+    let conversion = Arc::clone(&read_dir_state.conversion);
+    read_dir_state.hasher.spawn(move || {
+        let oid = match is_link {
+            true => link_blob_oid(&path).ok(),
+            false => conversion.blob_oid(&path, &name, &sha).ok(),
+        };
+        match oid == Some(sha) {
+            true => directory.push_refreshed(RefreshedEntry {
+                path: name,
+                sha,
+                stat,
+            }),
+            false => directory.push(StatusEntry {
+                name,
+                state: Status::Modified(None),
+            }),
+        }
+    });
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
-    use git2::{Repository, Signature, Time};
+    use git2::{IndexAddOption, Repository, Signature, Time};
     use std::fs;
     use temp_testdir::TempDir;
 
     // Create a test repo to be able to compare the index to the working tree.
-    pub fn test_repo(path: &Path, files: &Vec<&Path>) -> Index {
+    pub fn test_repo(path: &Path, files: &Vec<&Path>) -> IndexFile {
         let repo = Repository::init(path).unwrap();
         let mut index = repo.index().unwrap();
         let root = repo.path().parent().unwrap();
@@ -443,14 +1400,15 @@ mod tests {
             &[],
         )
         .unwrap();
-        Index::new(&path.join(".git/index")).unwrap()
+        IndexFile::open(&path.join(".git/index")).unwrap()
     }
 
     #[test]
     fn test_diff_against_index_nothing_modified() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         assert_eq!(value.entries, vec![]);
     }
 
@@ -458,10 +1416,11 @@ mod tests {
     fn test_diff_against_index_a_file_modified_size() {
         let entry_name = "simple_file.txt";
         let temp_dir = TempDir::default();
-        let mut index = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let mut index = Index::new(&index_file).unwrap();
         let dir_entries = index.entries.get_mut("").unwrap();
         dir_entries[0].stat.size += 1;
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: entry_name.to_string(),
             state: Status::Modified(None),
@@ -470,13 +1429,115 @@ mod tests {
     }
 
     #[test]
-    fn test_diff_against_index_a_file_modified_mstat() {
+    fn test_diff_against_index_a_file_touched() {
         let entry_name = "simple_file.txt";
         let temp_dir = TempDir::default();
-        let mut index = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let mut index = Index::new(&index_file).unwrap();
         let dir_entries = index.entries.get_mut("").unwrap();
-        dir_entries[0].stat.mtime += 1;
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        dir_entries[0].stat.mtime.0 += 1;
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(value.entries, vec![]);
+    }
+
+    #[test]
+    fn test_diff_against_index_same_size_contents_modified() {
+        let entry_name = "simple_file.txt";
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let index = Index::new(&index_file).unwrap();
+        let contents = fs::read_to_string(temp_dir.join(entry_name)).unwrap();
+        fs::write(temp_dir.join(entry_name), contents.to_uppercase()).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: entry_name.to_string(),
+            state: Status::Modified(None),
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[test]
+    fn test_diff_against_index_rewritten_with_same_contents() {
+        let names = vec!["a.txt", "dir/b.txt"];
+        let files = names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
+        for name in &names {
+            let contents = fs::read(temp_dir.join(name)).unwrap();
+            fs::remove_file(temp_dir.join(name)).unwrap();
+            fs::write(temp_dir.join(name), contents).unwrap();
+        }
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(value.entries, vec![]);
+    }
+
+    #[test]
+    fn test_racily_clean_entry_is_hashed() {
+        let entry_name = "simple_file.txt";
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let mut index = Index::new(&index_file).unwrap();
+        fs::write(temp_dir.join(entry_name), "other contents").unwrap();
+
+        // The index is left with the stat data of the changed file, as if it had changed in the
+        // same instant the index was written
+        let metadata = fs::symlink_metadata(temp_dir.join(entry_name)).unwrap();
+        index.entries.get_mut("").unwrap()[0].stat = file_stat(&metadata);
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: entry_name.to_string(),
+            state: Status::Modified(None),
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[test]
+    fn test_autocrlf_converts_before_hashing() {
+        let names = ["same.txt", "changed.txt"];
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        repo.config()
+            .unwrap()
+            .set_bool("core.autocrlf", true)
+            .unwrap();
+        let mut index = repo.index().unwrap();
+        for name in names.iter() {
+            fs::write(temp_dir.join(name), "one\r\ntwo\r\n").unwrap();
+            index.add_path(Path::new(name)).unwrap();
+        }
+        index.write().unwrap();
+        fs::write(temp_dir.join("changed.txt"), "one\r\nTWO\r\n").unwrap();
+
+        // The index has the blob with LFs and the stat data of the file with CRLFs, which no
+        // longer matches
+        let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+        let mut index = Index::new(&index_file).unwrap();
+        for entry in index.entries.get_mut("").unwrap() {
+            assert_eq!(entry.sha, crate::hash::blob_oid(b"one\ntwo\n"));
+            entry.stat.mtime.0 += 1;
+        }
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: "changed.txt".to_string(),
+            state: Status::Modified(None),
+        }];
+        assert_eq!(value.entries, entries);
+        let refreshed: Vec<&str> = value.refreshed.iter().map(|e| e.path.as_str()).collect();
+        assert_eq!(refreshed, vec!["same.txt"]);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_diff_against_index_executable_bit_changed() {
+        use std::os::unix::fs::PermissionsExt;
+        let entry_name = "simple_file.txt";
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+        let index = Index::new(&index_file).unwrap();
+        let permissions = fs::Permissions::from_mode(0o755);
+        fs::set_permissions(temp_dir.join(entry_name), permissions).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: entry_name.to_string(),
             state: Status::Modified(None),
@@ -484,21 +1545,77 @@ mod tests {
         assert_eq!(value.entries, entries);
     }
 
+    #[test]
+    fn test_stat_changed() {
+        let recorded = FileStat {
+            ctime: (1, 2),
+            mtime: (3, 4),
+            ino: 5,
+            size: 6,
+            ..Default::default()
+        };
+        let full = StatCheck {
+            executable_bit: true,
+            ctime: true,
+            nanoseconds: true,
+            inode: true,
+            symlinks: true,
+        };
+        let minimal = StatCheck {
+            ctime: false,
+            nanoseconds: false,
+            inode: false,
+            ..full
+        };
+        assert!(!stat_changed(&recorded, &recorded, &full));
+        let changes = vec![
+            FileStat {
+                mtime: (3, 5),
+                ..recorded
+            },
+            FileStat {
+                ctime: (2, 2),
+                ..recorded
+            },
+            FileStat { ino: 7, ..recorded },
+        ];
+        for stat in &changes {
+            assert!(stat_changed(&recorded, stat, &full), "{:?}", stat);
+            assert!(!stat_changed(&recorded, stat, &minimal), "{:?}", stat);
+        }
+        let no_nanoseconds = FileStat {
+            mtime: (3, 0),
+            ..recorded
+        };
+        let stat = FileStat {
+            mtime: (3, 9),
+            ..recorded
+        };
+        assert!(!stat_changed(&no_nanoseconds, &stat, &full));
+        let stat = FileStat {
+            size: 7,
+            ..recorded
+        };
+        assert!(stat_changed(&recorded, &stat, &minimal));
+    }
+
     #[test]
     fn test_diff_against_index_deeply_nested() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("dir_1/dir_2/dir_3/file.txt")]);
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let index_file = test_repo(&temp_dir, &vec![Path::new("dir_1/dir_2/dir_3/file.txt")]);
+        let index = Index::new(&index_file).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         assert_eq!(value.entries, vec![]);
     }
 
     #[test]
     fn test_diff_against_modified_index_deeply_nested() {
         let temp_dir = TempDir::default();
-        let mut index = test_repo(&temp_dir, &vec![Path::new("dir_1/dir_2/dir_3/file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("dir_1/dir_2/dir_3/file.txt")]);
+        let mut index = Index::new(&index_file).unwrap();
         let dir_entries = index.entries.get_mut("dir_1/dir_2/dir_3").unwrap();
         dir_entries[0].stat.size += 1;
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: "dir_1/dir_2/dir_3/file.txt".to_string(),
             state: Status::Modified(None),
@@ -506,16 +1623,99 @@ mod tests {
         assert_eq!(value.entries, entries);
     }
 
+    #[test]
+    fn test_large_directory_compared_in_chunks() {
+        let temp_dir = TempDir::default();
+        let repo = Repository::init(&temp_dir).unwrap();
+        let flat = temp_dir.join("flat");
+        fs::create_dir(&flat).unwrap();
+        let count = DIRECTORY_CHUNK * 2 + 10;
+        let name = |number: usize| format!("file_{:05}.txt", number);
+        for number in 0..count {
+            fs::write(flat.join(name(number)), "original").unwrap();
+        }
+        let mut index = repo.index().unwrap();
+        index
+            .add_all(["flat"].iter(), IndexAddOption::DEFAULT, None)
+            .unwrap();
+        index.write().unwrap();
+        let index_file = IndexFile::open(&temp_dir.join(".git/index")).unwrap();
+        let index = Index::new(&index_file).unwrap();
+
+        // Changes on either side of the chunk boundaries and outside of the listing
+        fs::remove_file(flat.join(name(0))).unwrap();
+        fs::remove_file(flat.join(name(count - 1))).unwrap();
+        for number in [DIRECTORY_CHUNK - 1, DIRECTORY_CHUNK, DIRECTORY_CHUNK * 2] {
+            fs::write(flat.join(name(number)), "changed").unwrap();
+        }
+        fs::remove_file(flat.join(name(DIRECTORY_CHUNK + 1))).unwrap();
+        let new_name = format!("file_{:05}a.txt", DIRECTORY_CHUNK);
+        fs::write(flat.join(&new_name), "").unwrap();
+        fs::create_dir(flat.join("untracked")).unwrap();
+        fs::write(flat.join("untracked/new.txt"), "").unwrap();
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let flat_name = |number| format!("flat/{}", name(number));
+        let expected = [
+            flat_name(0),
+            flat_name(DIRECTORY_CHUNK - 1),
+            flat_name(DIRECTORY_CHUNK),
+            format!("flat/{}", new_name),
+            flat_name(DIRECTORY_CHUNK + 1),
+            flat_name(DIRECTORY_CHUNK * 2),
+            flat_name(count - 1),
+            "flat/untracked/".to_string(),
+        ];
+        assert_eq!(entry_names(value), expected);
+    }
+
+    #[test]
+    fn test_list_dir_only_stats_tracked_entries() {
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
+        fs::write(temp_dir.join("new_file.txt"), "stuff").unwrap();
+        fs::create_dir(temp_dir.join("new_dir")).unwrap();
+        let parent_path: Arc<Path> = Arc::from(temp_dir.as_ref());
+        let tracked = &index.entries[""];
+        let sequential = Batching::Sequential;
+
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let mut files = list_dir(&listing, tracked, sequential, &parent_path, 1, |_| false);
+        files.sort_by(|a, b| a.name.cmp(&b.name));
+        let listed: Vec<(&str, bool, u16)> = files
+            .iter()
+            .map(|f| (f.name.as_str(), f.is_dir, f.mode))
+            .collect();
+        assert_eq!(
+            listed,
+            [
+                (".git", true, 0),
+                ("new_dir", true, 0),
+                ("new_file.txt", false, 0),
+                ("simple_file.txt", false, 0o100644)
+            ]
+        );
+        assert_eq!(files[2].stat, FileStat::default());
+        assert_ne!(files[3].stat, FileStat::default());
+
+        // Known to be unchanged by the file system monitor
+        let listing = DirListing::open(&temp_dir).unwrap();
+        let files = list_dir(&listing, tracked, sequential, &parent_path, 1, |_| true);
+        assert!(files.iter().all(|f| f.mode == 0));
+    }
+
     #[test]
     fn test_new_file_in_worktree() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
         let new_file_name = "new_file.txt";
         let new_file = temp_dir.join(new_file_name);
         fs::create_dir_all(new_file.parent().unwrap()).unwrap();
         fs::write(&new_file, "stuff").unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: new_file_name.to_string(),
             state: Status::New,
@@ -526,7 +1726,8 @@ mod tests {
     #[test]
     fn test_multiple_new_files_in_worktree() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
 
         // Putting them in order for the simpler assert
         let new_file_names = vec!["a_file.txt", "z_file.txt"];
@@ -536,7 +1737,7 @@ mod tests {
             fs::write(&new_file, "stuff").unwrap();
         }
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries: Vec<StatusEntry> = new_file_names
             .iter()
             .map(|&n| StatusEntry {
@@ -550,10 +1751,11 @@ mod tests {
     #[test]
     fn test_new_directory_in_worktree_does_not_show() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
         fs::create_dir_all(temp_dir.join("new_dir")).unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         assert_eq!(value.entries, vec![]);
     }
 
@@ -562,10 +1764,11 @@ mod tests {
         let names = vec!["file_1.txt", "file_2.txt", "foo.txt"];
         let files = names.iter().map(|n| Path::new(n)).collect();
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &files);
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
         fs::remove_file(temp_dir.join("file_2.txt")).unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: "file_2.txt".to_string(),
             state: Status::Deleted,
@@ -578,10 +1781,11 @@ mod tests {
         let names = vec!["file_1.txt", "file_2.txt", "foo.txt"];
         let files = names.iter().map(|n| Path::new(n)).collect();
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &files);
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
         fs::remove_file(temp_dir.join("foo.txt")).unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
         let entries = vec![StatusEntry {
             name: "foo.txt".to_string(),
             state: Status::Deleted,
@@ -592,7 +1796,8 @@ mod tests {
     #[test]
     fn test_ignored_file_in_worktree() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
 
         for name in vec!["ignored.txt", ".gitignore"] {
             let file = temp_dir.join(name);
@@ -600,7 +1805,7 @@ mod tests {
             fs::write(&file, "ignore*").unwrap();
         }
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
 
         // Only the gitignore should show up as new
         let entries = vec![StatusEntry {
@@ -613,7 +1818,8 @@ mod tests {
     #[test]
     fn test_ignored_directory_in_worktree() {
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
 
         for name in vec!["foo/ignored.txt", ".gitignore"] {
             let file = temp_dir.join(name);
@@ -621,7 +1827,7 @@ mod tests {
             fs::write(&file, "foo/").unwrap();
         }
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
 
         // Only the gitignore should show up as new
         let entries = vec![StatusEntry {
@@ -636,7 +1842,8 @@ mod tests {
         let seed_names = vec!["simple_file.txt", "foo/.gitignore"];
         let temp_dir = TempDir::default();
         let files = seed_names.iter().map(|n| Path::new(n)).collect();
-        let index = test_repo(&temp_dir, &files);
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
 
         for name in vec![
             "foo/ignored.txt",
@@ -651,7 +1858,7 @@ mod tests {
         let file = temp_dir.join("foo/.gitignore");
         fs::write(&file, "!ignore*").unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
 
         let entries = vec![
             StatusEntry {
@@ -678,7 +1885,8 @@ mod tests {
     fn test_ignored_file_in_untracked_directory() {
         // It looks like if one places a .gitignore in an untracked directory, git still obeys it.
         let temp_dir = TempDir::default();
-        let index = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
 
         for name in vec!["a/nested/dir/ignored.txt", "a/.gitignore"] {
             let file = temp_dir.join(name);
@@ -691,8 +1899,568 @@ mod tests {
         fs::create_dir_all(root_ignore.parent().unwrap()).unwrap();
         fs::write(&root_ignore, ".gitignore").unwrap();
 
-        let value = WorkTree::diff_against_index(&temp_dir, index).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
 
         assert_eq!(value.entries, vec![]);
     }
+
+    #[test]
+    fn test_untracked_directories_with_deeply_nested_files() {
+        let temp_dir = TempDir::default();
+        let index_file = test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index = Index::new(&index_file).unwrap();
+
+        for name in vec![
+            "a/b/c/d/found.txt",
+            "a/b/ignored.o",
+            "a/z/ignored.o",
+            "m/n/ignored.o",
+            "m/o/p/ignored.o",
+            "z/top.txt",
+            "z/deep/ignored.o",
+        ] {
+            let file = temp_dir.join(name);
+            fs::create_dir_all(file.parent().unwrap()).unwrap();
+            fs::write(&file, "").unwrap();
+        }
+        fs::write(temp_dir.join(".gitignore"), "*.o\n.gitignore").unwrap();
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+
+        let entries = vec![
+            StatusEntry {
+                name: "a/".to_string(),
+                state: Status::New,
+            },
+            StatusEntry {
+                name: "z/".to_string(),
+                state: Status::New,
+            },
+        ];
+        assert_eq!(value.entries, entries);
+    }
+
+    // A repo with tracked files, a modified and a deleted file, along with untracked files at the
+    // top, in an untracked directory tree, and in a tracked directory
+    fn untracked_files_repo(temp_dir: &TempDir) -> IndexFile {
+        let files = vec![
+            Path::new("dir/file.txt"),
+            Path::new("dir/nested/file.txt"),
+            Path::new("top.txt"),
+        ];
+        let index_file = test_repo(temp_dir, &files);
+        fs::write(temp_dir.join("dir/nested/file.txt"), "changed").unwrap();
+        fs::remove_file(temp_dir.join("top.txt")).unwrap();
+        for name in vec![
+            "dir/new.txt",
+            "new/a.txt",
+            "new/sub/b.txt",
+            "new/sub/ignored.o",
+            "new/z.o",
+            "untracked.txt",
+        ] {
+            let file = temp_dir.join(name);
+            fs::create_dir_all(file.parent().unwrap()).unwrap();
+            fs::write(&file, "").unwrap();
+        }
+        fs::write(temp_dir.join(".gitignore"), "*.o\n.gitignore").unwrap();
+        index_file
+    }
+
+    fn entry_names(work_tree: WorkTree) -> Vec<String> {
+        work_tree.entries.into_iter().map(|e| e.name).collect()
+    }
+
+    #[test]
+    fn test_no_untracked_files() {
+        let temp_dir = TempDir::default();
+        let index_file = untracked_files_repo(&temp_dir);
+        let index = Index::new(&index_file).unwrap();
+
+        let value =
+            WorkTree::diff_against_index_with_untracked(&temp_dir, &index, UntrackedFiles::No)
+                .unwrap();
+        assert_eq!(entry_names(value), ["dir/nested/file.txt", "top.txt"]);
+    }
+
+    #[test]
+    fn test_normal_untracked_files() {
+        let temp_dir = TempDir::default();
+        let index_file = untracked_files_repo(&temp_dir);
+        let index = Index::new(&index_file).unwrap();
+
+        let value =
+            WorkTree::diff_against_index_with_untracked(&temp_dir, &index, UntrackedFiles::Normal)
+                .unwrap();
+        assert_eq!(
+            entry_names(value),
+            [
+                "dir/nested/file.txt",
+                "dir/new.txt",
+                "new/",
+                "top.txt",
+                "untracked.txt"
+            ]
+        );
+    }
+
+    #[test]
+    fn test_all_untracked_files() {
+        let temp_dir = TempDir::default();
+        let index_file = untracked_files_repo(&temp_dir);
+        let index = Index::new(&index_file).unwrap();
+        fs::create_dir_all(temp_dir.join("new/empty")).unwrap();
+        Repository::init(temp_dir.join("new/nested_repo")).unwrap();
+
+        let value =
+            WorkTree::diff_against_index_with_untracked(&temp_dir, &index, UntrackedFiles::All)
+                .unwrap();
+        assert_eq!(
+            entry_names(value),
+            [
+                "dir/nested/file.txt",
+                "dir/new.txt",
+                "new/a.txt",
+                "new/nested_repo/",
+                "new/sub/b.txt",
+                "top.txt",
+                "untracked.txt"
+            ]
+        );
+    }
+
+    #[test]
+    fn test_pathspec_limits_work_tree() {
+        let temp_dir = TempDir::default();
+        let index_file = untracked_files_repo(&temp_dir);
+        let index = Index::new(&index_file).unwrap();
+        let diff_names = |specs: &[&str]| {
+            let pathspec = Pathspec::new("", specs).unwrap();
+            let normal = UntrackedFiles::Normal;
+            let value = WorkTree::diff_against_index_with_pathspec(
+                &temp_dir,
+                &index,
+                normal,
+                Some(&pathspec),
+            )
+            .unwrap();
+            entry_names(value)
+        };
+
+        assert_eq!(diff_names(&["dir"]), ["dir/nested/file.txt", "dir/new.txt"]);
+        assert_eq!(
+            diff_names(&["dir/nested", "top.txt"]),
+            ["dir/nested/file.txt", "top.txt"]
+        );
+        assert_eq!(diff_names(&["*.txt"]).len(), 6);
+        assert_eq!(diff_names(&["new"]), ["new/"]);
+        // Only what's under the pathspec is shown of an untracked directory
+        assert_eq!(diff_names(&["new/sub"]), ["new/sub/"]);
+        assert_eq!(diff_names(&["new/sub/b.txt"]), ["new/sub/b.txt"]);
+        assert!(diff_names(&["missing"]).is_empty());
+    }
+
+    #[test]
+    fn test_untracked_files_from_config() {
+        let temp_dir = TempDir::default();
+        let index_file = untracked_files_repo(&temp_dir);
+        let index = Index::new(&index_file).unwrap();
+        assert_eq!(UntrackedFiles::load(&temp_dir), UntrackedFiles::Normal);
+
+        let repo = Repository::open(&temp_dir).unwrap();
+        let mut config = repo.config().unwrap();
+        config.set_str("status.showUntrackedFiles", "no").unwrap();
+        assert_eq!(UntrackedFiles::load(&temp_dir), UntrackedFiles::No);
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(entry_names(value), ["dir/nested/file.txt", "top.txt"]);
+
+        config.set_str("status.showUntrackedFiles", "all").unwrap();
+        assert_eq!(UntrackedFiles::load(&temp_dir), UntrackedFiles::All);
+    }
+
+    #[test]
+    fn test_preload_index() {
+        let temp_dir = TempDir::default();
+        let files = vec![
+            Path::new("a/deleted/one.txt"),
+            Path::new("a/deleted/two.txt"),
+            Path::new("a/kept.txt"),
+            Path::new("a/modified.txt"),
+            Path::new("b/gone.txt"),
+            Path::new("b/same.txt"),
+            Path::new("top.txt"),
+        ];
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
+        fs::remove_dir_all(temp_dir.join("a/deleted")).unwrap();
+        fs::write(temp_dir.join("a/modified.txt"), "changed").unwrap();
+        fs::remove_file(temp_dir.join("b/gone.txt")).unwrap();
+        fs::write(temp_dir.join("untracked.txt"), "").unwrap();
+        let no = UntrackedFiles::No;
+        let diff_names = |engine| {
+            let value = WorkTree::diff_with_engine(&temp_dir, &index, no, None, engine).unwrap();
+            entry_names(value)
+        };
+        let expected = [
+            "a/deleted/one.txt",
+            "a/deleted/two.txt",
+            "a/modified.txt",
+            "b/gone.txt",
+        ];
+
+        assert_eq!(diff_names(Engine::Preload), expected);
+        assert_eq!(diff_names(Engine::Walk), expected);
+    }
+
+    #[test]
+    fn test_engines_report_deleted_directories_alike() {
+        let temp_dir = TempDir::default();
+        let files = vec![
+            Path::new("a/deleted/nested/three.txt"),
+            Path::new("a/deleted/one.txt"),
+            Path::new("a/deleted-not.txt"),
+            Path::new("a/kept.txt"),
+            Path::new("c/replaced.txt"),
+            Path::new("top.txt"),
+        ];
+        let index_file = test_repo(&temp_dir, &files);
+        let index = Index::new(&index_file).unwrap();
+        fs::remove_dir_all(temp_dir.join("a/deleted")).unwrap();
+        fs::remove_dir_all(temp_dir.join("c")).unwrap();
+        fs::write(temp_dir.join("c"), "now a file").unwrap();
+        let diff_names = |untracked_files, engine| {
+            let value =
+                WorkTree::diff_with_engine(&temp_dir, &index, untracked_files, None, engine);
+            entry_names(value.unwrap())
+        };
+        let deleted = [
+            "a/deleted/nested/three.txt",
+            "a/deleted/one.txt",
+            "c/replaced.txt",
+        ];
+
+        let no = UntrackedFiles::No;
+        assert_eq!(diff_names(no, Engine::Preload), deleted);
+        assert_eq!(diff_names(no, Engine::Walk), deleted);
+        let with_untracked = diff_names(UntrackedFiles::Normal, Engine::Walk);
+        let expected = [
+            "a/deleted/nested/three.txt",
+            "a/deleted/one.txt",
+            "c",
+            "c/replaced.txt",
+        ];
+        assert_eq!(with_untracked, expected);
+    }
+
+    #[test]
+    fn test_engine_selection() {
+        let temp_dir = TempDir::default();
+        Repository::init(&temp_dir).unwrap();
+        let pathspec = Pathspec::new("", &["dir"]).unwrap();
+        let select = |untracked_files, pathspec, entries| {
+            Engine::select(&temp_dir, untracked_files, pathspec, entries)
+        };
+        let no = UntrackedFiles::No;
+        assert_eq!(select(no, None, 10_000), Engine::Preload);
+        assert_eq!(select(no, None, 10), Engine::Walk);
+        assert_eq!(select(no, Some(&pathspec), 10_000), Engine::Walk);
+        assert_eq!(select(UntrackedFiles::Normal, None, 10_000), Engine::Walk);
+
+        let repo = Repository::open(&temp_dir).unwrap();
+        let mut config = repo.config().unwrap();
+        config.set_bool("core.preloadIndex", false).unwrap();
+        assert_eq!(select(no, None, 10_000), Engine::Walk);
+    }
+
+    fn stat_data_stream(metadata: Option<fs::Metadata>) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![0; 8];
+        if let Some(metadata) = metadata {
+            let mtime = metadata
+                .modified()
+                .unwrap()
+                .duration_since(UNIX_EPOCH)
+                .unwrap();
+            stream.extend(&(mtime.as_secs() as u32).to_be_bytes());
+            stream.extend(&mtime.subsec_nanos().to_be_bytes());
+            stream.extend(&[0u8; 16]);
+            stream.extend(&(metadata.len() as u32).to_be_bytes());
+        } else {
+            stream.extend(&[0u8; 28]);
+        }
+        stream
+    }
+
+    // Adds an untracked cache of the root directory, listing `untracked`, to the index of the
+    // repo at `path`.
+    fn add_untracked_cache(path: &Path, untracked: &[&str]) -> IndexFile {
+        let mut data: Vec<u8> = vec![];
+        let work_tree = path.to_str().unwrap().replace("\\", "/");
+        let ident = format!("Location {}, system Test\0", work_tree);
+        // The ident size as a varint, temporary paths need at most two bytes
+        match ident.len() {
+            size if size < 0x80 => data.push(size as u8),
+            size => data.extend(&[0x80 | ((size >> 7) - 1) as u8, size as u8 & 0x7f]),
+        }
+        data.extend(ident.as_bytes());
+        data.extend(stat_data_stream(
+            fs::metadata(path.join(".git/info/exclude")).ok(),
+        ));
+        data.extend(stat_data_stream(None));
+        data.extend(&6u32.to_be_bytes());
+        data.extend(&[0u8; 40]);
+        data.extend(b".gitignore\0");
+        data.extend(&[1, untracked.len() as u8, 0, 0]);
+        for name in untracked {
+            data.extend(name.as_bytes());
+            data.push(0);
+        }
+        // The valid, check only, and exclude oid bitmaps
+        for bits in &[1u64, 0, 0] {
+            data.extend(ewah_stream(1, *bits));
+        }
+        data.extend(stat_data_stream(fs::symlink_metadata(path).ok()));
+        data.push(0);
+        add_extension(path, b"UNTR", &data)
+    }
+
+    // An EWAH bitmap of up to 64 bits, as one literal word
+    fn ewah_stream(bit_count: u32, bits: u64) -> Vec<u8> {
+        let mut stream: Vec<u8> = vec![];
+        stream.extend(&bit_count.to_be_bytes());
+        stream.extend(&2u32.to_be_bytes());
+        stream.extend(&(1u64 << 33).to_be_bytes());
+        stream.extend(&bits.to_be_bytes());
+        stream.extend(&0u32.to_be_bytes());
+        stream
+    }
+
+    // Adds an extension to the index of the repo at `path`.  The checksum of the index is left
+    // as zeros.
+    fn add_extension(path: &Path, signature: &[u8], data: &[u8]) -> IndexFile {
+        let index_path = path.join(".git/index");
+        let mut contents = fs::read(&index_path).unwrap();
+        contents.truncate(contents.len() - 20);
+        contents.extend(signature);
+        contents.extend(&(data.len() as u32).to_be_bytes());
+        contents.extend(data);
+        contents.extend(&[0u8; 20]);
+        fs::write(&index_path, contents).unwrap();
+        IndexFile::open(&index_path).unwrap()
+    }
+
+    #[test]
+    fn test_untracked_cache_skips_reading_directory() {
+        let entry_name = "simple_file.txt";
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &vec![Path::new(entry_name)]);
+
+        // The untracked file doesn't exist, so it can only come from the cache
+        let index_file = add_untracked_cache(&temp_dir, &["phantom.txt", "phantom_dir/"]);
+        let mut index = Index::new(&index_file).unwrap();
+        let dir_entries = index.entries.get_mut("").unwrap();
+        dir_entries[0].stat.size += 1;
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let mut names: Vec<(String, Status)> = value
+            .entries
+            .into_iter()
+            .map(|e| (e.name, e.state))
+            .collect();
+        names.sort_by(|a, b| a.0.cmp(&b.0));
+        let expected = vec![
+            ("phantom.txt".to_string(), Status::New),
+            ("phantom_dir/".to_string(), Status::New),
+            (entry_name.to_string(), Status::Modified(None)),
+        ];
+        assert_eq!(names, expected);
+    }
+
+    #[test]
+    fn test_untracked_cache_modified_directory_is_read() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = add_untracked_cache(&temp_dir, &["phantom.txt"]);
+        let index = Index::new(&index_file).unwrap();
+        let new_file_name = "new_file.txt";
+        fs::write(temp_dir.join(new_file_name), "stuff").unwrap();
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: new_file_name.to_string(),
+            state: Status::New,
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[test]
+    fn test_untracked_cache_of_another_work_tree_is_ignored() {
+        let temp_dir = TempDir::default();
+        let other_dir = TempDir::default();
+        test_repo(&temp_dir, &vec![Path::new("simple_file.txt")]);
+        let index_file = add_untracked_cache(&temp_dir, &["phantom.txt"]);
+        let index = Index::new(&index_file).unwrap();
+        test_repo(&other_dir, &vec![Path::new("simple_file.txt")]);
+
+        let value = WorkTree::diff_against_index(&other_dir, &index).unwrap();
+        assert_eq!(value.entries, vec![]);
+    }
+
+    // Sets up a `core.fsmonitor` hook which reports `changed`, and adds the token it expects to
+    // the index along with the entries to mark as changed.
+    #[cfg(unix)]
+    fn add_fsmonitor(path: &Path, changed: &str, entries: u32, dirty: u64) -> IndexFile {
+        use std::os::unix::fs::PermissionsExt;
+        let hook = path.join(".git/fsmonitor-hook");
+        let script = format!(
+            "#!/bin/sh\necho \"$@\" > .git/hook_args\nprintf 'token_2\\0{}'\n",
+            changed
+        );
+        fs::write(&hook, script).unwrap();
+        fs::set_permissions(&hook, fs::Permissions::from_mode(0o755)).unwrap();
+        let repo = Repository::open(path).unwrap();
+        let mut config = repo.config().unwrap();
+        config
+            .set_str("core.fsmonitor", hook.to_str().unwrap())
+            .unwrap();
+
+        let mut data: Vec<u8> = vec![];
+        data.extend(&2u32.to_be_bytes());
+        data.extend(b"token_1\0");
+        let bitmap = ewah_stream(entries, dirty);
+        data.extend(&(bitmap.len() as u32).to_be_bytes());
+        data.extend(bitmap);
+        add_extension(path, b"FSMN", &data)
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_fsmonitor_only_changed_paths_are_compared() {
+        let names = vec!["a.txt", "dir/b.txt", "dir/c.txt"];
+        let files = names.iter().map(|n| Path::new(n)).collect();
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &files);
+        let index_file = add_fsmonitor(&temp_dir, "dir/b.txt\\0", 3, 0b100);
+        let index = Index::new(&index_file).unwrap();
+
+        // Every file changes, "dir/c.txt" was marked as changed in the index
+        for name in &names {
+            fs::write(temp_dir.join(name), "a change").unwrap();
+        }
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let mut names: Vec<String> = value.entries.into_iter().map(|e| e.name).collect();
+        names.sort();
+        assert_eq!(names, vec!["dir/b.txt", "dir/c.txt"]);
+        let hook_args = fs::read_to_string(temp_dir.join(".git/hook_args")).unwrap();
+        assert_eq!(hook_args, "2 token_1\n");
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_fsmonitor_new_file() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &vec![Path::new("dir/a.txt")]);
+        let index_file = add_fsmonitor(&temp_dir, "dir/new.txt\\0", 1, 0);
+        let index = Index::new(&index_file).unwrap();
+        fs::write(temp_dir.join("dir/new.txt"), "new").unwrap();
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: "dir/new.txt".to_string(),
+            state: Status::New,
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_fsmonitor_lost_track() {
+        let temp_dir = TempDir::default();
+        test_repo(&temp_dir, &vec![Path::new("a.txt")]);
+        let index_file = add_fsmonitor(&temp_dir, "/\\0", 1, 0);
+        let index = Index::new(&index_file).unwrap();
+        fs::write(temp_dir.join("a.txt"), "a change").unwrap();
+
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: "a.txt".to_string(),
+            state: Status::Modified(None),
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[test]
+    fn test_skip_worktree_file_is_not_deleted() {
+        let temp_dir = TempDir::default();
+        let files = vec![Path::new("a.txt"), Path::new("b.txt")];
+        let index_file = test_repo(&temp_dir, &files);
+        let mut index = Index::new(&index_file).unwrap();
+        index.entries.get_mut("").unwrap()[1].skip_worktree = true;
+        fs::remove_file(temp_dir.join("b.txt")).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        assert_eq!(value.entries, vec![]);
+    }
+
+    #[test]
+    fn test_sparse_cone_skips_directories_outside_cone() {
+        let temp_dir = TempDir::default();
+        let files = vec![
+            Path::new("inside/file.txt"),
+            Path::new("outside/file.txt"),
+            Path::new("top.txt"),
+        ];
+        let index_file = test_repo(&temp_dir, &files);
+        let repo = Repository::open(&temp_dir).unwrap();
+        let mut config = repo.config().unwrap();
+        config.set_bool("core.sparseCheckout", true).unwrap();
+        config.set_bool("core.sparseCheckoutCone", true).unwrap();
+        fs::create_dir_all(temp_dir.join(".git/info")).unwrap();
+        fs::write(
+            temp_dir.join(".git/info/sparse-checkout"),
+            "/*\n!/*/\n/inside/\n",
+        )
+        .unwrap();
+        let mut index = Index::new(&index_file).unwrap();
+        index.entries.get_mut("outside").unwrap()[0].skip_worktree = true;
+
+        fs::write(temp_dir.join("outside/new.txt"), "new").unwrap();
+        fs::write(temp_dir.join("inside/file.txt"), "a modification").unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![StatusEntry {
+            name: "inside/file.txt".to_string(),
+            state: Status::Modified(None),
+        }];
+        assert_eq!(value.entries, entries);
+    }
+
+    #[test]
+    fn test_io_uring_config_gives_same_status() {
+        let temp_dir = TempDir::default();
+        let files = vec![
+            Path::new("dir/file.txt"),
+            Path::new("dir/nested/deeper/file.txt"),
+            Path::new("top.txt"),
+        ];
+        let index_file = test_repo(&temp_dir, &files);
+        let repo = Repository::open(&temp_dir).unwrap();
+        repo.config()
+            .unwrap()
+            .set_bool("winGitStatus.ioUring", true)
+            .unwrap();
+        let index = Index::new(&index_file).unwrap();
+
+        fs::write(temp_dir.join("dir/nested/deeper/file.txt"), "changed").unwrap();
+        fs::remove_file(temp_dir.join("top.txt")).unwrap();
+        let value = WorkTree::diff_against_index(&temp_dir, &index).unwrap();
+        let entries = vec![
+            StatusEntry {
+                name: "dir/nested/deeper/file.txt".to_string(),
+                state: Status::Modified(None),
+            },
+            StatusEntry {
+                name: "top.txt".to_string(),
+                state: Status::Deleted,
+            },
+        ];
+        assert_eq!(value.entries, entries);
+    }
 }
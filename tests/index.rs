@@ -8,7 +8,7 @@ extern crate win_git_status;
 use std::collections::HashMap;
 use std::path::Path;
 use temp_testdir::TempDir;
-use win_git_status::Index;
+use win_git_status::{Index, IndexFile};
 
 mod common;
 
@@ -17,6 +17,7 @@ fn index_has_one_entry() {
     let temp = TempDir::default().permanent();
     common::test_repo(&temp, vec![Path::new("some_file.txt")]);
     let index_file = temp.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
     assert_eq!(index.entries.len(), 1);
     assert_eq!(index.entries.get("").unwrap().len(), 1);
@@ -29,11 +30,12 @@ fn index_has_three_entries_in_order() {
     let temp = TempDir::default().permanent();
     common::test_repo(&temp, files);
     let index_file = temp.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
     assert_eq!(index.entries.len(), 1);
     let dir_list = index.entries.get("").unwrap();
-    let index_names: Vec<&String> = dir_list.iter().map(|e| &e.name).collect();
+    let index_names: Vec<&str> = dir_list.iter().map(|e| e.name).collect();
     names.sort();
     assert_eq!(index_names, names);
 }
@@ -45,6 +47,7 @@ fn index_has_nested_entries_in_order() {
     let temp = TempDir::default().permanent();
     common::test_repo(&temp, files);
     let index_file = temp.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
     let mut file_map = HashMap::new();
@@ -56,9 +59,9 @@ fn index_has_nested_entries_in_order() {
         entry.push(file.file_name().unwrap().to_str().unwrap());
     }
     assert_eq!(index.entries.len(), file_map.len());
-    for (key, value) in index.entries.into_iter() {
-        let index_names: Vec<&String> = value.iter().map(|e| &e.name).collect();
-        assert_eq!(&index_names, file_map.get(key.as_str()).unwrap());
+    for (key, value) in index.entries.iter() {
+        let index_names: Vec<&str> = value.iter().map(|e| e.name).collect();
+        assert_eq!(&index_names, file_map.get(key).unwrap());
     }
 }
 
@@ -69,6 +72,7 @@ fn index_has_more_deeply_nested_entries() {
     let temp = TempDir::default().permanent();
     common::test_repo(&temp, files);
     let index_file = temp.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
     let directories = vec!["", "dir_1", "dir_1/dir_2", "dir_1/dir_2/dir_3"];
@@ -82,3 +86,49 @@ fn index_has_more_deeply_nested_entries() {
         "file.txt"
     );
 }
+
+#[test]
+fn index_version_4_matches_version_2() {
+    let names = vec![
+        "dir_1/dir_2/file_1.txt",
+        "dir_1/dir_2/file_2.txt",
+        "dir_1/file.txt",
+        "top.md",
+    ];
+    let files = names.iter().map(|n| Path::new(n)).collect();
+    let temp = TempDir::default().permanent();
+    let repo = common::test_repo(&temp, files);
+    let index_file = temp.join(".git/index");
+    let v2_file = IndexFile::read(&index_file).unwrap();
+    let v2 = Index::new(&v2_file).unwrap();
+
+    let mut repo_index = repo.index().unwrap();
+    repo_index.set_version(4).unwrap();
+    repo_index.write().unwrap();
+    let v4_file = IndexFile::open(&index_file).unwrap();
+    let v4 = Index::new(&v4_file).unwrap();
+
+    assert_eq!(v4.entries, v2.entries);
+}
+
+#[test]
+fn index_cache_matches_parsed_index() {
+    let names = vec!["dir_1/dir_2/file_1.txt", "dir_1/file.txt", "top.md"];
+    let files = names.iter().map(|n| Path::new(n)).collect();
+    let temp = TempDir::default().permanent();
+    common::test_repo(&temp, files);
+    let index_file = temp.join(".git/index");
+    let cache_file = temp.join(".git/win-git-status/index.cache");
+    let parsed_file = IndexFile::open(&index_file).unwrap();
+    let parsed = Index::new(&parsed_file).unwrap();
+
+    let cold_file = IndexFile::open_cached(&index_file, &cache_file).unwrap();
+    let cold = Index::new(&cold_file).unwrap();
+    assert!(cache_file.exists());
+    let warm_file = IndexFile::open_cached(&index_file, &cache_file).unwrap();
+    let warm = Index::new(&warm_file).unwrap();
+
+    assert_eq!(cold.entries, parsed.entries);
+    assert_eq!(warm.entries, parsed.entries);
+    assert_eq!(warm.cache_tree(), parsed.cache_tree());
+}
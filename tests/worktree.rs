@@ -11,7 +11,7 @@ use std::fs;
 use std::path::Path;
 use temp_testdir::TempDir;
 use win_git_status::status::{Status, StatusEntry};
-use win_git_status::{Index, WorkTree};
+use win_git_status::{Index, IndexFile, WorkTree};
 
 mod common;
 
@@ -31,9 +31,10 @@ fn worktree_diff_with_submodule() {
     common::add_submodule(&super_repo, sub_repo.to_str().unwrap(), "sub_repo_dir");
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     assert_eq!(value.entries, vec![]);
 }
 
@@ -56,9 +57,10 @@ fn submodule_with_new_file() {
     fs::write(&new_sub_repo_file, "stuff").unwrap();
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from("untracked content"))),
@@ -86,9 +88,10 @@ fn submodule_with_modified_files() {
     fs::write(&modified_sub_repo_file, "some modified stuff").unwrap();
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from("modified content"))),
@@ -118,9 +121,10 @@ fn submodule_with_staged_files() {
     common::stage_file(&sub_repo, Path::new("sure.c"));
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from("modified content"))),
@@ -152,9 +156,10 @@ fn submodule_with_new_commits() {
     common::commit_file(&sub_repo, &local_file_path);
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from("new commits"))),
@@ -181,9 +186,10 @@ fn worktree_diff_with_submodule_removed() {
     fs::remove_dir_all(super_repo.join("sub_repo_dir")).unwrap();
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     assert_eq!(value.entries, vec![]);
 }
 
@@ -209,9 +215,10 @@ fn submodule_with_new_file_and_modified_file() {
     fs::write(&modified_sub_repo_file, "some modified stuff").unwrap();
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from("modified content, untracked content"))),
@@ -251,9 +258,10 @@ fn submodule_with_new_commits_staged_files_and_untracked_file() {
     fs::write(&new_sub_repo_file, "stuff").unwrap();
 
     let index_file = super_repo.join(".git/index");
+    let index_file = IndexFile::open(&index_file).unwrap();
     let index = Index::new(&index_file).unwrap();
 
-    let value = WorkTree::diff_against_index(&super_repo, index).unwrap();
+    let value = WorkTree::diff_against_index(&super_repo, &index).unwrap();
     let entries = vec![StatusEntry {
         name: "sub_repo_dir".to_string(),
         state: Status::Modified(Some(String::from(